@@ -8,10 +8,29 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <zmq.h>
+#include <algorithm>
 
 #define IDENT_LEN           INET6_ADDRSTRLEN + 8
 #define METER_TIMEDIFF      1.0/15
 
+// How many buffers the device can get ahead of the audio thread before we drop input
+#define RAW_AUDIO_SLOTS     8
+// The device can't wake us up, so we sleep until this long before its next callback is due, and
+// then look in on its ring buffers this often until it's been
+#define CALLBACK_GUARD_MS   1.0
+#define CALLBACK_POLL_MS    1
+// How much audio each client's jitter buffer can hold
+#define JITTER_BUFFER_MS    320
+// How often the broker looks for clients that have gone quiet
+#define BROKER_CLEAN_MS     5000
+// How often we remind our targets what we'd like forwarded to us, in case they're relays; well inside
+// BROKER_CLEAN_MS, so that they don't forget about us in between
+#define SUBSCRIBE_INTERVAL_MS 2000
+// How often we ask each peer whose audio is to be played at a set time what time it is; eight times as
+// often until we know.  Each ClockSync goes by the last few answers, so this is also how quickly we
+// notice the two clocks wandering apart.
+#define CLOCK_INTERVAL_MS   250
+
 void * zmq_ctx;
 
 void print_peak_level(const float * data, int num_samples, int num_channels) {
@@ -90,26 +109,66 @@ void print_level_meter( const float * buffer, const int num_samples, const int n
     fflush(stdout);
 }
 
+// Called from the device callback when the audio thread has nothing ready for us.  The first
+// time we fade out whatever we last played so we don't click, after that it's just silence.
+static void conceal_output( audio_device * device, float * out, unsigned long num_samples ) {
+    if( device->concealing ) {
+        memset(out, 0, num_samples*device->num_channels*sizeof(float));
+        return;
+    }
+
+    for( unsigned long i=0; i<num_samples; ++i ) {
+        float gain = 1.0f - (float)i/num_samples;
+        for( int k=0; k<device->num_channels; ++k )
+            out[i*device->num_channels + k] = gain*device->last_mixed[i*device->num_channels + k];
+    }
+    device->concealing = true;
+}
+
+// Whether the device callback has been since the audio thread last caught up with it: it's left
+// audio to encode, or taken a buffer we'd mixed (or wanted one, and found none)
+static bool device_has_work( audio_device * device ) {
+    if( device->direction != OUTPUT && device->raw_audio->size() > 0 )
+        return true;
+    return device->direction != INPUT && device->mixed_audio->size() < device->num_prerender;
+}
+
 static int pa_callback( const void *inputBuffer, void *outputBuffer, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags, void *userData ) {
     // First, disable unused variable warnings
     (void) statusFlags;
-    (void) timeInfo;
 
     // Grab our audio_device, which has important things in it
     audio_device * device = (audio_device *)userData;
 
-    // If we've got input data, send it out!
+    // Nothing in here may block, lock, allocate or make a syscall; we only touch our ring buffers.
+    // If we've got input data, hand it off to the audio thread.  If the audio thread has fallen
+    // so far behind that the ring is full, this buffer is simply dropped.
     if( inputBuffer != NULL ) {
-        zmq_send(device->raw_audio_in, inputBuffer, framesPerBuffer*device->num_channels*sizeof(float), 0);
+        device->raw_audio->push((const float *)inputBuffer, timeInfo->inputBufferAdcTime);
     }
 
     if( outputBuffer != NULL ) {
-        // First, send out an empty message, asking for data
-        int empty = 0;
-        zmq_send(device->mixed_audio_in, &empty, 1, 0);
-
-        // Now, receive the response
-        int dec_len = zmq_recv(device->mixed_audio_in, outputBuffer, framesPerBuffer*device->num_channels*sizeof(float), 0);
+        float * out = (float *)outputBuffer;
+        unsigned long out_len = framesPerBuffer*device->num_channels;
+
+        // Grab the next mixed buffer, if the audio thread has one ready for us.  We never wait for it.
+        if( device->mixed_audio->pop(out) ) {
+            // Let the audio thread know when this one will be heard (if the host API knows)
+            device->played->push(timeInfo->outputBufferDacTime);
+
+            // If we had faded out, fade back in so we don't click on the way back either
+            if( device->concealing ) {
+                for( unsigned long i=0; i<framesPerBuffer; ++i ) {
+                    for( int k=0; k<device->num_channels; ++k )
+                        out[i*device->num_channels + k] *= (float)i/framesPerBuffer;
+                }
+                device->concealing = false;
+            }
+            memcpy(device->last_mixed, out, out_len*sizeof(float));
+        } else {
+            device->underruns.fetch_add(1, std::memory_order_relaxed);
+            conceal_output(device, out, framesPerBuffer);
+        }
     }
 
     // The show must go on
@@ -118,41 +177,124 @@ static int pa_callback( const void *inputBuffer, void *outputBuffer, unsigned lo
 
 
 
-// Right now, only covers mono -> multichannel and multichannel -> mono
-// Note; DOES NOT OVERWRITE; adds so that we can mix into buffers directly!
-void mixdown_channels( float * in_data, float * out_data, unsigned int num_samples, unsigned int in_channels, unsigned int out_channels ) {
-    if( in_channels == out_channels ) {
-        // Easiest mixdown ever.
-        for( int i=0; i<num_samples*in_channels; ++i ) {
-            out_data[i] += in_data[i];
+// Mix in a buffer, fading it from gain down to silence over its length
+static void mix_fade_out( float * out, const float * in, unsigned int num_samples, unsigned int num_channels, float gain ) {
+    for( unsigned int i=0; i<num_samples; ++i ) {
+        float g = gain*(1.0f - (float)i/num_samples);
+        for( unsigned int k=0; k<num_channels; ++k )
+            out[i*num_channels + k] += g*in[i*num_channels + k];
+    }
+}
+
+// Create an encoder for something we're about to send out, or NULL if we can't
+static OpusEncoder * create_encoder( unsigned short num_channels, const char * name ) {
+    int err;
+    OpusEncoder * encoder = opus_encoder_create(SAMPLE_RATE, num_channels, OPUS_APPLICATION_AUDIO, &err);
+    if (err != OPUS_OK) {
+        fprintf(stderr, "Could not create Opus encoder with %d channels for %s.\n", num_channels, name);
+        return NULL;
+    }
+    //printf("Created an encoder for %d channels!\n", num_channels);
+
+    // Put enough redundancy into each packet that receivers can rebuild the one before it
+    opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+    opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(opts.expected_loss));
+    return encoder;
+}
+
+// One of the mixes the mixer sends out, and everybody it goes to
+struct mix_group {
+    OpusEncoder * encoder;
+    uint32_t seq, timestamp;
+
+    // The identities of everybody getting this mix this time around, each NULL-terminated
+    std::string dests;
+};
+
+// Send every listener the mix we just made, minus whatever they put into it themselves.  Each listener
+// we're also mixing gets a mix (and so an encoder) of their own; everybody else shares the plain mix.
+static void send_mix_minus( audio_device * device, ClientTable & clients, const float * mix_buff, float * scratch,
+                            unsigned char * encoded_data, const std::vector<std::string> & listeners,
+                            std::map<std::string, mix_group> & groups ) {
+    unsigned int mix_buff_len = device->num_channels*opts.frame_samples;
+
+    // Sort everybody into their groups; the shared one is keyed by ""
+    std::unordered_map<std::string, client_slot *> mixing;
+    for( unsigned int n=0; n<clients.size(); ++n )
+        mixing[clients.active(n)->ident] = clients.active(n);
+    for( auto& itty : groups )
+        itty.second.dests.clear();
+    for( auto& listener : listeners ) {
+        const std::string & key = mixing.count(listener) ? listener : "";
+        auto itty = groups.find(key);
+        if( itty == groups.end() ) {
+            mix_group group = {create_encoder(device->num_channels, device->name), 0, 0, ""};
+            if( group.encoder == NULL )
+                continue;
+            itty = groups.insert(std::make_pair(key, group)).first;
         }
-        return;
+        itty->second.dests.append(listener.c_str(), listener.size() + 1);
     }
-    switch( in_channels ) {
-        case 1:
-            // Just copy input channel to all output channels
-            for( int i=0; i<num_samples; ++i ) {
-                for( int k=0; k<out_channels; ++k )
-                    out_data[i*out_channels + k] += in_data[i];
-            }
-            break;
-        default:
-            // If output is mono, just mix all input channels together
-            if( out_channels == 1 ) {
-                for( int i=0; i<num_samples; ++i ) {
-                    float tmp_mix = 0.0f;
-                    for( int k=0; k<in_channels; ++k )
-                        tmp_mix += in_data[i*in_channels + k];
-                    out_data[i] += tmp_mix/in_channels;
-                }
-            }
 
-            // If output is not mono, I don't know what to do!
-            printf("ERROR: Cannot mixdown %d -> %d!\n", in_channels, out_channels);
-            break;
+    for( auto itty = groups.begin(); itty != groups.end(); ) {
+        mix_group & group = itty->second;
+
+        // Nobody left listening to this one
+        if( group.dests.empty() ) {
+            opus_encoder_destroy(group.encoder);
+            itty = groups.erase(itty);
+            continue;
+        }
+
+        // Take out exactly what this listener put in, whether that was a whole frame or a fade
+        const float * mix = mix_buff;
+        if( itty->first != "" ) {
+            client_slot * c = mixing[itty->first];
+            memcpy(scratch, mix_buff, sizeof(float)*mix_buff_len);
+            if( c->mixed )
+                mixk.accumulate_gain(scratch, c->last_frame, -c->gain, mix_buff_len);
+            else if( c->fading )
+                mix_fade_out(scratch, c->last_frame, opts.frame_samples, device->num_channels, -c->gain);
+            mix = scratch;
+        }
+
+        int enc_len = opus_encode_float(group.encoder, mix, opts.frame_samples, encoded_data + PACKET_HEADER_LEN, MAX_DATA_PACKET_LEN - PACKET_HEADER_LEN);
+        if( enc_len < 0 ) {
+            fprintf(stderr, "opus_encode_float() error: %d\n", enc_len);
+        } else {
+            audio_packet_header hdr;
+            memset(&hdr, 0, sizeof(audio_packet_header));
+            hdr.type = PACKET_AUDIO;
+            hdr.num_channels = device->num_channels;
+            hdr.num_samples = opts.frame_samples;
+            hdr.seq = group.seq;
+            hdr.timestamp = group.timestamp;
+            hdr.capture_us = (uint64_t)(time_ms()*1000.0);
+            if( opts.sync_ms != 0 )
+                hdr.presentation_us = hdr.capture_us + 1000*opts.sync_ms;
+            pack_header(&hdr, encoded_data);
+
+            // The broker sends the packet to everybody listed in the frame after it
+            zmq_send(device->input_sock, encoded_data, PACKET_HEADER_LEN + enc_len, ZMQ_SNDMORE);
+            zmq_send(device->input_sock, group.dests.data(), group.dests.size(), 0);
+        }
+        group.seq++;
+        group.timestamp += opts.frame_samples;
+        ++itty;
     }
 }
 
+// Figure out how a client sending us in_channels gets routed onto this device; whatever the user
+// asked for with --route, or the default matrix if they didn't ask for anything in particular.
+static ChannelMatrix * route_for_client( audio_device * device, const std::string & ident, unsigned int in_channels ) {
+    const ChannelMatrix * route = find_channel_route(opts.routes, device->id, ident, in_channels, device->num_channels);
+    if( route == NULL )
+        return new ChannelMatrix(in_channels, device->num_channels);
+
+    printf("[%d] Routing %s through %s\n", device->id, ident.c_str(), route->toString().c_str());
+    return new ChannelMatrix(*route);
+}
+
 
 bool bind_darnit(void * sock, const char * addr) {
     int err = zmq_bind(sock, addr);
@@ -163,16 +305,12 @@ bool bind_darnit(void * sock, const char * addr) {
     return true;
 }
 
-// Initialize Opus encoder for the given device (decoders are created upon demand for clients)
+// Initialize Opus encoder for the given device (client decoders live in the DecodeStage)
 bool initOpus( audio_device * device ) {
-    int err;
     if( device->direction != OUTPUT ) {
-        device->encoder = opus_encoder_create(SAMPLE_RATE, device->num_channels, OPUS_APPLICATION_AUDIO, &err);
-        if (err != OPUS_OK) {
-            fprintf(stderr, "Could not create Opus encoder with %d channels for %s.\n", device->num_channels, device->name);
+        device->encoder = create_encoder(device->num_channels, device->name);
+        if( device->encoder == NULL )
             return false;
-        }
-        //printf("Created an encoder for %d channels!\n", device->num_channels);
     }
     return true;
 }
@@ -199,25 +337,38 @@ bool initSocks( audio_device * device ) {
     zmq_setsockopt(device->input_sock, ZMQ_IDENTITY, &device, sizeof(audio_device *));
     zmq_connect(device->input_sock, "inproc://broker_input");
 
-    // Create channel to receive raw audio from audio device.
-    device->raw_audio_out = create_sock(ZMQ_PULL);
-    if( device->raw_audio_out == NULL ) {
-        fprintf(stderr, "Could not create raw_audio_out socket for device %s", device->name);
-        return false;
+    // If we play anything, every client's decoded audio comes in through this one socket; with room
+    // for a couple of frames from every client we could possibly have, so a busy room doesn't overflow it
+    device->data_sock = NULL;
+    if( device->direction != INPUT ) {
+        device->data_sock = create_sock(ZMQ_PAIR, 2*MAX_CLIENTS);
+        if( device->data_sock == NULL ) {
+            fprintf(stderr, "Could not create data socket for device %s", device->name);
+            return false;
+        }
+        zmq_connect(device->data_sock, DecodeStage::addressFor(device).c_str());
     }
-    char addr[20];
-    sprintf(&addr[0], "inproc://dev%2d_raw", device->id);
-    zmq_connect(device->raw_audio_out, addr);
+    return true;
+}
 
-    // Create channel to send mixed audio to audio device.
-    device->mixed_audio_out = create_sock(ZMQ_PAIR);
-    if( device->mixed_audio_out == NULL ) {
-        fprintf(stderr, "Could not create mixed_audio_out socket for device %s", device->name);
-        return false;
+// Run the device at SAMPLE_RATE if it'll let us, otherwise at whatever it likes to run at (and we'll resample)
+static void choose_sample_rate( audio_device * device ) {
+    device->sample_rate = SAMPLE_RATE;
+    if( !device->is_virtual ) {
+        PaStreamParameters parameters;
+        parameters.device = device->id;
+        parameters.channelCount = device->num_channels;
+        parameters.sampleFormat = paFloat32;
+        parameters.suggestedLatency = 0;
+        parameters.hostApiSpecificStreamInfo = NULL;
+        if( Pa_IsFormatSupported(device->direction != OUTPUT ? &parameters : NULL, device->direction != INPUT ? &parameters : NULL, SAMPLE_RATE) != paFormatIsSupported ) {
+            device->sample_rate = (unsigned int)Pa_GetDeviceInfo(device->id)->defaultSampleRate;
+            printf("\"%s\" can't run at %dHz, resampling from %uHz\n", device->name, SAMPLE_RATE, device->sample_rate);
+        }
     }
-    sprintf(&addr[0], "inproc://dev%2d_mixed", device->id);
-    zmq_connect(device->mixed_audio_out, addr);
-    return true;
+
+    // Enough to make up a frame, rounded up if it doesn't divide evenly
+    device->buffer_samples = ((unsigned long)opts.frame_samples*device->sample_rate + SAMPLE_RATE - 1)/SAMPLE_RATE;
 }
 
 // Initialize Port streams for the given device
@@ -243,7 +394,7 @@ bool initPortAudio( audio_device * device ) {
     squelch_stderr();
 
     PaError err;
-    err = Pa_OpenStream( &device->stream, inparams, outparams, SAMPLE_RATE, SAMPLES_IN_BUFFER, 0, &pa_callback, (void *)device );
+    err = Pa_OpenStream( &device->stream, inparams, outparams, device->sample_rate, device->buffer_samples, 0, &pa_callback, (void *)device );
 
     if( err != paNoError ) {
         restore_stderr();
@@ -265,6 +416,40 @@ bool initPortAudio( audio_device * device ) {
 }
 
 
+// Encode a frame of our own audio and send it off, either to the broker to pass along or straight to
+// every target.  Those we don't wait on, a slow target just misses out.
+static void send_frame( audio_device * device, const float * pcm, double capture_ms, unsigned char * encoded_data,
+                        uint32_t & out_seq, uint32_t & out_timestamp, std::map<std::string, void *> & direct_socks ) {
+    // Encode it just past where the header will go
+    int enc_len = opus_encode_float(device->encoder, pcm, opts.frame_samples, encoded_data + PACKET_HEADER_LEN, MAX_DATA_PACKET_LEN - PACKET_HEADER_LEN );
+    if( enc_len < 0 ) {
+        fprintf(stderr, "opus_encode_float() error: %d\n", enc_len);
+    } else {
+        // Stamp the header on the front
+        audio_packet_header hdr;
+        memset(&hdr, 0, sizeof(audio_packet_header));
+        hdr.type = PACKET_AUDIO;
+        hdr.num_channels = device->num_channels;
+        hdr.num_samples = opts.frame_samples;
+        hdr.seq = out_seq;
+        hdr.timestamp = out_timestamp;
+        hdr.capture_us = (uint64_t)(capture_ms*1000.0);
+        if( opts.sync_ms != 0 )
+            hdr.presentation_us = hdr.capture_us + 1000*opts.sync_ms;
+        pack_header(&hdr, encoded_data);
+
+        // Send the whole thing off as a single frame
+        if( !opts.direct )
+            zmq_send(device->input_sock, encoded_data, PACKET_HEADER_LEN + enc_len, 0);
+        for( auto& itty : direct_socks )
+            zmq_send(itty.second, encoded_data, PACKET_HEADER_LEN + enc_len, ZMQ_DONTWAIT);
+    }
+
+    // Even if this one didn't make it out, our stream position moves on
+    out_seq++;
+    out_timestamp += opts.frame_samples;
+}
+
 void * audio_thread(void * device_ptr) {
     // Grab our device from the device_ptr passed in to this thread
     audio_device * device = (audio_device *)device_ptr;
@@ -275,8 +460,9 @@ void * audio_thread(void * device_ptr) {
     // Initialize Opus
     initOpus(device);
 
-    // Initialize Port
-    initPortAudio(device);
+    // Initialize Port, unless there's nothing there to initialize
+    if( !device->is_virtual )
+        initPortAudio(device);
 
     WAVFile * input_log = NULL;
     WAVFile * output_log = NULL;
@@ -294,27 +480,69 @@ void * audio_thread(void * device_ptr) {
     device->output_log = output_log;
 
     // I think it's pretty probable that we'll need at least 10ms stereo for scratch space; let's see if I'm right!
-    unsigned int temp_buff_len = 2*SAMPLES_IN_BUFFER;
-    float * temp_buff = new float[temp_buff_len];
-    unsigned int mix_buff_len = device->num_channels*SAMPLES_IN_BUFFER;
+    unsigned int mix_buff_len = device->num_channels*opts.frame_samples;
     float * mix_buff = new float[mix_buff_len];
     memset(mix_buff, 0, sizeof(float)*mix_buff_len);
 
-    // Scratch space for encoded data
+    // Every client's frames are added into this on their way into mix_buff, a buffer's worth at a
+    // time.  Frames can land up to half a buffer ahead of the one we're mixing, so a few buffers is
+    // plenty.  Fading out a client that ran dry needs somewhere to put the fade first.
+    QueueingAdditiveRingBuffer * qarb = new QueueingAdditiveRingBuffer(4*opts.frame_samples, device->num_channels, MAX_CLIENTS);
+    float * fade_buff = new float[mix_buff_len];
+
+    // The decode stage only keeps clients in step with the first output device's clock, so any other
+    // output device corrects what's left itself; a client's frames are routed into this first.
+    bool own_drift = device->direction != INPUT && device->rate_corrections == NULL;
+    float * drift_buff = own_drift ? new float[MAX_PCM_FRAME_SAMPLES*device->num_channels] : NULL;
+
+    // Scratch space for encoded data (packet header and all)
     unsigned char * encoded_data = new unsigned char[MAX_DATA_PACKET_LEN];
 
-    // Our client identity list, mapping to output sockets.  These sockets go:
-    // Broker [PUB] -> Audio thread [SUB]
-    std::map<std::string, void *> clientSocks;
-    std::map<std::string, std::vector<float *> > clientChunks;
-    std::map<std::string, OpusDecoder *> clientDecoders;
-    std::map<std::string, bool> clientMixedInAlready;
+    // Where we are in the stream of packets we're sending out
+    uint32_t out_seq = 0, out_timestamp = 0;
+
+    // If the device doesn't run at SAMPLE_RATE, what we've resampled but not yet encoded (or played), each
+    // with room for a whole buffer of what's left over plus everything the next buffer could resample to
+    Resampler * in_resampler = NULL, * out_resampler = NULL;
+    float * in_resampled = NULL, * out_resampled = NULL;
+    unsigned int in_resampled_len = 0, out_resampled_len = 0;
+    if( device->sample_rate != SAMPLE_RATE ) {
+        if( device->direction != OUTPUT ) {
+            in_resampler = new Resampler(device->sample_rate, SAMPLE_RATE, device->num_channels, device->buffer_samples, opts.resampler_quality);
+            in_resampled = new float[(opts.frame_samples + in_resampler->maxOutput(device->buffer_samples))*device->num_channels];
+        }
+        if( device->direction != INPUT ) {
+            out_resampler = new Resampler(SAMPLE_RATE, device->sample_rate, device->num_channels, opts.frame_samples, opts.resampler_quality);
+            out_resampled = new float[(2*device->buffer_samples + out_resampler->maxOutput(opts.frame_samples))*device->num_channels];
+        }
+    }
 
-    // Build up a pollitem_t group from our sockets
-    zmq_pollitem_t items[67];
+    // In direct mode, our own connection to each target (by identity), so our packets don't go through the broker
+    std::map<std::string, void *> direct_socks;
+
+    // If we're the mixer, who we're mixing for, the mixes we're sending them, and when the next is due
+    std::vector<std::string> listeners;
+    std::map<std::string, mix_group> mix_groups;
+    float * minus_buff = device->is_virtual ? new float[mix_buff_len] : NULL;
+    double next_tick = time_ms();
+
+    // When (on the wall clock) the last buffer the device took will start playing, or 0 if we don't
+    // know, and how many we've handed it since.  From these we work out when what we're about to
+    // mix will be heard, so that clients whose frames say when they should be heard can be.
+    double dac_ms = 0.0;
+    unsigned int unplayed = 0;
+    double buffer_ms = (1000.0*device->buffer_samples)/device->sample_rate;
+
+    // Everyone we're listening to.  Identities are only looked at when clients come and go,
+    // after that each one is just the slot in this table that the broker tags its packets with.
+    ClientTable clients;
+
+    // Build up a pollitem_t group from our sockets; the device talks to us through ring
+    // buffers, and all clients share data_sock, so this never grows with the client count
+    zmq_pollitem_t items[2];
     items[0].socket = device->cmd_sock;
-    items[1].socket = device->raw_audio_out;
-    items[2].socket = device->mixed_audio_out;
+    items[1].socket = device->data_sock;
+    int num_items = device->data_sock != NULL ? 2 : 1;
 
     // We only deal in ZMQ_POLLIN events, so set those up first
     for( int i=0; i<sizeof(items)/sizeof(zmq_pollitem_t); ++i ) {
@@ -323,64 +551,153 @@ void * audio_thread(void * device_ptr) {
         items[i].events = ZMQ_POLLIN;
     }
 
+    // When we expect the device's next callback, going by when we last saw one had been
+    double next_callback_ms = 0.0;
+
     // Let's listen for ZMQ events, and mix some wicked sick beats
     bool keepRunning = true;
     double last_meter = 0.0;
     while( keepRunning ) {
-        // Wait for an event
-        //printf("[0x%x] Waiting for events from %d sockets...\n", device, 2 + clientSocks.size() );
-        int rc = zmq_poll(&items[0], 3 + clientSocks.size(), -1);
-
-        if( rc <= 0 ) {
+        // Wait for an event.  The device can't wake us up, so we sleep until just before its next
+        // callback is due, and look in on it every so often from then until it's been; the mixer
+        // just goes by the clock.
+        long timeout;
+        if( device->is_virtual )
+            timeout = (long)fmax(0.0, ceil(next_tick - time_ms()));
+        else if( device_has_work(device) )
+            timeout = 0;
+        else
+            timeout = (long)fmax(CALLBACK_POLL_MS, ceil(next_callback_ms - CALLBACK_GUARD_MS - time_ms()));
+        int rc = zmq_poll(&items[0], num_items, timeout);
+
+        if( rc < 0 ) {
             fprintf(stderr, "zmq_poll() == %d: %s\n", rc, strerror(errno) );
             keepRunning = false;
             break;
         }
 
-        // Is the device asking for audio from us? (This is the most important, let's deal with it first)
-        if( items[2].revents & ZMQ_POLLIN ) {
-            // Read the empty message
-            int empty;
-            zmq_recv(device->mixed_audio_out, &empty, 0, 0);
+        // If the device has been since we last looked, the next one's a buffer's length from about now
+        if( !device->is_virtual && device_has_work(device) )
+            next_callback_ms = time_ms() + buffer_ms;
 
-            // Send it the pre-mixed buffer of audio
-            zmq_send(device->mixed_audio_out, mix_buff, sizeof(float)*mix_buff_len, 0);
+        // Catch up on when the device's buffers are being heard
+        double dac_time;
+        while( device->direction != INPUT && !device->is_virtual && device->played->pop(&dac_time) ) {
+            if( unplayed > 0 )
+                unplayed--;
+            dac_ms = dac_time > 0.0 ? time_ms() - 1000.0*(Pa_GetStreamTime(device->stream) - dac_time) : 0.0;
+        }
 
-            int maxsize = 0;
-            for( auto &kv : clientMixedInAlready ) {
-                maxsize = fmax(clientChunks[kv.first].size(), maxsize);
+        // Has the device eaten into the buffers we rendered ahead for it? (This is the most
+        // important, let's deal with it first).  Top it back up to num_prerender buffers.  The
+        // mixer has nobody to eat into them, so it goes by the clock instead.
+        while( device->direction != INPUT && (device->is_virtual ? time_ms() >= next_tick : device->mixed_audio->size() < device->num_prerender) ) {
+            // Hand it the pre-mixed buffer of audio
+            if( device->is_virtual ) {
+                send_mix_minus(device, clients, mix_buff, minus_buff, encoded_data, listeners, mix_groups);
+
+                // If we've fallen hopelessly behind, don't try to catch up all at once
+                next_tick += (1000.0*opts.frame_samples)/SAMPLE_RATE;
+                if( time_ms() - next_tick > 10*(1000.0*opts.frame_samples)/SAMPLE_RATE )
+                    next_tick = time_ms();
+            } else if( out_resampler == NULL ) {
+                device->mixed_audio->push(mix_buff);
+                unplayed++;
+            } else {
+                // Hand it over a buffer at a time, at the device's rate, for as long as it has room
+                unsigned int channels = device->num_channels;
+                out_resampled_len += out_resampler->process(mix_buff, opts.frame_samples, out_resampled + out_resampled_len*channels);
+                while( out_resampled_len >= device->buffer_samples && device->mixed_audio->size() < device->num_prerender ) {
+                    device->mixed_audio->push(out_resampled);
+                    unplayed++;
+                    out_resampled_len -= device->buffer_samples;
+                    memmove(out_resampled, out_resampled + device->buffer_samples*channels, sizeof(float)*out_resampled_len*channels);
+                }
             }
 
             if( opts.meter && time_ms() - last_meter > METER_TIMEDIFF  ) {
+                // Show how many clients made it into this buffer, the deepest client jitter buffer,
+                // how many frames we've dropped overall, the furthest any client's clock is off and the
+                // furthest any client playing at a set time is off from it.  On any output device but the
+                // first, the clocks have already been brought in step with that device's, so what's left
+                // is how far off from it our own clock is.
+                unsigned int maxdepth = 0, drops = 0, num_mixed = 0;
+                float maxdrift = 0.0f, maxsync = 0.0f;
+                for( unsigned int n=0; n<clients.size(); ++n ) {
+                    client_slot * c = clients.active(n);
+                    jitter_stats stats = c->jb->getStats();
+                    maxdepth = fmax(stats.depth, maxdepth);
+                    drops += stats.drops;
+                    num_mixed += c->mixed;
+                    if( fabs(stats.drift_ppm) > fabs(maxdrift) )
+                        maxdrift = stats.drift_ppm;
+                    if( stats.scheduled && fabs(stats.sync_error_ms) > fabs(maxsync) )
+                        maxsync = stats.sync_error_ms;
+                }
+
                 last_meter = time_ms();
-                print_level_meter( (const float *)mix_buff, SAMPLES_IN_BUFFER, device->num_channels);
-                printf(" (%d)\r", maxsize);
+                print_level_meter( (const float *)mix_buff, opts.frame_samples, device->num_channels);
+                printf(" (%u/%u mixed, %u, %u drops, %u underruns, %+.1fppm, %+.3fms)\r", num_mixed, clients.size(), maxdepth, drops, device->underruns.load(std::memory_order_relaxed), maxdrift, maxsync);
                 fflush(stdout);
             }
 
             if( device->output_log != NULL )
-                device->output_log->writeData((const float *)mix_buff, SAMPLES_IN_BUFFER);
-
-            // Now, mix up as much of the next buffer of audio as we can.  First, clear mix_buff:
-            memset(mix_buff, 0, sizeof(float)*mix_buff_len);
-
-            // Next, mix in every client that has buffers waiting.
-            for( auto &kv : clientMixedInAlready ) {
-                if( clientChunks[kv.first].size() > 0 ) {
-                    // Grab the first chunk of audio waiting for me;
-                    float * chunk = clientChunks[kv.first][0];
-                    clientChunks[kv.first].erase(clientChunks[kv.first].begin());
-
-                    // Mix it in, and delete the chunk!
-                    for( int i=0; i<device->num_channels*SAMPLES_IN_BUFFER; ++i )
-                        mix_buff[i] += chunk[i];
-                    delete[] chunk;
-                } else {
-                    // If we didn't have anything queued up, just say that this client hasn't
-                    // been mixed into mix_buff already, so it will get put in immediately later.
-                    clientMixedInAlready[kv.first] = false;
+                device->output_log->writeData((const float *)mix_buff, opts.frame_samples);
+
+            // Now, mix up as much of the next buffer of audio as we can.
+            // Work out when it'll be heard: the mixer sends it out on the next tick, a device plays it
+            // once it's played everything we've already handed it (and anything still being resampled).
+            double play_ms = 0.0;
+            if( device->is_virtual )
+                play_ms = next_tick;
+            else if( dac_ms != 0.0 ) {
+                play_ms = dac_ms + (1 + unplayed)*buffer_ms;
+                if( out_resampler != NULL )
+                    play_ms += (1000.0*out_resampled_len)/device->sample_rate + (1000.0*out_resampler->delay())/SAMPLE_RATE;
+            }
+
+            // Next, add the next frame from every client's jitter buffer into the qarb.  A client that's
+            // been playing carries on from where its last frame ended, which it'll be heard this far
+            // ahead of play_ms.  One that's (re)starting with a frame that should be heard a little
+            // after play_ms gets put down right where it will be; one that's late can only start now,
+            // and its jitter buffer steers out the rest.  The mixer takes each listener's own frame
+            // back out of their mix, so there every frame has to line up with the buffer.
+            uint64_t position = qarb->position();
+            for( unsigned int n=0; n<clients.size(); ++n ) {
+                client_slot * c = clients.active(n);
+                unsigned int slot = clients.activeSlot(n);
+                double frame_ms = play_ms;
+                bool place = false;
+                if( play_ms != 0.0 && qarb->following(slot) )
+                    frame_ms += (1000.0*qarb->ahead(slot))/SAMPLE_RATE;
+                else if( play_ms != 0.0 && !device->is_virtual ) {
+                    double at = c->jb->nextPlayAt();
+                    place = at > play_ms && at <= play_ms + (500.0*opts.frame_samples)/SAMPLE_RATE;
+                    if( place )
+                        frame_ms = at;
+                }
+
+                const float * frame = c->jb->read(frame_ms);
+                c->mixed = frame != NULL;
+                c->fading = false;
+                if( frame != NULL ) {
+                    if( place )
+                        qarb->writeAt(slot, position + (uint64_t)llround((frame_ms - play_ms)*SAMPLE_RATE/1000.0), frame, opts.frame_samples, c->gain);
+                    else
+                        qarb->write(slot, frame, opts.frame_samples, c->gain);
+                    memcpy(c->last_frame, frame, sizeof(float)*mix_buff_len);
+                    c->faded = false;
+                } else if( !c->faded ) {
+                    // This client ran dry on us.  The decode stage fills in for a client that's gone quiet
+                    // with PLC, so if even that's run out, all that's left is to fade out what we last played.
+                    memset(fade_buff, 0, sizeof(float)*mix_buff_len);
+                    mix_fade_out(fade_buff, c->last_frame, opts.frame_samples, device->num_channels, c->gain);
+                    qarb->write(slot, fade_buff, opts.frame_samples);
+                    c->faded = true;
+                    c->fading = true;
                 }
             }
+            qarb->read(opts.frame_samples, mix_buff);
         }
 
 
@@ -392,67 +709,97 @@ void * audio_thread(void * device_ptr) {
 
             switch( cmd.type ) {
                 case CMD_CLIENTLIST: {
-                    std::unordered_set<std::string> clients;
                     //printf("Rebuilding clientlist...\n");
 
-                    // The data field of cmd now holds a NULL-separated list of client identities,
-                    // ending with an entry of zero length (an extra NULL at the end of the last id)
-                    unsigned int idx = 0;
-                    while( cmd.data[idx] != 0 ) {
-                        unsigned int identity_len = strlen(cmd.data + idx);
-
-                        const char * identity = cmd.data + idx;
-                        // Add this string to our client set:
-                        clients.insert(identity);
-
-                        // If such a client does not already exist in clientSocks, create one!
-                        if( clientSocks.find(identity) == clientSocks.end() ) {
-                            // Create a socket to listen for data coming from this client:
-                            void * sock = zmq_socket(zmq_ctx, ZMQ_SUB);
-                            zmq_connect(sock, "inproc://broker_output");
-                            zmq_setsockopt(sock, ZMQ_SUBSCRIBE, identity, identity_len);
-                            clientSocks[identity] = sock;
-                            clientMixedInAlready[identity] = false;
-
-                            // Create decoder for this client
-                            clientDecoders[identity] = opus_decoder_create(SAMPLE_RATE, device->num_channels, NULL);
-                            //printf("We are ready to receive from %s on socket 0x%llx\n", identity, (unsigned long long) sock);
-                        }
-                        idx += identity_len + 1;
+                    std::vector<const char *> listed;
+                    parseClientList(cmd, listed);
+
+                    // Go through all the clients we already have and ensure they're still on the list (and
+                    // still in the same slot; if somebody else is in it now, the broker has moved on from them).
+                    // Walk backwards, since leave() moves the last active client into the hole it leaves.
+                    for( int n=clients.size()-1; n>=0; --n ) {
+                        client_slot * c = clients.active(n);
+                        const char * identity = listed[clients.activeSlot(n)];
+                        if( identity != NULL && c->ident == identity )
+                            continue;
+
+                        printf("Kicking %s out of the client list\n", c->ident.c_str());
+
+                        // Say goodbye to its jitter buffer and routing
+                        jitter_stats stats = c->jb->getStats();
+                        printf("%s: jitter %.1fms, depth %u/%u, %u drops, %u underruns, drift %+.1fppm", c->ident.c_str(), stats.jitter_ms, stats.depth, stats.target_depth, stats.drops, stats.underruns, stats.drift_ppm);
+                        if( stats.scheduled )
+                            printf(", %+.3fms off schedule", stats.sync_error_ms);
+                        printf("\n");
+                        delete c->jb;
+                        delete c->matrix;
+                        delete[] c->last_frame;
+                        delete[] c->partial;
+                        delete c->drift;
+                        if( device->rate_corrections != NULL )
+                            device->rate_corrections[clients.activeSlot(n)].store(0.0f, std::memory_order_relaxed);
+
+                        // Finally, give up its slot, and its place in the qarb
+                        qarb->clearClient(clients.activeSlot(n));
+                        clients.leave(clients.activeSlot(n));
                     }
 
-                    // Now go through all the clients we already have and ensure they're still on the list
-                    std::unordered_set<std::string> to_delete;
-                    for( auto& kv : clientSocks ) {
-                        if( clients.count(kv.first) == 0 )
-                            to_delete.insert(kv.first);
-                    }
-                    for( auto& ident : to_delete ) {
-                        printf("Kicking %s out of the client list\n", ident.c_str());
-                        // Close that special little socket we designed for the client
-                        zmq_close(clientSocks[ident]);
-
-                        // Erase the mixing flags and chunk storage
-                        clientMixedInAlready.erase(ident);
-                        for( int i=0; i<clientChunks[ident].size(); ++i )
-                            delete[] clientChunks[ident][i];
-                        clientChunks.erase(ident);
-
-                        // Finally, erase all mention in clientSocks
-
-                        clientSocks.erase(ident);
-                    }
-
-                    // Finally, rebuild items:
-                    int i = 3;
-                    for( auto& kv : clientSocks ) {
-                        items[i].socket = kv.second;
-                        i++;
+                    // Now welcome anybody we don't already have
+                    for( int slot=0; slot<MAX_CLIENTS; ++slot ) {
+                        if( listed[slot] == NULL || clients.inUse(slot) )
+                            continue;
+                        clients.join(listed[slot], slot);
+                        client_slot * c = clients.get(slot);
+
+                        // Create a jitter buffer for this client; there's nothing to fade out until it starts playing
+                        c->jb = new JitterBuffer((JITTER_BUFFER_MS*SAMPLE_RATE/1000)/opts.frame_samples, mix_buff_len, (1000.0f*opts.frame_samples)/SAMPLE_RATE);
+                        c->last_frame = new float[mix_buff_len];
+                        c->faded = true;
+
+                        // Its frames can come in a few samples longer than it sent them, after drift correction
+                        // (ours too, if we're not the device the decode stage corrects for), on top of whatever's
+                        // left over from last time
+                        c->partial = new float[(opts.frame_samples + DriftCorrector::maxOutput(MAX_PCM_FRAME_SAMPLES))*device->num_channels];
+                        if( own_drift )
+                            c->drift = new DriftCorrector(device->num_channels, MAX_PCM_FRAME_SAMPLES);
+                        //printf("We are ready to receive from %s in slot %d\n", listed[slot], slot);
                     }
+                    delete[] cmd.data;
 
                     // We can't really continue on in this loop I don't think, so let's continue from here;
                     continue;
                 }   break;
+                case CMD_CONNECT: {
+                    // Address, target identity, then the identity we should send as
+                    const char * tcp_addr = cmd.data;
+                    const char * target_ident = tcp_addr + strlen(tcp_addr) + 1;
+                    const char * our_ident = target_ident + strlen(target_ident) + 1;
+                    if( direct_socks.find(target_ident) == direct_socks.end() ) {
+                        void * sock = create_sock(ZMQ_DEALER, 5);
+                        zmq_setsockopt(sock, ZMQ_IDENTITY, our_ident, strlen(our_ident) + 1);
+                        if( zmq_connect(sock, tcp_addr) != 0 ) {
+                            printf("[%d] ERROR: Could not connect directly to %s!\n", device->id, tcp_addr);
+                            zmq_close(sock);
+                        } else
+                            direct_socks[target_ident] = sock;
+                    }
+                    delete[] cmd.data;
+                }   break;
+                case CMD_LISTENERS: {
+                    // Everybody we should send a mix to, each NULL-terminated
+                    listeners.clear();
+                    for( unsigned int idx=0; idx < cmd.datalen; idx += listeners.back().size() + 1 )
+                        listeners.push_back(std::string(cmd.data + idx, strnlen(cmd.data + idx, cmd.datalen - idx)));
+                    delete[] cmd.data;
+                }   break;
+                case CMD_DISCONNECT: {
+                    auto itty = direct_socks.find(cmd.data);
+                    if( itty != direct_socks.end() ) {
+                        zmq_close(itty->second);
+                        direct_socks.erase(itty);
+                    }
+                    delete[] cmd.data;
+                }   break;
                 case CMD_SHUTDOWN:
                     // The ultimate surrender
                     keepRunning = false;
@@ -464,117 +811,156 @@ void * audio_thread(void * device_ptr) {
         }
 
         // Did we just get audio from the device?
-        if( items[1].revents & ZMQ_POLLIN ) {
-            // Read it in
-            zmq_msg_t msg;
-            zmq_msg_init(&msg);
-            zmq_recvmsg(device->raw_audio_out, &msg, 0);
-            int dec_len = zmq_msg_size(&msg);
-            int num_samples = dec_len/(sizeof(float)*device->num_channels);
-
-
-            if( opts.meter && time_ms() - last_meter > METER_TIMEDIFF  ) {
-                last_meter = time_ms();
-                print_level_meter( (const float *)zmq_msg_data(&msg), num_samples, device->num_channels);
-                fflush(stdout);
+        const float * raw_buff;
+        double adc_time;
+        while( device->direction != OUTPUT && (raw_buff = device->raw_audio->readSlot(&adc_time)) != NULL ) {
+            // Figure out when this was captured on the wall clock; PortAudio gives us the ADC time in
+            // terms of the stream clock, so see how far behind the stream clock's "now" that is.
+            double capture_ms = time_ms();
+            if( adc_time > 0.0 )
+                capture_ms -= 1000.0*(Pa_GetStreamTime(device->stream) - adc_time);
+
+            // Most of the time this is a frame just as it is; otherwise it's resampled and added onto
+            // whatever's left over from last time, which was captured that much earlier
+            const float * frame = raw_buff;
+            unsigned int num_frames = 1;
+            if( in_resampler != NULL ) {
+                capture_ms -= (1000.0*in_resampled_len)/SAMPLE_RATE;
+                in_resampled_len += in_resampler->process(raw_buff, device->buffer_samples, in_resampled + in_resampled_len*device->num_channels);
+                device->raw_audio->commitRead();
+                frame = in_resampled;
+                num_frames = in_resampled_len/opts.frame_samples;
             }
 
-            if( input_log != NULL )
-                input_log->writeData((const float *)zmq_msg_data(&msg), num_samples);
-
-            // Encode it:
-            int enc_len = opus_encode_float(device->encoder, (const float *)zmq_msg_data(&msg), num_samples, encoded_data, MAX_DATA_PACKET_LEN );
-            if( enc_len < 0 ) {
-                fprintf(stderr, "opus_encode_float() error: %d\n", enc_len);
-            } else {
-                // Send the decoded length
-                dec_len = htonl(dec_len);
-                zmq_send(device->input_sock, &dec_len, sizeof(int), ZMQ_SNDMORE);
+            for( unsigned int f=0; f<num_frames; ++f ) {
+                const float * pcm = frame + f*opts.frame_samples*device->num_channels;
+                if( opts.meter && time_ms() - last_meter > METER_TIMEDIFF  ) {
+                    last_meter = time_ms();
+                    print_level_meter( pcm, opts.frame_samples, device->num_channels);
+                    fflush(stdout);
+                }
 
-                // Send number of channels
-                int num_channels = htonl(device->num_channels);
-                zmq_send(device->input_sock, &num_channels, sizeof(int), ZMQ_SNDMORE);
+                if( input_log != NULL )
+                    input_log->writeData(pcm, opts.frame_samples);
 
-                // Next, send the encoded audio!
-                zmq_send(device->input_sock, encoded_data, enc_len, 0);
+                send_frame(device, pcm, capture_ms + (1000.0*f*opts.frame_samples)/SAMPLE_RATE, encoded_data, out_seq, out_timestamp, direct_socks);
+            }
 
-                // Small amount of cleanup
-                zmq_msg_close(&msg);
+            // Let the device have its slot back, or keep whatever didn't make up a whole frame
+            if( in_resampler == NULL ) {
+                device->raw_audio->commitRead();
+            } else {
+                unsigned int used = num_frames*opts.frame_samples;
+                in_resampled_len -= used;
+                memmove(in_resampled, in_resampled + used*device->num_channels, sizeof(float)*in_resampled_len*device->num_channels);
             }
         }
 
-        // Did we just get audio from a client?
-        for( int i=0; i<clientSocks.size(); ++i ) {
-            //printf("Checking user socket %d (0x%llx)...\n", i, items[i+3].socket);
-            zmq_pollitem_t * item = &items[i+3];
-            if( item->revents & ZMQ_POLLIN ) {
-                // Get the identity first
-                char client_ident[IDENT_LEN];
-                if( zmq_recv(item->socket, &client_ident[0], IDENT_LEN, 0) == -1 )
-                    printf("[0x%llx] zmq_recv failed; %s\n", (unsigned long long)item->socket, strerror(errno));
-
-                int dec_len, num_channels;
-                // Read in the audio from this client; first decoded length
-                zmq_recv(item->socket, &dec_len, sizeof(int), 0);
-                dec_len = ntohl(dec_len);
-
-                // Then number of channels
-                zmq_recv(item->socket, &num_channels, sizeof(int), 0);
-                num_channels = ntohl(num_channels);
-
-                // Finally, the audio itself
-                int enc_len = zmq_recv(item->socket, encoded_data, MAX_DATA_PACKET_LEN, 0);
-
-                //printf("Got a %d dec_len, %d num_channels, and %d enc_len from %s\n", dec_len, num_channels, enc_len, &client_ident[0]);
-
-                // Decode the data, expanding temp_buff if we need to:
-                if( temp_buff_len < dec_len/sizeof(float) ) {
-                    delete[] temp_buff;
-                    temp_buff_len = dec_len/sizeof(float);
-                    temp_buff = new float[temp_buff_len];
-                }
+        // Did we just get audio from a client?  The decode stage has already done the hard part; all
+        // that's left is to route each frame onto our channels.  Drain what's waiting rather than going
+        // back around the poll for every frame, but not so much that we leave the device waiting.
+        for( unsigned int drained=0; device->data_sock != NULL && (items[1].revents & ZMQ_POLLIN) && drained <= clients.size(); ++drained ) {
+            // The slot of the client this came from comes first
+            uint16_t slot;
+            if( zmq_recv(device->data_sock, &slot, sizeof(uint16_t), ZMQ_DONTWAIT) == -1 ) {
+                if( errno != EAGAIN )
+                    printf("[%d] zmq_recv failed; %s\n", device->id, strerror(errno));
+                break;
+            }
 
-                // Decode it into our (possibly newly-widened) temp_buff
-                std::string client_key = &client_ident[0];
-                int actually_dec_len = opus_decode_float(clientDecoders[client_key], encoded_data, enc_len, temp_buff, temp_buff_len, 0);
+            // Next, the frame itself, which we have to let go of once we're done with it
+            pcm_frame * frame;
+            zmq_recv(device->data_sock, &frame, sizeof(pcm_frame *), 0);
 
-                // Calculate the expected number of samples
-                int num_samples = dec_len/(sizeof(float)*num_channels);
-                if( actually_dec_len != num_samples ) {
-                    fprintf(stderr, "ERROR: actually_dec_len (%d) != num_samples (%d)\n", actually_dec_len, num_samples);
-                    break;
-                }
+            // This can happen if the frame beat the client list that announces its sender
+            if( !clients.inUse(slot) ) {
+                release_frame(frame);
+                continue;
+            }
+            client_slot * c = clients.get(slot);
 
-                if( !clientMixedInAlready[client_key] ) {
-                    clientMixedInAlready[client_key] = true;
-                    mixdown_channels(temp_buff, mix_buff, num_samples, num_channels, device->num_channels);
-                } else {
-                    float * client_backlog = new float[num_samples*device->num_channels];
-                    memset(client_backlog, 0, sizeof(float)*num_samples*device->num_channels);
-                    mixdown_channels(temp_buff, client_backlog, num_samples, num_channels, device->num_channels);
-                    clientChunks[client_key].push_back(client_backlog);
-                }
+            // If this is the first we've heard from this client, figure out how to route it now that
+            // we know how many channels it's sending us (or again, if that's changed)
+            if( c->matrix == NULL || c->matrix->getInChannels() != frame->num_channels ) {
+                delete c->matrix;
+                c->matrix = route_for_client(device, c->ident, frame->num_channels);
+            }
+
+            // Route it onto our channels, after whatever's left over from before.  If we're correcting this
+            // client's drift ourselves, it's routed to one side first, and whatever our drift corrector was
+            // still holding on to comes out ahead of it along with what's left over.
+            float * routed = c->partial + c->partial_samples*device->num_channels;
+            double ahead_ms = (1000.0*c->partial_samples)/SAMPLE_RATE;
+            unsigned int num_samples = frame->num_samples;
+            if( c->drift != NULL ) {
+                ahead_ms += (1000.0*c->drift->delay())/SAMPLE_RATE;
+                memset(drift_buff, 0, sizeof(float)*frame->num_samples*device->num_channels);
+                c->matrix->apply(frame->samples, drift_buff, frame->num_samples);
+                c->drift->adjust(c->jb->rateCorrection());
+                num_samples = c->drift->process(drift_buff, frame->num_samples, routed);
+            } else {
+                memset(routed, 0, sizeof(float)*frame->num_samples*device->num_channels);
+                c->matrix->apply(frame->samples, routed, frame->num_samples);
+            }
+            c->partial_arrival_ms = frame->arrival_ms;
+            c->partial_media_ms = frame->media_ms - ahead_ms;
+
+            // Real frames say when they should be heard (if they mind).  What's left over from before comes
+            // out ahead of this one; frames we made up ourselves carry on from the one before.
+            if( frame->arrival_ms != 0.0 )
+                c->partial_play_ms = frame->play_ms == 0.0 ? 0.0 : frame->play_ms - ahead_ms;
+            c->partial_samples += num_samples;
+            release_frame(frame);
+
+            // If we're the device the decode stage keeps this client's clock in step with, tell it how
+            // far off it still is
+            if( device->rate_corrections != NULL )
+                device->rate_corrections[slot].store(c->jb->rateCorrection(), std::memory_order_relaxed);
+
+            // Queue it up in this client's jitter buffer, cut up (or pieced together) into frames as long as
+            // our buffers; only real packets count towards jitter.
+            while( c->partial_samples >= opts.frame_samples ) {
+                memcpy(c->jb->writeSlot(), c->partial, sizeof(float)*mix_buff_len);
+                if( c->partial_arrival_ms != 0.0 )
+                    c->jb->commitWrite(c->partial_arrival_ms, c->partial_media_ms, c->partial_play_ms);
+                else
+                    c->jb->commitWrite(c->partial_play_ms);
+                c->partial_samples -= opts.frame_samples;
+                memmove(c->partial, c->partial + mix_buff_len, sizeof(float)*c->partial_samples*device->num_channels);
+                c->partial_media_ms += (1000.0*opts.frame_samples)/SAMPLE_RATE;
+                if( c->partial_play_ms != 0.0 )
+                    c->partial_play_ms += (1000.0*opts.frame_samples)/SAMPLE_RATE;
             }
         }
     }
 
     // CLEANUP TIME! Let's blow this popsicle stand!
     printf("[%d] Cleaning up thread\n", device->id);
+    if( device->direction != INPUT )
+        printf("[%d] Device underran %u times with %u buffers rendered ahead\n", device->id, device->underruns.load(), device->num_prerender);
 
     // Stop the stream
-    Pa_CloseStream(device->stream);
-
-    // Cleanup client decoders
-    while( !clientDecoders.empty() ) {
-        auto kv = clientDecoders.begin();
-        opus_decoder_destroy(kv->second);
-        clientDecoders.erase(kv->first);
-    }
-
-    // Cleanup any client chunks laying around
-    while( !clientChunks.empty() ) {
-        auto kv = clientChunks.begin();
-        clientChunks.erase(kv->first);
+    if( !device->is_virtual )
+        Pa_CloseStream(device->stream);
+
+    // Cleanup the mixer's encoders
+    for( auto& itty : mix_groups )
+        opus_encoder_destroy(itty.second.encoder);
+    delete[] minus_buff;
+    delete in_resampler;
+    delete out_resampler;
+    delete[] in_resampled;
+    delete[] out_resampled;
+
+    // Cleanup any clients laying around; their routing and jitter buffers
+    while( clients.size() > 0 ) {
+        client_slot * c = clients.active(0);
+        delete c->matrix;
+        delete c->jb;
+        delete[] c->last_frame;
+        delete[] c->partial;
+        delete c->drift;
+        clients.leave(clients.activeSlot(0));
     }
 
     // Cleanup device encoder
@@ -587,23 +973,20 @@ void * audio_thread(void * device_ptr) {
     if( input_log != NULL )
         delete input_log;
 
-    // Close client socks
-    while( !clientSocks.empty() ) {
-        auto kv = clientSocks.begin();
-        zmq_close(kv->second);
-        clientSocks.erase(kv->first);
-    }
-
     // Close sockets we no longer need
     zmq_close(device->cmd_sock);
     zmq_close(device->input_sock);
-    zmq_close(device->raw_audio_out);
-    zmq_close(device->mixed_audio_out);
+    if( device->data_sock != NULL )
+        zmq_close(device->data_sock);
+    for( auto& itty : direct_socks )
+        zmq_close(itty.second);
 
     // Cleanup top-tier stuff!
     delete[] device->name;
-    delete[] temp_buff;
     delete[] mix_buff;
+    delete qarb;
+    delete[] fade_buff;
+    delete[] drift_buff;
     delete[] encoded_data;
 
     return NULL;
@@ -618,26 +1001,33 @@ AudioEngine::AudioEngine(std::vector<audio_device *> & devices) : devices(device
         throw "Error: Could not initialize PortAudio";
     }
 
+    // Figure out which mixing kernels this CPU can handle
+    init_mix_kernels();
+    printf("Mixing with %s kernels\n", mixk.name);
+
     // Initialize broker...
     this->initBroker();
 
+    // Start decoding; this binds the sockets the audio threads are about to connect to.  A relay
+    // never decodes anything, it just passes packets along.
+    this->decode_stage = NULL;
+    if( !opts.relay )
+        this->decode_stage = new DecodeStage(this->devices, opts.decode_workers);
+
     // Start audio device threads
     for( auto device : this->devices ) {
-        // Create channel to send raw audio out from audio device
-        device->raw_audio_in = create_sock(ZMQ_PUSH);
-        if( device->raw_audio_in == NULL ) {
-            fprintf(stderr, "Could not create raw_audio_in socket for device %s", device->name);
-        }
-        char addr[20];
-        sprintf(&addr[0], "inproc://dev%2d_raw", device->id);
-        zmq_bind(device->raw_audio_in, addr);
-
-        device->mixed_audio_in = create_sock(ZMQ_PAIR);
-        if( device->mixed_audio_in == NULL ) {
-            fprintf(stderr, "Could not create mixed_audio_in socket for device %s\n", device->name);
-        }
-        sprintf(&addr[0], "inproc://dev%2d_mixed", device->id);
-        zmq_bind(device->mixed_audio_in, addr);
+        // Create the ring buffers the device callback and audio thread talk through.  These
+        // must exist before the stream starts, as the callback never checks for them.
+        choose_sample_rate(device);
+        device->raw_audio = new SPSCRingBuffer(RAW_AUDIO_SLOTS, device->buffer_samples*device->num_channels);
+        device->mixed_audio = new SPSCRingBuffer(device->num_prerender, device->buffer_samples*device->num_channels);
+        device->played = new SPSCTimeQueue(RAW_AUDIO_SLOTS);
+
+        // Start out faded out, so the first real buffer fades in
+        device->last_mixed = new float[device->buffer_samples*device->num_channels];
+        memset(device->last_mixed, 0, sizeof(float)*device->buffer_samples*device->num_channels);
+        device->concealing = true;
+        device->underruns.store(0);
 
         if( pthread_create(&device->thread, NULL, audio_thread, (void *)device) != 0 ) {
             fprintf(stderr, "pthread_create() failed!\n");
@@ -650,24 +1040,39 @@ AudioEngine::AudioEngine(std::vector<audio_device *> & devices) : devices(device
         //pthread_create(&monitor_thread, NULL, socket_monitor_thread, zmq_ctx);
     }
 
-    // Initialize encoded_data as well
-    this->encoded_data = new unsigned char[MAX_DATA_PACKET_LEN];
+    // Everything the broker needs is in place, so let it loose
+    if( pthread_create(&this->broker_thread, NULL, AudioEngine::broker_main, (void *)this) != 0 ) {
+        fprintf(stderr, "pthread_create() failed!\n");
+        throw "Error: Could not create broker thread!";
+    }
 }
 
 AudioEngine::~AudioEngine() {
+    // Stop the broker first, so that its sockets are ours again
+    audio_device_command cmd = {CMD_SHUTDOWN, 0};
+    sendCommand(this->ctl_sock, cmd);
+    pthread_join(this->broker_thread, NULL);
+
     // Send CMD_SHUTDOWN to everybody
     for( auto device : this->devices ) {
         zmq_send(this->cmd_sock, &device, sizeof(audio_device *), ZMQ_SNDMORE | ZMQ_DONTWAIT);
         audio_device_command cmd = {CMD_SHUTDOWN, 0};
         sendCommand(this->cmd_sock, cmd);
     }
+    if( this->decode_stage != NULL ) {
+        zmq_send(this->cmd_sock, &this->decode_stage, sizeof(DecodeStage *), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+        sendCommand(this->cmd_sock, cmd);
+    }
 
-    // Join all threads
+    // Join all threads; the audio threads first, as they may still be holding on to decoded frames
     for( auto device : this->devices ) {
-        zmq_close(device->raw_audio_in);
-        zmq_close(device->mixed_audio_in);
         pthread_join(device->thread, NULL);
+        delete device->raw_audio;
+        delete device->mixed_audio;
+        delete device->played;
+        delete[] device->last_mixed;
     }
+    delete this->decode_stage;
 
     // No more Port Audio for us.  :(
     Pa_Terminate();
@@ -677,6 +1082,9 @@ AudioEngine::~AudioEngine() {
     zmq_close(this->input_sock);
     zmq_close(this->output_sock);
     zmq_close(this->world_sock);
+    zmq_close(this->ctl_sock);
+    zmq_close(this->broker_ctl_sock);
+    delete this->udp;
 
     // Finally, terminate zmq!
     zmq_term(zmq_ctx);
@@ -708,8 +1116,8 @@ void AudioEngine::initBroker() {
         exit(0);
     }
 
-    // Initialize audio output PUB socket
-    this->output_sock = create_sock(ZMQ_PUB);
+    // Initialize audio output PUB socket; every client's packets go through here, so leave room for them all
+    this->output_sock = create_sock(ZMQ_PUB, 2*MAX_CLIENTS);
     bind_darnit(this->output_sock, "inproc://broker_output");
 
     // Initialize audio input ROUTER socket
@@ -720,12 +1128,87 @@ void AudioEngine::initBroker() {
     this->cmd_sock = create_sock(ZMQ_ROUTER);
     bind_darnit(this->cmd_sock, "inproc://broker_cmd");
 
-    // Client list accounting
+    // If we're talking UDP, that goes on the same port number
+    this->udp = NULL;
+    if( opts.udp ) {
+        this->udp = new UDPTransport(opts.port);
+        printf("Listening for UDP on port %d\n", opts.port);
+    }
+
+    // A multicast group is something we listen to if we play anything, and send to if we record anything
+    if( opts.multicast != "" ) {
+        bool plays = false, records = false;
+        for( auto device : this->devices ) {
+            plays |= device->direction != INPUT;
+            records |= device->direction != OUTPUT;
+        }
+        std::string group = UDPTransport::resolve(opts.multicast);
+        if( plays && !this->udp->joinGroup(opts.multicast) )
+            throw "Error: Could not join multicast group!";
+        if( records && (group == "" || !this->udp->addTarget(group)) ) {
+            fprintf(stderr, "Could not send to multicast group %s\n", opts.multicast.c_str());
+            throw "Error: Could not send to multicast group!";
+        }
+        if( plays )
+            printf("Listening to multicast group %s\n", opts.multicast.c_str());
+        if( records )
+            printf("Sending to multicast group %s\n", opts.multicast.c_str());
+    }
+
+    // Initialize the broker thread's control channel
+    this->broker_ctl_sock = create_sock(ZMQ_PAIR, 10);
+    bind_darnit(this->broker_ctl_sock, "inproc://broker_ctl");
+    this->ctl_sock = create_sock(ZMQ_PAIR, 10);
+    zmq_connect(this->ctl_sock, "inproc://broker_ctl");
+
+    // Client list accounting; hand out low slots first
+    for( int slot=MAX_CLIENTS-1; slot>=0; --slot )
+        this->free_slots.push_back(slot);
     this->client_list_dirty = false;
     this->last_clean = time_ms();
+    this->relay_plan_dirty = false;
+    this->listeners_dirty = false;
+    this->last_subscribe = 0.0;
+    this->last_clock_sync = 0.0;
+
+    // If we play anything, ask whoever we target to forward us audio, in case they're relays.  That needs
+    // our world_sock connected to them, which in direct mode it isn't.
+    this->subscribes = false;
+    for( auto device : this->devices )
+        this->subscribes |= device->direction != INPUT && !device->is_virtual && !opts.relay && !opts.direct;
 }
 
 void AudioEngine::connect(std::string addr) {
+    // Does this target want our audio batched up?
+    unsigned int batch = 1;
+    size_t slash = addr.rfind('/');
+    if( slash != std::string::npos ) {
+        std::string frames = addr.substr(slash + 1);
+        batch = atoi(frames.c_str());
+        if( !is_number(frames.c_str()) || batch < 1 || batch > MAX_BATCH_FRAMES ) {
+            printf("ERROR: Can't batch %s packets at a time (1 to %d)\n", frames.c_str(), MAX_BATCH_FRAMES);
+            return;
+        }
+        addr = addr.substr(0, slash);
+        if( opts.direct && batch > 1 ) {
+            printf("WARNING: Input devices sending directly don't batch; %s gets every packet on its own\n", addr.c_str());
+            batch = 1;
+        }
+    }
+
+    // Over UDP, there's nobody to ask; a peer is known by the address its datagrams come from
+    if( opts.udp ) {
+        std::string ident = UDPTransport::resolve(addr);
+        if( ident == "" ) {
+            printf("ERROR: Could not resolve %s\n", addr.c_str());
+            return;
+        }
+        std::string payload = addr + '\0' + ident + '\0' + (char)batch;
+        audio_device_command cmd = {CMD_CONNECT, (unsigned short)payload.size(), (char *)payload.data()};
+        sendCommand(this->ctl_sock, cmd);
+        return;
+    }
+
     // Let's find out the identity of this peer:
     std::string tcp_addr = "tcp://" + addr;
     void * ident_sock = create_sock(ZMQ_REQ);
@@ -748,25 +1231,418 @@ void AudioEngine::connect(std::string addr) {
     char client_ident[IDENT_LEN];
     int ident_len = zmq_recv(ident_sock, &client_ident[0], IDENT_LEN, 0);
     zmq_close(ident_sock);
-
-    // Insert the identity into outbound, and connect our world_sock!
-    this->outbound.insert(client_ident);
-    if( zmq_connect( this->world_sock, tcp_addr.c_str() ) != 0 ) {
-        printf("ERROR: Could not connect world sock to %s!\n", tcp_addr.c_str());
+    if( ident_len <= 0 || ident_len >= IDENT_LEN ) {
+        printf("ERROR: Got a bogus identity back from %s\n", tcp_addr.c_str());
         return;
     }
-    printf("Connected to %s (%s)\n", addr.c_str(), client_ident);
+    client_ident[ident_len] = 0;
+
+    // Have the broker thread insert the identity into outbound and connect our world_sock;
+    // it's sent over as the address and the identity, each NULL-terminated, then the batch size
+    std::string payload = tcp_addr + '\0' + client_ident + '\0' + (char)batch;
+    audio_device_command cmd = {CMD_CONNECT, (unsigned short)payload.size(), (char *)payload.data()};
+    sendCommand(this->ctl_sock, cmd);
 }
 
 void AudioEngine::disconnect(std::string addr) {
-    this->outbound.erase(addr);
+    audio_device_command cmd = {CMD_DISCONNECT, (unsigned short)(addr.size() + 1), (char *)addr.c_str()};
+    sendCommand(this->ctl_sock, cmd);
 }
 
+void AudioEngine::connectDirect(const char * tcp_addr, const char * client_ident) {
+    // Every input device sends as us; if there's more than one they each need an identity of
+    // their own, or the target would only ever hear from whichever connected last
+    bool first = true;
+    for( auto device : this->devices ) {
+        if( device->direction == OUTPUT )
+            continue;
+        std::string ident = this->identity;
+        if( !first )
+            ident += "#" + std::to_string(device->id);
+        first = false;
+
+        std::string payload = std::string(tcp_addr) + '\0' + client_ident + '\0' + ident + '\0';
+        audio_device_command cmd = {CMD_CONNECT, (unsigned short)payload.size(), (char *)payload.data()};
+        zmq_send(this->cmd_sock, &device, sizeof(audio_device *), ZMQ_SNDMORE);
+        sendCommand(this->cmd_sock, cmd);
+    }
+}
 
-void AudioEngine::processBroker() {
+void AudioEngine::forwardToInputs(const audio_device_command & cmd) {
+    for( auto device : this->devices ) {
+        if( device->direction == OUTPUT )
+            continue;
+        zmq_send(this->cmd_sock, &device, sizeof(audio_device *), ZMQ_SNDMORE);
+        sendCommand(this->cmd_sock, cmd);
+    }
+}
+
+void * AudioEngine::broker_main(void * engine) {
+    while( ((AudioEngine *)engine)->processBroker() )
+        ;
+    return NULL;
+}
+
+
+void AudioEngine::deliverPacket(const char * ident, zmq_msg_t * packet) {
+    // Don't bother the device threads with anything we can't make sense of
+    audio_packet_header hdr;
+    const unsigned char * data = (const unsigned char *)zmq_msg_data(packet);
+    int len = zmq_msg_size(packet);
+    if( !unpack_header(data, len, &hdr) ) {
+        fprintf(stderr, "Dropping unintelligible packet from %s\n", ident);
+        zmq_msg_close(packet);
+        return;
+    }
+
+    // Everybody answers when they're asked what time it is
+    if( hdr.type == PACKET_CLOCK_REQUEST || hdr.type == PACKET_CLOCK_REPLY ) {
+        this->handleClock(ident, hdr.type, data, len);
+        zmq_msg_close(packet);
+        return;
+    }
+
+    // Subscriptions are only for relays and mixers; anybody else just ignores them
+    if( hdr.type == PACKET_SUBSCRIBE ) {
+        if( opts.relay || opts.mixer )
+            this->handleSubscribe(ident, data, len);
+        zmq_msg_close(packet);
+        return;
+    }
+
+    // A relay telling us whose audio its stream IDs carry
+    if( hdr.type == PACKET_STREAMS ) {
+        if( !unpack_streams(data, len, &this->relayed_streams[ident]) )
+            fprintf(stderr, "Dropping mangled stream list from %s\n", ident);
+        zmq_msg_close(packet);
+        return;
+    }
+
+    // Several packets at once get split back up, and each goes on its way as though it came alone
+    if( hdr.type == PACKET_AUDIO_BATCH ) {
+        std::vector<batch_frame> frames;
+        if( !unpack_batch(data, len, SAMPLE_RATE, &frames) ) {
+            fprintf(stderr, "Dropping mangled batch from %s\n", ident);
+        } else {
+            for( auto& f : frames ) {
+                zmq_msg_t msg;
+                zmq_msg_init_size(&msg, PACKET_HEADER_LEN + f.len);
+                pack_header(&f.hdr, (unsigned char *)zmq_msg_data(&msg));
+                memcpy((unsigned char *)zmq_msg_data(&msg) + PACKET_HEADER_LEN, f.data, f.len);
+                this->deliverPacket(ident, &msg);
+            }
+        }
+        zmq_msg_close(packet);
+        return;
+    }
+
+    // Anything to be played at a set time was stamped on the clock of whoever sent it to us; move it onto
+    // ours (and it's then ours to forward, if we're a relay).  Until we know how, it's played whenever.
+    if( hdr.presentation_us != 0 ) {
+        ClockSync & clock = this->clocks[ident];
+        clock.last_heard = time_ms();
+        if( clock.synced() )
+            retime_packet((unsigned char *)zmq_msg_data(packet), clock.offset());
+        else
+            unschedule_packet((unsigned char *)zmq_msg_data(packet));
+    }
+
+    // If this came by way of a relay, it's really from whoever the relay says it is.  Until the
+    // relay has told us who that is, there's nobody to play it as.  We put it back the way it was
+    // originally sent; if we're a relay too, we'll mark it as one of our own streams instead.
+    std::string source = ident;
+    if( hdr.flags & PACKET_FLAG_RELAYED ) {
+        auto ritty = this->relayed_streams.find(ident);
+        if( ritty == this->relayed_streams.end() || !ritty->second.count(hdr.stream_id) ) {
+            zmq_msg_close(packet);
+            return;
+        }
+        source = ritty->second[hdr.stream_id];
+        unmark_relayed((unsigned char *)zmq_msg_data(packet));
+        ident = source.c_str();
+    }
+
+    // Find this client in our inbound list, adding it if it doesn't already exist
+    auto itty = this->inbound.find(ident);
+    if( itty == this->inbound.end() ) {
+        if( this->free_slots.empty() ) {
+            static double last_full_warning = 0.0;
+            if( time_ms() - last_full_warning > 5*1000.0 ) {
+                fprintf(stderr, "Already listening to %d clients, ignoring %s\n", MAX_CLIENTS, ident);
+                last_full_warning = time_ms();
+            }
+            zmq_msg_close(packet);
+            return;
+        }
+        inbound_client ic = {0.0, this->free_slots.back(), 0.0f};
+        this->free_slots.pop_back();
+        itty = this->inbound.insert(std::make_pair(std::string(ident), ic)).first;
+
+        // Set the client list as dirty, since we just added something new into it
+        printf("Let's take a minute to welcome %s to the party\n", ident);
+        this->client_list_dirty = true;
+    }
+    itty->second.last_heard = time_ms();
+
+    // As a relay, that's as far as it goes; it's straight back out the door to our subscribers
+    if( opts.relay ) {
+        if( hdr.num_samples > 0 ) {
+            float kbps = (8.0f*len)/(1000.0f*hdr.num_samples/SAMPLE_RATE)/1000.0f;
+            itty->second.kbps = itty->second.kbps == 0.0f ? kbps : itty->second.kbps + (kbps - itty->second.kbps)/16.0f;
+        }
+        this->relayPacket(itty->first, itty->second.slot, packet);
+        return;
+    }
+
+    // Send it on to device threads, tagged with the slot this client lives in.  Sending
+    // hands the message's buffer over to zmq, so the payload is never copied here.
+    zmq_send(this->output_sock, &itty->second.slot, sizeof(uint16_t), ZMQ_SNDMORE);
+    if( zmq_msg_send(packet, this->output_sock, 0) == -1 )
+        zmq_msg_close(packet);
+}
+
+void AudioEngine::sendToPeer(const std::string & ident, zmq_msg_t * msg) {
+    if( this->udp != NULL ) {
+        this->udp->sendTo(ident, (const unsigned char *)zmq_msg_data(msg), zmq_msg_size(msg));
+        zmq_msg_close(msg);
+        return;
+    }
+    zmq_send(this->world_sock, ident.c_str(), ident.size()+1, ZMQ_SNDMORE);
+    if( zmq_msg_send(msg, this->world_sock, 0) == -1 )
+        zmq_msg_close(msg);
+}
+
+void AudioEngine::batchPacket(const std::string & ident, outbound_target & target, audio_device * device, zmq_msg_t * packet) {
+    pending_batch & b = target.pending[device];
+    const unsigned char * data = (const unsigned char *)zmq_msg_data(packet);
+    int len = zmq_msg_size(packet);
+
+    // If it doesn't follow on from (or fit in with) what we've got, send that off and start again
+    int batch_len = batch_append(b.data, b.len, MAX_DATA_PACKET_LEN, data, len);
+    if( batch_len < 0 && b.len > 0 ) {
+        this->flushBatch(ident, b);
+        batch_len = batch_append(b.data, 0, MAX_DATA_PACKET_LEN, data, len);
+    }
+
+    // Something that won't batch at all just goes as it is
+    if( batch_len < 0 ) {
+        zmq_msg_t out;
+        zmq_msg_init(&out);
+        zmq_msg_copy(&out, packet);
+        this->sendToPeer(ident, &out);
+        return;
+    }
+    b.len = batch_len;
+    if( batch_count(b.data, b.len) >= target.batch )
+        this->flushBatch(ident, b);
+}
+
+void AudioEngine::flushBatch(const std::string & ident, pending_batch & batch) {
+    if( batch.len == 0 )
+        return;
+    zmq_msg_t msg;
+    zmq_msg_init_size(&msg, batch.len);
+    memcpy(zmq_msg_data(&msg), batch.data, batch.len);
+    this->sendToPeer(ident, &msg);
+    batch.len = 0;
+}
+
+void AudioEngine::relayPacket(const std::string & source, uint16_t stream_id, zmq_msg_t * packet) {
+    // Mark it as our stream_id; that's the only change we make to it, and it's made in place
+    zmq_msg_t relayed;
+    zmq_msg_init(&relayed);
+    zmq_msg_move(&relayed, packet);
+    zmq_msg_close(packet);
+    mark_relayed((unsigned char *)zmq_msg_data(&relayed), stream_id);
+
+    // Everybody who gets this shares the one copy of it; the last one takes the original
+    unsigned int remaining = 0;
+    for( auto& itty : this->subscribers )
+        remaining += itty.second.forwarding.count(source);
+    if( remaining == 0 ) {
+        zmq_msg_close(&relayed);
+        return;
+    }
+    for( auto& itty : this->subscribers ) {
+        if( !itty.second.forwarding.count(source) )
+            continue;
+        if( --remaining > 0 ) {
+            zmq_msg_t out;
+            zmq_msg_init(&out);
+            zmq_msg_copy(&out, &relayed);
+            this->sendToPeer(itty.first, &out);
+        } else
+            this->sendToPeer(itty.first, &relayed);
+    }
+}
+
+void AudioEngine::handleSubscribe(const char * ident, const unsigned char * data, int len) {
+    subscribe_request req;
+    if( !unpack_subscribe(data, len, &req) ) {
+        fprintf(stderr, "Dropping mangled subscription from %s\n", ident);
+        return;
+    }
+
+    auto itty = this->subscribers.find(ident);
+    if( itty == this->subscribers.end() ) {
+        printf("Relaying to %s\n", ident);
+        itty = this->subscribers.insert(std::make_pair(std::string(ident), relay_subscriber())).first;
+        this->relay_plan_dirty = true;
+        this->listeners_dirty = true;
+    } else if( itty->second.req.max_streams != req.max_streams || itty->second.req.max_kbps != req.max_kbps ||
+               itty->second.req.wanted != req.wanted )
+        this->relay_plan_dirty = true;
+    itty->second.req = req;
+    itty->second.last_heard = time_ms();
+
+    // Every subscription gets an answer of which stream is whom, in case the last one went missing
+    this->announceStreams(itty->first, itty->second);
+}
+
+void AudioEngine::announceStreams(const std::string & ident, const relay_subscriber & sub) {
+    // Our stream IDs are just our inbound slots
+    stream_map streams;
+    for( auto& source : sub.forwarding ) {
+        auto itty = this->inbound.find(source);
+        if( itty != this->inbound.end() )
+            streams[itty->second.slot] = source;
+    }
+
+    // However many packets it takes
+    unsigned char buff[MAX_DATA_PACKET_LEN];
+    stream_map::const_iterator next = streams.begin();
+    while( next != streams.end() ) {
+        int len = pack_streams(streams, next, buff, MAX_DATA_PACKET_LEN);
+        if( len < 0 )
+            break;
+        zmq_msg_t msg;
+        zmq_msg_init_size(&msg, len);
+        memcpy(zmq_msg_data(&msg), buff, len);
+        this->sendToPeer(ident, &msg);
+    }
+}
+
+void AudioEngine::planRelay() {
+    for( auto& sitty : this->subscribers ) {
+        relay_subscriber & sub = sitty.second;
+        std::unordered_set<std::string> forwarded = sub.forwarding;
+        sub.forwarding.clear();
+
+        // Line up who they could get, in order of preference: whoever they asked for, in the order they asked,
+        // or otherwise everybody in the order they showed up (approximately; slots get reused)
+        std::vector<std::pair<uint16_t, const std::string *>> candidates;
+        if( !sub.req.wanted.empty() ) {
+            for( unsigned int i=0; i<sub.req.wanted.size(); ++i ) {
+                auto itty = this->inbound.find(sub.req.wanted[i]);
+                if( itty != this->inbound.end() )
+                    candidates.push_back(std::make_pair(i, &itty->first));
+            }
+        } else {
+            for( auto& itty : this->inbound )
+                candidates.push_back(std::make_pair(itty.second.slot, &itty.first));
+            std::sort(candidates.begin(), candidates.end());
+        }
+
+        // Take as many as fit within their limits, never handing anybody back their own audio
+        float total_kbps = 0.0f;
+        for( auto& c : candidates ) {
+            if( *c.second == sitty.first )
+                continue;
+            if( sub.req.max_streams != 0 && sub.forwarding.size() >= sub.req.max_streams )
+                break;
+            float kbps = this->inbound[*c.second].kbps;
+            if( sub.req.max_kbps != 0 && total_kbps + kbps > sub.req.max_kbps )
+                continue;
+            sub.forwarding.insert(*c.second);
+            total_kbps += kbps;
+        }
+
+        // Let them know who they'll be hearing before they hear them.  Whoever replaced somebody
+        // in the same slot must have changed what we forward too, so nobody is left with a stale ID.
+        if( sub.forwarding != forwarded )
+            this->announceStreams(sitty.first, sub);
+    }
+    this->relay_plan_dirty = false;
+}
+
+void AudioEngine::sendSubscribe() {
+    subscribe_request req;
+    req.max_streams = opts.max_streams;
+    req.max_kbps = opts.max_kbps;
+    req.wanted = opts.listen_to;
+
+    unsigned char buff[MAX_DATA_PACKET_LEN];
+    int len = pack_subscribe(req, buff, MAX_DATA_PACKET_LEN);
+    if( len < 0 )
+        return;
+
+    if( this->udp != NULL ) {
+        // Anybody we batch for isn't in the UDP transport's list; see CMD_CONNECT
+        this->udp->sendToAll(buff, len);
+        for( auto& itty : this->outbound ) {
+            if( itty.second.batch > 1 )
+                this->udp->sendTo(itty.first, buff, len);
+        }
+    } else {
+        for( auto& itty : this->outbound ) {
+            zmq_send(this->world_sock, itty.first.c_str(), itty.first.size()+1, ZMQ_SNDMORE);
+            zmq_send(this->world_sock, buff, len, 0);
+        }
+    }
+    this->last_subscribe = time_ms();
+}
+
+void AudioEngine::syncClocks() {
+    double now = time_ms();
+    for( auto& itty : this->clocks ) {
+        ClockSync & clock = itty.second;
+        if( now - clock.last_request < (clock.synced() ? CLOCK_INTERVAL_MS : CLOCK_INTERVAL_MS/8) )
+            continue;
+
+        clock_stamps stamps = {(uint64_t)(now*1000.0), 0, 0};
+        zmq_msg_t msg;
+        zmq_msg_init_size(&msg, CLOCK_PACKET_LEN);
+        pack_clock(PACKET_CLOCK_REQUEST, stamps, (unsigned char *)zmq_msg_data(&msg), CLOCK_PACKET_LEN);
+        this->sendToPeer(itty.first, &msg);
+        clock.last_request = now;
+    }
+    this->last_clock_sync = now;
+}
+
+void AudioEngine::handleClock(const char * ident, uint8_t type, const unsigned char * data, int len) {
+    uint64_t now_us = (uint64_t)(time_ms()*1000.0);
+    clock_stamps stamps;
+    if( !unpack_clock(data, len, &stamps) ) {
+        fprintf(stderr, "Dropping mangled clock packet from %s\n", ident);
+        return;
+    }
+
+    // Somebody's asking us; tell them when we got that, and when we're answering
+    if( type == PACKET_CLOCK_REQUEST ) {
+        stamps.receive_us = now_us;
+        stamps.transmit_us = (uint64_t)(time_ms()*1000.0);
+        zmq_msg_t reply;
+        zmq_msg_init_size(&reply, CLOCK_PACKET_LEN);
+        pack_clock(PACKET_CLOCK_REPLY, stamps, (unsigned char *)zmq_msg_data(&reply), CLOCK_PACKET_LEN);
+        this->sendToPeer(ident, &reply);
+        return;
+    }
+
+    // Otherwise it's an answer; only ones to questions we're still asking count
+    auto itty = this->clocks.find(ident);
+    if( itty == this->clocks.end() )
+        return;
+    ClockSync & clock = itty->second;
+    bool was_synced = clock.synced();
+    clock.addExchange(stamps.origin_us, stamps.receive_us, stamps.transmit_us, now_us);
+    if( !was_synced && clock.synced() )
+        printf("Synced clocks with %s: %+.3fms from ours, %.3fms round trip\n", ident, clock.offset()/1000.0, clock.roundTrip()/1000.0);
+}
+
+bool AudioEngine::processBroker() {
     // Build up a pollitem_t group from our sockets
-    zmq_pollitem_t items[2];
-    memset(items, 0, sizeof(zmq_pollitem_t)*2);
+    zmq_pollitem_t items[5];
+    memset(items, 0, sizeof(zmq_pollitem_t)*5);
 
     // First up, world_sock!
     items[0].socket = this->world_sock;
@@ -776,9 +1652,82 @@ void AudioEngine::processBroker() {
     items[1].socket = this->input_sock;
     items[1].events = ZMQ_POLLIN;
 
-    // Check if we've got an event
-    int rc = zmq_poll(items, 2, 10);
+    // Then, anything anybody else wants us to do
+    items[2].socket = this->broker_ctl_sock;
+    items[2].events = ZMQ_POLLIN;
+
+    // Last, if we're talking UDP, our peers' datagrams (and the multicast group's, if we've joined one)
+    int num_items = 3;
+    if( this->udp != NULL ) {
+        items[3].fd = this->udp->getFd();
+        items[3].events = ZMQ_POLLIN;
+        num_items = 4;
+        if( this->udp->getGroupFd() >= 0 ) {
+            items[4].fd = this->udp->getGroupFd();
+            items[4].events = ZMQ_POLLIN;
+            num_items = 5;
+        }
+    }
+
+    // Sleep until something shows up, or until it's time to look for dead clients (or resubscribe)
+    double next_timer = this->last_clean + BROKER_CLEAN_MS;
+    if( this->subscribes )
+        next_timer = fmin(next_timer, this->last_subscribe + SUBSCRIBE_INTERVAL_MS);
+    if( !this->clocks.empty() )
+        next_timer = fmin(next_timer, this->last_clock_sync + CLOCK_INTERVAL_MS/8);
+    long timeout = (long)ceil(next_timer - time_ms());
+    int rc = zmq_poll(items, num_items, timeout < 0 ? 0 : timeout);
     if( rc > 0 ) {
+        if( items[2].revents & ZMQ_POLLIN ) {
+            audio_device_command cmd;
+            readCommand(this->broker_ctl_sock, &cmd);
+            switch( cmd.type ) {
+                case CMD_CONNECT: {
+                    // Address first, then identity, then how many packets they want at a time
+                    const char * tcp_addr = cmd.data;
+                    const char * client_ident = cmd.data + strlen(tcp_addr) + 1;
+                    outbound_target & target = this->outbound[client_ident];
+                    target.batch = (unsigned char)client_ident[strlen(client_ident) + 1];
+                    target.pending.clear();
+                    if( this->udp != NULL ) {
+                        // Everybody the transport sends to all at once gets every packet on its own,
+                        // so anybody we batch for we send to one at a time
+                        if( target.batch > 1 )
+                            printf("Sending to %s over UDP, %u packets at a time\n", client_ident, target.batch);
+                        else if( this->udp->addTarget(client_ident) )
+                            printf("Sending to %s over UDP\n", client_ident);
+                        else
+                            printf("ERROR: Could not send to %s over UDP!\n", client_ident);
+                    } else if( opts.direct ) {
+                        this->connectDirect(tcp_addr, client_ident);
+                        printf("Connected input devices directly to %s (%s)\n", tcp_addr, client_ident);
+                    } else if( zmq_connect(this->world_sock, tcp_addr) != 0 )
+                        printf("ERROR: Could not connect world sock to %s!\n", tcp_addr);
+                    else if( target.batch > 1 )
+                        printf("Connected to %s (%s), %u packets at a time\n", tcp_addr, client_ident, target.batch);
+                    else
+                        printf("Connected to %s (%s)\n", tcp_addr, client_ident);
+
+                    // Let them know what we want straight away, rather than waiting for the timer
+                    this->last_subscribe = 0.0;
+                }   break;
+                case CMD_DISCONNECT:
+                    this->outbound.erase(cmd.data);
+                    this->relayed_streams.erase(cmd.data);
+                    if( this->udp != NULL )
+                        this->udp->removeTarget(cmd.data);
+                    if( opts.direct )
+                        this->forwardToInputs(cmd);
+                    break;
+                case CMD_SHUTDOWN:
+                    return false;
+                case CMD_INVALID:
+                default:
+                    break;
+            }
+            delete[] cmd.data;
+        }
+
         // Did we get a message from the world?
         if( items[0].revents & ZMQ_POLLIN ) {
             // First, get the identity of the client talking to us:
@@ -787,37 +1736,36 @@ void AudioEngine::processBroker() {
 
             //printf("Received a world message from %s!\n", &client_tmp[0]);
 
-            // Get the decoded audio length, number of channels, and encoded audio:
-            int audio_len, num_channels;
-            // If this was an empty message, not an audio length at all, that's an ident request
-            if( zmq_recv(this->world_sock, &audio_len, sizeof(int), 0) == 0 ) {
+            // Get the packet itself.  If this was an empty message, not a packet at all, that's an ident request.
+            // We hold on to it as a message rather than copying it out, so it can be passed along as-is.
+            zmq_msg_t packet;
+            zmq_msg_init(&packet);
+            int datalen = zmq_msg_recv(&packet, this->world_sock, 0);
+            if( datalen == 0 ) {
                 // Clear empty message as well
-                zmq_recv(this->world_sock, &audio_len, sizeof(int), 0);
+                zmq_msg_recv(&packet, this->world_sock, 0);
+                zmq_msg_close(&packet);
 
                 printf("Returning identity %s to %s\n", this->identity.c_str(), &client_tmp[0]);
                 zmq_send(this->world_sock, &client_tmp[0], client_len, ZMQ_SNDMORE);
                 zmq_send(this->world_sock, 0, 0, ZMQ_SNDMORE);
                 zmq_send(this->world_sock, this->identity.c_str(), this->identity.size()+1, 0);
-            } else {
-                // Now, receive the num_channels, if we can.
-                zmq_recv(this->world_sock, &num_channels, sizeof(int), 0);
-
-                int datalen = zmq_recv(this->world_sock, this->encoded_data, MAX_DATA_PACKET_LEN, 0);
-
-                // send all pieces on to device threads, tagging it as originating from this client
-                zmq_send(this->output_sock, &client_tmp[0], client_len, ZMQ_SNDMORE);
-                zmq_send(this->output_sock, &audio_len, sizeof(int), ZMQ_SNDMORE);
-                zmq_send(this->output_sock, &num_channels, sizeof(int), ZMQ_SNDMORE);
-                zmq_send(this->output_sock, this->encoded_data, datalen, 0);
-
-                // Add this client to our inbound list, if it doesn't alread exist and timestamp it
-                bool new_inbound = this->inbound.find(&client_tmp[0]) == this->inbound.end();
-                this->inbound[&client_tmp[0]] = time_ms();
+            } else
+                this->deliverPacket(&client_tmp[0], &packet);
+        }
 
-                // Set the client list as dirty if we just added something new into it
-                if( new_inbound ) {
-                    printf("Let's take a minute to welcome %s to the party\n", &client_tmp[0]);
-                    this->client_list_dirty = true;
+        // Did we get anything over UDP?  Take it all in one go.
+        for( int item=3; item<num_items; ++item ) {
+            if( !(items[item].revents & ZMQ_POLLIN) )
+                continue;
+            udp_datagram datagrams[UDP_BATCH];
+            int num_datagrams;
+            while( (num_datagrams = this->udp->recvBatch(items[item].fd, datagrams)) > 0 ) {
+                for( int i=0; i<num_datagrams; ++i ) {
+                    zmq_msg_t packet;
+                    zmq_msg_init_size(&packet, datagrams[i].len);
+                    memcpy(zmq_msg_data(&packet), datagrams[i].data, datagrams[i].len);
+                    this->deliverPacket(datagrams[i].ident.c_str(), &packet);
                 }
             }
         }
@@ -829,32 +1777,87 @@ void AudioEngine::processBroker() {
             audio_device * device;
             zmq_recv(this->input_sock, &device, sizeof(audio_device *), 0);
 
-            // Next, get decoded audio len, number of channels, and actual encoded data:
-            int audio_len, num_channels;
-            zmq_recv(this->input_sock, &audio_len, sizeof(int), 0);
-            zmq_recv(this->input_sock, &num_channels, sizeof(int), 0);
-            int enc_len = zmq_recv(this->input_sock, this->encoded_data, MAX_DATA_PACKET_LEN, 0);
-
-            // Loop over all outbound clients
-            for( auto client_addr : outbound ) {
-                // First, direct the message at this client
-                zmq_send(this->world_sock, client_addr.c_str(), client_addr.size()+1, ZMQ_SNDMORE);
-
-                // Send the decoded length, number of channels, and actual encoded data
-                zmq_send(this->world_sock, &audio_len, sizeof(int), ZMQ_SNDMORE);
-                zmq_send(this->world_sock, &num_channels, sizeof(int), ZMQ_SNDMORE);
-                zmq_send(this->world_sock, this->encoded_data, enc_len, 0);
+            // Next, get the packet itself
+            zmq_msg_t packet;
+            zmq_msg_init(&packet);
+            zmq_msg_recv(&packet, this->input_sock, 0);
+
+            // A mix from the mixer comes with everybody it's meant for, each NULL-terminated
+            int more = 0;
+            size_t more_size = sizeof(int);
+            zmq_getsockopt(this->input_sock, ZMQ_RCVMORE, &more, &more_size);
+            if( more ) {
+                zmq_msg_t dests;
+                zmq_msg_init(&dests);
+                zmq_msg_recv(&dests, this->input_sock, 0);
+
+                std::vector<std::string> idents;
+                const char * data = (const char *)zmq_msg_data(&dests);
+                size_t len = zmq_msg_size(&dests);
+                for( size_t idx=0; idx < len; idx += idents.back().size() + 1 )
+                    idents.push_back(std::string(data + idx, strnlen(data + idx, len - idx)));
+                zmq_msg_close(&dests);
+
+                // They all share the one packet; the last one takes the original
+                for( size_t i=0; i<idents.size(); ++i ) {
+                    if( i + 1 < idents.size() ) {
+                        zmq_msg_t out;
+                        zmq_msg_init(&out);
+                        zmq_msg_copy(&out, &packet);
+                        this->sendToPeer(idents[i], &out);
+                    } else
+                        this->sendToPeer(idents[i], &packet);
+                }
+                if( idents.empty() )
+                    zmq_msg_close(&packet);
+            } else {
+                // Anybody who takes several packets at a time gets them once there are enough
+                for( auto& itty : this->outbound ) {
+                    if( itty.second.batch > 1 )
+                        this->batchPacket(itty.first, itty.second, device, &packet);
+                }
+
+                // Over UDP, that's one batch of datagrams all pointing at the same packet
+                if( this->udp != NULL )
+                    this->udp->sendToAll((const unsigned char *)zmq_msg_data(&packet), zmq_msg_size(&packet));
+
+                // Otherwise loop over all outbound clients that take one at a time.  Every one of them gets a copy of
+                // the message, which only bumps a reference count on the one payload buffer; the last just takes the original.
+                unsigned int remaining = 0;
+                if( this->udp == NULL ) {
+                    for( auto& itty : this->outbound )
+                        remaining += itty.second.batch <= 1;
+                }
+                for( auto& itty : this->outbound ) {
+                    if( remaining == 0 )
+                        break;
+                    if( itty.second.batch > 1 )
+                        continue;
+                    // First, direct the message at this client
+                    zmq_send(this->world_sock, itty.first.c_str(), itty.first.size()+1, ZMQ_SNDMORE);
+
+                    // Send the packet, header and all
+                    zmq_msg_t out;
+                    zmq_msg_init(&out);
+                    if( --remaining > 0 )
+                        zmq_msg_copy(&out, &packet);
+                    else
+                        zmq_msg_move(&out, &packet);
+                    if( zmq_msg_send(&out, this->world_sock, 0) == -1 )
+                        zmq_msg_close(&out);
+                }
+                zmq_msg_close(&packet);
             }
         }
     }
 
-    // Search for dead clients every 5 seconds
+    // Search for dead clients every BROKER_CLEAN_MS
     double curr_time = time_ms();
-    if( curr_time - this->last_clean > 5*1000.0f ) {
+    if( curr_time - this->last_clean >= BROKER_CLEAN_MS ) {
         std::unordered_set<std::string> to_delete;
         for( auto& itty : this->inbound ) {
             // If we haven't heard from somebody since the last clean, clean them!
-            if( this->last_clean > itty.second ) {
+            if( this->last_clean > itty.second.last_heard ) {
                 to_delete.insert(itty.first);
                 this->client_list_dirty = true;
             }
@@ -862,43 +1865,111 @@ void AudioEngine::processBroker() {
 
         for( auto& itty : to_delete ) {
             printf("Culling %s\n", itty.c_str());
+            this->free_slots.push_back(this->inbound[itty].slot);
             this->inbound.erase(itty);
         }
+
+        // And anybody we've stopped getting audio to be played at a set time from
+        for( auto itty = this->clocks.begin(); itty != this->clocks.end(); ) {
+            if( this->last_clean > itty->second.last_heard )
+                itty = this->clocks.erase(itty);
+            else
+                ++itty;
+        }
+
+        // Same goes for anybody who's stopped asking us to relay to them
+        for( auto itty = this->subscribers.begin(); itty != this->subscribers.end(); ) {
+            if( this->last_clean > itty->second.last_heard ) {
+                printf("No longer relaying to %s\n", itty->first.c_str());
+                if( this->udp != NULL )
+                    this->udp->forget(itty->first);
+                itty = this->subscribers.erase(itty);
+                this->listeners_dirty = true;
+            } else
+                ++itty;
+        }
+
+        // Everybody's bitrate has had a chance to change, too
+        this->relay_plan_dirty = true;
         this->last_clean = curr_time;
     }
 
+    // Remind our targets what we want
+    if( this->subscribes && curr_time - this->last_subscribe >= SUBSCRIBE_INTERVAL_MS )
+        this->sendSubscribe();
+
+    // Keep up with the clocks of everybody whose audio is to be played at a set time
+    if( !this->clocks.empty() && curr_time - this->last_clock_sync >= CLOCK_INTERVAL_MS/8 )
+        this->syncClocks();
+
+    // As a relay, work out who gets what whenever who's sending or who's listening changes
+    if( opts.relay && (this->client_list_dirty || this->relay_plan_dirty) )
+        this->planRelay();
+
+    // As a mixer, tell the mixing thread who it's mixing for
+    if( opts.mixer && this->listeners_dirty ) {
+        unsigned short ls_len = 0;
+        for( auto& itty : this->subscribers )
+            ls_len += itty.first.size() + 1;
+
+        char * listener_list = new char[ls_len];
+        int idx = 0;
+        for( auto& itty : this->subscribers ) {
+            memcpy(listener_list + idx, itty.first.c_str(), itty.first.size()+1);
+            idx += itty.first.size()+1;
+        }
+
+        audio_device_command ls_cmd = {CMD_LISTENERS, ls_len, listener_list};
+        for( auto device : this->devices ) {
+            if( !device->is_virtual )
+                continue;
+            zmq_send(this->cmd_sock, &device, sizeof(audio_device *), ZMQ_SNDMORE);
+            sendCommand(this->cmd_sock, ls_cmd);
+        }
+        delete[] listener_list;
+        this->listeners_dirty = false;
+    }
+
     // If we need to update our poor device threads, do so!
     if( this->client_list_dirty ) {
-        // Calculate total length
+        // Calculate total length; each client is its slot followed by its NULL-terminated identity
         unsigned short cl_len = 0;
-        for( auto itty : this->inbound )
-            cl_len += itty.first.size();
+        for( auto& itty : this->inbound )
+            cl_len += sizeof(uint16_t) + itty.first.size() + 1;
 
-        // Allocate enough for our identities, NULLs separating each, and the extra NULL at the end
-        char * client_list = new char[cl_len + this->inbound.size() + 1];
+        char * client_list = new char[cl_len];
 
         // Copy each in, paying special attention to copying NULL characters as well
         int idx = 0;
-        for( auto itty : this->inbound ) {
-            memcpy(client_list + idx, itty.first.c_str(), itty.first.size()+1);
-            idx += itty.first.size()+1;
+        for( auto& itty : this->inbound ) {
+            memcpy(client_list + idx, &itty.second.slot, sizeof(uint16_t));
+            memcpy(client_list + idx + sizeof(uint16_t), itty.first.c_str(), itty.first.size()+1);
+            idx += sizeof(uint16_t) + itty.first.size()+1;
         }
-        // The final NULL in the coffin (heh)
-        client_list[cl_len + this->inbound.size()] = 0;
 
-        // Send it over to audio threads, identifying it as a client list update!
+        // Send it over to the decode stage and every audio thread that plays anything, identifying
+        // it as a client list update!
+        audio_device_command cl_cmd = {CMD_CLIENTLIST, cl_len, client_list};
+        if( this->decode_stage != NULL ) {
+            zmq_send(this->cmd_sock, &this->decode_stage, sizeof(DecodeStage *), ZMQ_SNDMORE);
+            sendCommand(this->cmd_sock, cl_cmd);
+        }
         for( auto device : this->devices ) {
+            if( device->direction == INPUT )
+                continue;
+
             // First, direct this message to the appropriate device:
             zmq_send(this->cmd_sock, &device, sizeof(audio_device *), ZMQ_SNDMORE);
 
-            // Next, create the necessary command and blast it out onto the socket!
-            audio_device_command cl_cmd = {CMD_CLIENTLIST, (unsigned short )(cl_len + this->inbound.size() + 1), client_list};
+            // Next, blast the command out onto the socket!
             sendCommand(this->cmd_sock, cl_cmd);
         }
+        delete[] client_list;
 
         // We are no longer dirty!
         this->client_list_dirty = false;
     }
+    return true;
 }
 
 
@@ -998,7 +2069,6 @@ void sendCommand( void * sock, audio_device_command cmd ) {
         zmq_send(sock, &datalen, sizeof(unsigned short), ZMQ_SNDMORE | ZMQ_DONTWAIT);
         zmq_send(sock, cmd.data, cmd.datalen, ZMQ_DONTWAIT);
     } else {
-        zmq_send(sock, &cmd.type, sizeof(char), ZMQ_SNDMORE | ZMQ_DONTWAIT);
         zmq_send(sock, &cmd.datalen, sizeof(unsigned short), ZMQ_DONTWAIT);
     }
 }
@@ -1021,9 +2091,26 @@ int readCommand( void * sock, audio_device_command * cmd ) {
     cmd->datalen = ntohs(datalen);
 
     // If we successfully read in the type, let's construct a command object out of it
+    cmd->data = NULL;
     if( cmd->datalen > 0 ) {
         cmd->data = new char[cmd->datalen];
         zmq_recv(sock, cmd->data, cmd->datalen, 0);
     }
     return 0;
 }
+
+void parseClientList( const audio_device_command & cmd, std::vector<const char *> & listed ) {
+    listed.assign(MAX_CLIENTS, (const char *)NULL);
+
+    // The data field of cmd holds a list of clients, each one the slot the broker tags its
+    // packets with followed by its NULL-terminated identity
+    unsigned int idx = 0;
+    while( idx + sizeof(uint16_t) < cmd.datalen ) {
+        uint16_t slot;
+        memcpy(&slot, cmd.data + idx, sizeof(uint16_t));
+        const char * identity = cmd.data + idx + sizeof(uint16_t);
+        idx += sizeof(uint16_t) + strlen(identity) + 1;
+        if( slot < MAX_CLIENTS )
+            listed[slot] = identity;
+    }
+}
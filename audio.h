@@ -2,11 +2,56 @@
 #define AUDIO_H
 
 #include "popuset.h"
+#include "clienttable.h"
+#include "clocksync.h"
+#include "decodestage.h"
+#include "jitterbuffer.h"
+#include "mixkernels.h"
+#include "packet.h"
+#include "udptransport.h"
+#include <unordered_map>
 #include <unordered_set>
 
 // Our zmq context object which is used by errybody
 extern void * zmq_ctx;
 
+// Somebody sending us audio
+struct inbound_client {
+    // When we last heard from them, so we can cull them once they go quiet
+    double last_heard;
+
+    // Which slot of the audio threads' client tables they go in; their packets are tagged with this
+    uint16_t slot;
+
+    // Roughly how much bitrate they're sending us; only relays care
+    float kbps;
+};
+
+// Some of an input device's packets, waiting on the rest of their batch
+struct pending_batch {
+    unsigned char data[MAX_DATA_PACKET_LEN];
+    int len;
+};
+
+// Somebody we send audio to
+struct outbound_target {
+    // How many of an input device's packets we send them at a time, as a PACKET_AUDIO_BATCH (1 for no batching)
+    unsigned int batch;
+    std::unordered_map<audio_device *, pending_batch> pending;
+};
+
+// Somebody who's asked us, as a relay, to forward them audio
+struct relay_subscriber {
+    // When we last heard their subscription, so we can cull them once they go quiet
+    double last_heard;
+
+    // What they asked for
+    subscribe_request req;
+
+    // Which of our inbound clients we're forwarding to them right now, worked out by planRelay()
+    std::unordered_set<std::string> forwarding;
+};
+
 
 class AudioEngine {
 /*****************
@@ -18,15 +63,53 @@ public:
 	// Cleanup
 	~AudioEngine();
 
-	void processBroker();
-
-	// Connect to a client, add them to outbound
+	// Connect to a client, add them to outbound.  These can be called from any one thread
+	// (other than the broker's own), as they just pass the word along to the broker thread.
+	// A client that would rather get our audio K packets at a time is given as <addr>/<K>.
 	void connect(std::string addr);
 	void disconnect(std::string addr);
 protected:
 	// Initialize network broker thingy
 	void initBroker();
 
+	// The broker thread sleeps in processBroker() until a packet, a control message, or the
+	// next timer shows up, and returns false once it's been told to shut down
+	static void * broker_main(void * engine);
+	bool processBroker();
+
+	// Pass a packet from a client along to the decode stage (or on to our subscribers, if
+	// we're a relay), taking it off our hands
+	void deliverPacket(const char * ident, zmq_msg_t * packet);
+
+	// Send a message to a single peer, over whichever transport we're using, taking it off our hands
+	void sendToPeer(const std::string & ident, zmq_msg_t * msg);
+
+	// Add a packet from device onto the batch we're putting together for a target (leaving the packet
+	// itself alone), sending the batch off once it's full; flushBatch() sends it off regardless
+	void batchPacket(const std::string & ident, outbound_target & target, audio_device * device, zmq_msg_t * packet);
+	void flushBatch(const std::string & ident, pending_batch & batch);
+
+	// As a relay: forward a client's packet to everybody who should get it (as stream_id), keep track
+	// of who wants what, work out who gets what within the limits they've asked for, and tell a
+	// subscriber which stream IDs stand for whom
+	void relayPacket(const std::string & source, uint16_t stream_id, zmq_msg_t * packet);
+	void handleSubscribe(const char * ident, const unsigned char * data, int len);
+	void planRelay();
+	void announceStreams(const std::string & ident, const relay_subscriber & sub);
+
+	// As anybody else with something to play: ask our targets to forward us audio, in case they're relays
+	void sendSubscribe();
+
+	// Ask everybody who sends us audio to be played at a set time what time it is, and answer
+	// them (or anybody else) when they ask us; see ClockSync
+	void syncClocks();
+	void handleClock(const char * ident, uint8_t type, const unsigned char * data, int len);
+
+	// In direct mode, have every input device connect to this target itself, and pass along
+	// anything else the input devices need to hear about their direct connections
+	void connectDirect(const char * tcp_addr, const char * client_ident);
+	void forwardToInputs(const audio_device_command & cmd);
+
 	// Initialize opus encoder/decoder and port input/output for each device configured
 	bool initOpus(audio_device * device);
 	bool initPortAudio(audio_device * device);
@@ -36,22 +119,51 @@ protected:
 	void * world_sock;
 	std::string identity;
 
+	// Unless we've been told to use UDP instead, in which case this does the talking (and is NULL otherwise)
+	UDPTransport * udp;
+
 	// The sockets for output and input of audio data to the audio threads, PUB and ROUTER, respectively.
 	void * output_sock;
 	void * input_sock;
 
-	// The socket for telling audio threads what to do
+	// The socket for telling audio threads (and the decode stage) what to do
 	void * cmd_sock;
 
-	// Temp buffer for dealing with audio
-	unsigned char * encoded_data;
+	// How everybody else tells the broker thread what to do; we hold ctl_sock, the broker thread
+	// holds broker_ctl_sock.  Connections, disconnections and shutdown all come through here.
+	void * ctl_sock;
+	void * broker_ctl_sock;
+	pthread_t broker_thread;
+
+	// Decodes everything our clients send us, once, for all our devices
+	DecodeStage * decode_stage;
 
 	// Keeping track of who's with us, and who's against us
-	std::map<std::string, double> inbound;
-	std::unordered_set<std::string> outbound;
+	std::unordered_map<std::string, inbound_client> inbound;
+	std::vector<uint16_t> free_slots;
+	std::unordered_map<std::string, outbound_target> outbound;
 	double last_clean;
 	bool client_list_dirty;
 
+	// Who we relay to, and whether we need to work out again who gets what
+	std::unordered_map<std::string, relay_subscriber> subscribers;
+	bool relay_plan_dirty;
+
+	// As a mixer, whether the mixing thread needs to hear who it's mixing for again
+	bool listeners_dirty;
+
+	// Whether we ask our targets to forward us audio, and when we last told them what we want
+	bool subscribes;
+	double last_subscribe;
+
+	// What each relay we hear from has told us its stream IDs stand for
+	std::unordered_map<std::string, stream_map> relayed_streams;
+
+	// How far the clock of everybody sending us audio to be played at a set time is from ours
+	// (including relays, who move everything they forward onto their own clock first)
+	std::unordered_map<std::string, ClockSync> clocks;
+	double last_clock_sync;
+
 	// Our devices
 	std::vector<audio_device *> & devices;
 };
@@ -69,8 +181,15 @@ void * create_sock(int sock_type, int hwm = 2);
 // Get link-local IPv6 address; used to set socket identities...
 std::string get_link_local_ip6();
 
+// Bind, and complain if it doesn't work out
+bool bind_darnit( void * sock, const char * addr );
+
 // Helper function to read/write commands
 void sendCommand( void * sock, audio_device_command cmd );
 int readCommand( void * sock, audio_device_command * cmd );
 
+// Unpack a CMD_CLIENTLIST into the identity of whoever is in each slot (NULL if nobody is).
+// The identities point into cmd.data, so they're only good for as long as it is.
+void parseClientList( const audio_device_command & cmd, std::vector<const char *> & listed );
+
 #endif //AUDIO_H
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include "channelmatrix.h"
+#include "mixkernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+/***********
+* KERNELS *
+***********/
+// Anything goes; the compiler doesn't know how many channels we have, so this is the slow one
+static void mix_matrix_generic( const float * gains, const float * in, float * out, unsigned int num_samples,
+                                unsigned int in_channels, unsigned int out_channels ) {
+    for( unsigned int s=0; s<num_samples; ++s ) {
+        for( unsigned int k=0; k<out_channels; ++k ) {
+            float acc = 0.0f;
+            for( unsigned int i=0; i<in_channels; ++i )
+                acc += gains[k*in_channels + i]*in[s*in_channels + i];
+            out[s*out_channels + k] += acc;
+        }
+    }
+}
+
+// The same thing, but with the shape nailed down so the compiler can unroll the channel
+// loops entirely and keep the gains in registers.  Instantiated for the shapes we see most.
+template <unsigned int IN, unsigned int OUT>
+static void mix_matrix_fixed( const float * gains, const float * in, float * out, unsigned int num_samples,
+                              unsigned int, unsigned int ) {
+    float g[OUT*IN];
+    for( unsigned int j=0; j<OUT*IN; ++j )
+        g[j] = gains[j];
+
+    for( unsigned int s=0; s<num_samples; ++s ) {
+        for( unsigned int k=0; k<OUT; ++k ) {
+            float acc = 0.0f;
+            for( unsigned int i=0; i<IN; ++i )
+                acc += g[k*IN + i]*in[s*IN + i];
+            out[s*OUT + k] += acc;
+        }
+    }
+}
+
+// The special matrices that mixk already has kernels for
+static void mix_matrix_identity( const float *, const float * in, float * out, unsigned int num_samples,
+                                 unsigned int in_channels, unsigned int ) {
+    mixk.accumulate(out, in, num_samples*in_channels);
+}
+
+static void mix_matrix_upmix( const float *, const float * in, float * out, unsigned int num_samples,
+                              unsigned int, unsigned int out_channels ) {
+    mixk.upmix_mono(out, in, num_samples, out_channels);
+}
+
+static void mix_matrix_downmix( const float *, const float * in, float * out, unsigned int num_samples,
+                                unsigned int in_channels, unsigned int ) {
+    mixk.downmix_mono(out, in, num_samples, in_channels);
+}
+
+
+/*****************
+* CHANNELMATRIX *
+*****************/
+ChannelMatrix::ChannelMatrix( unsigned int in_channels, unsigned int out_channels ) {
+    this->in_channels = in_channels;
+    this->out_channels = out_channels;
+    this->gains = new float[in_channels*out_channels];
+    this->setDefault();
+}
+
+ChannelMatrix::ChannelMatrix( const ChannelMatrix & other ) {
+    this->in_channels = other.in_channels;
+    this->out_channels = other.out_channels;
+    this->gains = new float[in_channels*out_channels];
+    memcpy(this->gains, other.gains, sizeof(float)*in_channels*out_channels);
+    this->kernel = other.kernel;
+}
+
+ChannelMatrix::~ChannelMatrix() {
+    delete[] this->gains;
+}
+
+void ChannelMatrix::setDefault() {
+    memset(this->gains, 0, sizeof(float)*this->in_channels*this->out_channels);
+    if( this->in_channels == 1 || this->out_channels == 1 ) {
+        // Mono in goes everywhere, and everything gets averaged into mono out
+        for( unsigned int j=0; j<this->in_channels*this->out_channels; ++j )
+            this->gains[j] = 1.0f/this->in_channels;
+    } else {
+        // Wrap the inputs around the outputs, so stereo into 4 channels is L R L R, and 4 into stereo
+        // averages 0/2 into L and 1/3 into R.  When the counts match, this is just straight through.
+        for( unsigned int k=0; k<this->out_channels; ++k ) {
+            unsigned int num_sources = 0;
+            for( unsigned int i=0; i<this->in_channels; ++i ) {
+                if( this->defaultRoutes(i, k) )
+                    num_sources++;
+            }
+            for( unsigned int i=0; i<this->in_channels; ++i ) {
+                if( this->defaultRoutes(i, k) )
+                    this->gains[k*this->in_channels + i] = 1.0f/num_sources;
+            }
+        }
+    }
+    this->chooseKernel();
+}
+
+bool ChannelMatrix::defaultRoutes( unsigned int in_channel, unsigned int out_channel ) const {
+    if( this->in_channels <= this->out_channels )
+        return in_channel == out_channel % this->in_channels;
+    return out_channel == in_channel % this->out_channels;
+}
+
+float ChannelMatrix::getGain( unsigned int out_channel, unsigned int in_channel ) const {
+    return this->gains[out_channel*this->in_channels + in_channel];
+}
+
+void ChannelMatrix::setGain( unsigned int out_channel, unsigned int in_channel, float gain ) {
+    this->gains[out_channel*this->in_channels + in_channel] = gain;
+    this->chooseKernel();
+}
+
+void ChannelMatrix::chooseKernel() {
+    const unsigned int in_channels = this->in_channels, out_channels = this->out_channels;
+
+    // Is this one of the matrices mixk handles for us?
+    bool identity = in_channels == out_channels, upmix = in_channels == 1, downmix = out_channels == 1;
+    for( unsigned int k=0; k<out_channels; ++k ) {
+        for( unsigned int i=0; i<in_channels; ++i ) {
+            float g = this->gains[k*in_channels + i];
+            identity = identity && g == (i == k ? 1.0f : 0.0f);
+            upmix = upmix && g == 1.0f;
+            downmix = downmix && g == 1.0f/in_channels;
+        }
+    }
+
+    if( identity )
+        this->kernel = mix_matrix_identity;
+    else if( upmix )
+        this->kernel = mix_matrix_upmix;
+    else if( downmix )
+        this->kernel = mix_matrix_downmix;
+    else if( in_channels == 1 && out_channels == 2 )
+        this->kernel = mix_matrix_fixed<1, 2>;
+    else if( in_channels == 2 && out_channels == 2 )
+        this->kernel = mix_matrix_fixed<2, 2>;
+    else if( in_channels == 2 && out_channels == 1 )
+        this->kernel = mix_matrix_fixed<2, 1>;
+    else if( in_channels == 2 && out_channels == 8 )
+        this->kernel = mix_matrix_fixed<2, 8>;
+    else
+        this->kernel = mix_matrix_generic;
+}
+
+void ChannelMatrix::apply( const float * in, float * out, unsigned int num_samples ) const {
+    this->kernel(this->gains, in, out, num_samples, this->in_channels, this->out_channels);
+}
+
+unsigned int ChannelMatrix::getInChannels() const {
+    return this->in_channels;
+}
+
+unsigned int ChannelMatrix::getOutChannels() const {
+    return this->out_channels;
+}
+
+std::string ChannelMatrix::toString() const {
+    std::string s = std::to_string(this->in_channels) + "x" + std::to_string(this->out_channels) + ":";
+    char tmp[32];
+    for( unsigned int j=0; j<this->in_channels*this->out_channels; ++j ) {
+        snprintf(tmp, sizeof(tmp), j == 0 ? "%g" : ",%g", this->gains[j]);
+        s += tmp;
+    }
+    return s;
+}
+
+ChannelMatrix * ChannelMatrix::parse( const char * spec ) {
+    char * end;
+    long in_channels = strtol(spec, &end, 10);
+    if( end == spec || *end != 'x' || in_channels < 1 || in_channels > 255 )
+        return NULL;
+    const char * out_str = end + 1;
+    long out_channels = strtol(out_str, &end, 10);
+    if( end == out_str || *end != ':' || out_channels < 1 || out_channels > 255 )
+        return NULL;
+
+    ChannelMatrix * m = new ChannelMatrix(in_channels, out_channels);
+    const char * g = end + 1;
+    for( unsigned int j=0; j<in_channels*out_channels; ++j ) {
+        m->gains[j] = strtof(g, &end);
+        // Every gain has to be there, separated by commas, with nothing left over at the end
+        if( end == g || (*end != ',' && *end != 0) || (*end == 0) != (j == in_channels*out_channels - 1) ) {
+            delete m;
+            return NULL;
+        }
+        g = end + 1;
+    }
+    m->chooseKernel();
+    return m;
+}
+
+
+/**********
+* ROUTES *
+**********/
+bool parse_channel_route( const char * spec, channel_route * route ) {
+    route->device_id = -1;
+    route->client = "";
+    route->matrix = NULL;
+
+    // Everything after the last slash is the matrix itself
+    const char * matrix = strrchr(spec, '/');
+    if( matrix == NULL ) {
+        route->matrix = ChannelMatrix::parse(spec);
+        return route->matrix != NULL;
+    }
+
+    // Everything before it is a device id, a client identity, or a device id and then a client identity
+    std::string prefix(spec, matrix - spec);
+    size_t slash = prefix.find('/');
+    std::string first = prefix.substr(0, slash);
+    if( !first.empty() && first.find_first_not_of("0123456789") == std::string::npos ) {
+        route->device_id = atoi(first.c_str());
+        if( slash != std::string::npos )
+            route->client = prefix.substr(slash + 1);
+    } else {
+        route->client = prefix;
+    }
+
+    route->matrix = ChannelMatrix::parse(matrix + 1);
+    return route->matrix != NULL;
+}
+
+const ChannelMatrix * find_channel_route( const std::vector<channel_route> & routes, int device_id, const std::string & client,
+                                          unsigned int in_channels, unsigned int out_channels ) {
+    const ChannelMatrix * best = NULL;
+    int best_score = -1;
+    for( auto& r : routes ) {
+        if( r.matrix->getInChannels() != in_channels || r.matrix->getOutChannels() != out_channels )
+            continue;
+        if( r.device_id != -1 && r.device_id != device_id )
+            continue;
+        if( r.client != "" && r.client != client )
+            continue;
+
+        // Naming the client counts for more than naming the device; later routes win ties
+        int score = (r.client != "" ? 2 : 0) + (r.device_id != -1 ? 1 : 0);
+        if( score >= best_score ) {
+            best = r.matrix;
+            best_score = score;
+        }
+    }
+    return best;
+}
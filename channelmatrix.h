@@ -0,0 +1,81 @@
+#ifndef CHANNELMATRIX_H
+#define CHANNELMATRIX_H
+
+#include <string>
+#include <vector>
+
+/*
+Routes a buffer with in_channels interleaved channels into one with out_channels,
+with a gain for every (output, input) pair.  Output channel k of every sample gets
+    sum over i of gain(k, i)*in[i]
+ADDED into it, so that clients can be mixed straight into a shared buffer.  The most
+common shapes (1x2, 2x2, 2x1, 2x8) get kernels specialized at compile time, and the
+plain copy/upmix/downmix matrices go through mixk; anything else uses a generic loop.
+*/
+class ChannelMatrix {
+public:
+    // Builds the default routing for this shape; see setDefault()
+    ChannelMatrix( unsigned int in_channels, unsigned int out_channels );
+    ChannelMatrix( const ChannelMatrix & other );
+    ~ChannelMatrix();
+
+    // Parse "<in>x<out>:<gains>", where gains is a comma-separated list of out*in gains,
+    // one row of in_channels gains for each output channel.  Returns NULL if it's malformed.
+    static ChannelMatrix * parse( const char * spec );
+
+    // The default routing: straight through if the channel counts match, mono goes to every
+    // output, everything is averaged down to mono, and otherwise input i lands on output
+    // channels i, i + in_channels, ..., averaged if more than one input lands on an output.
+    void setDefault();
+
+    float getGain( unsigned int out_channel, unsigned int in_channel ) const;
+    void setGain( unsigned int out_channel, unsigned int in_channel, float gain );
+
+    // Mix num_samples samples of in into out
+    void apply( const float * in, float * out, unsigned int num_samples ) const;
+
+    unsigned int getInChannels() const;
+    unsigned int getOutChannels() const;
+
+    // Something like "2x4:1,0,0,1,1,0,0,1", for printing
+    std::string toString() const;
+
+protected:
+    // Figure out the fastest kernel for the gains we have right now
+    void chooseKernel();
+
+    // Whether setDefault() sends this input channel to this output channel
+    bool defaultRoutes( unsigned int in_channel, unsigned int out_channel ) const;
+
+    typedef void (*matrix_kernel)( const float * gains, const float * in, float * out, unsigned int num_samples,
+                                   unsigned int in_channels, unsigned int out_channels );
+
+    unsigned int in_channels, out_channels;
+    float * gains;
+    matrix_kernel kernel;
+};
+
+
+/*
+A user-supplied matrix, and who it applies to.  Routes for a particular client on a
+particular device beat routes for just that client, which beat routes for every
+client on that device.  When nothing matches we use the default matrix.
+*/
+struct channel_route {
+    // The portaudio device id this applies to, or -1 for every output device
+    int device_id;
+
+    // The identity of the client this applies to, or "" for every client
+    std::string client;
+
+    ChannelMatrix * matrix;
+};
+
+// Parse "[<device id>/][<client identity>/]<in>x<out>:<gains>", returning false if it's malformed
+bool parse_channel_route( const char * spec, channel_route * route );
+
+// The most specific route for this client on this device with the given shape, or NULL if there isn't one
+const ChannelMatrix * find_channel_route( const std::vector<channel_route> & routes, int device_id, const std::string & client,
+                                          unsigned int in_channels, unsigned int out_channels );
+
+#endif //CHANNELMATRIX_H
@@ -0,0 +1,79 @@
+#include "clienttable.h"
+
+ClientTable::ClientTable() {
+    this->slots = new client_slot[MAX_CLIENTS];
+    this->order = new int[MAX_CLIENTS];
+    this->position = new int[MAX_CLIENTS];
+    for( int i=0; i<MAX_CLIENTS; ++i ) {
+        this->order[i] = i;
+        this->position[i] = i;
+    }
+    this->num_active = 0;
+}
+
+ClientTable::~ClientTable() {
+    delete[] this->slots;
+    delete[] this->order;
+    delete[] this->position;
+}
+
+// Swap slot into order position pos, keeping position up to date
+static void move_to( int * order, int * position, int slot, int pos ) {
+    int other = order[pos];
+    order[position[slot]] = other;
+    position[other] = position[slot];
+    order[pos] = slot;
+    position[slot] = pos;
+}
+
+bool ClientTable::join( const std::string & ident, int slot ) {
+    if( slot < 0 || slot >= MAX_CLIENTS || this->inUse(slot) )
+        return false;
+
+    // Move it from somewhere amongst the free slots to just past the active ones
+    move_to(this->order, this->position, slot, this->num_active++);
+
+    client_slot * c = &this->slots[slot];
+    c->jb = NULL;
+    c->matrix = NULL;
+    c->gain = 1.0f;
+    c->mixed = false;
+    c->last_frame = NULL;
+    c->faded = false;
+    c->partial = NULL;
+    c->partial_samples = 0;
+    c->partial_play_ms = 0.0;
+    c->drift = NULL;
+    c->fading = false;
+    c->ident = ident;
+    return true;
+}
+
+void ClientTable::leave( int slot ) {
+    if( !this->inUse(slot) )
+        return;
+    this->slots[slot].ident.clear();
+
+    // Swap the last active slot into this one's position, so the active ones stay packed
+    move_to(this->order, this->position, slot, --this->num_active);
+}
+
+bool ClientTable::inUse( int slot ) const {
+    return slot >= 0 && slot < MAX_CLIENTS && this->position[slot] < (int)this->num_active;
+}
+
+unsigned int ClientTable::size() const {
+    return this->num_active;
+}
+
+client_slot * ClientTable::active( unsigned int n ) {
+    return &this->slots[this->order[n]];
+}
+
+int ClientTable::activeSlot( unsigned int n ) const {
+    return this->order[n];
+}
+
+client_slot * ClientTable::get( int slot ) {
+    return &this->slots[slot];
+}
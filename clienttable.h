@@ -0,0 +1,89 @@
+#ifndef CLIENTTABLE_H
+#define CLIENTTABLE_H
+
+#include <string>
+#include "channelmatrix.h"
+#include "jitterbuffer.h"
+#include "resampler.h"
+
+// The most clients we will listen to at once.  The broker tags every packet it passes on with
+// the sender's slot, so this is also how many distinct tags there are.
+#define MAX_CLIENTS             1024
+
+// Everything an audio thread knows about one client, kept together so the per-packet and
+// per-buffer paths touch one contiguous chunk of memory instead of a handful of maps
+struct client_slot {
+    // Decoded frames (already routed onto our channels) waiting to be played
+    JitterBuffer * jb;
+
+    // Created upon the first frame, as that's when we learn the client's channel count
+    ChannelMatrix * matrix;
+
+    // How loud this client is in our mix
+    float gain;
+
+    // Whether this client made it into the last buffer we mixed
+    bool mixed;
+
+    // The last frame we played from this client, and whether we've already faded it out
+    // because the client ran dry
+    float * last_frame;
+    bool faded;
+
+    // Whether fading out last_frame is what this client put into the last buffer we mixed
+    bool fading;
+
+    // Whatever we've gotten from this client (routed onto our channels) that doesn't make up a whole
+    // buffer yet, when the last of it arrived, when the start of it was captured, and when (if ever)
+    // the start of it should be heard
+    float * partial;
+    unsigned int partial_samples;
+    double partial_arrival_ms, partial_media_ms, partial_play_ms;
+
+    // On output devices other than the one the decode stage steers drift correction by, what's left
+    // of this client's drift from our own clock is corrected here, on its way into partial; NULL otherwise
+    DriftCorrector * drift;
+
+    // Only needed when clients come and go, and for printing
+    std::string ident;
+};
+
+/*
+Holds every client we're listening to, indexed by the slot the broker assigned it when it
+joined, so that getting from a tagged packet to its client is just an array index.  Slots in
+use are also kept packed at the front of a list, so that mixing can walk them without
+skipping holes.
+*/
+class ClientTable {
+public:
+    ClientTable();
+    ~ClientTable();
+
+    // Claim slot for ident, returning false if it's out of range or already taken.  The slot
+    // is zeroed, save for its ident and a unity gain; filling out the rest is up to the caller.
+    bool join( const std::string & ident, int slot );
+
+    // Give a slot back.  Whatever it points to should already be cleaned up.
+    void leave( int slot );
+
+    // Whether anybody is in slot right now
+    bool inUse( int slot ) const;
+
+    // How many clients are active, and the n'th of them
+    unsigned int size() const;
+    client_slot * active( unsigned int n );
+    int activeSlot( unsigned int n ) const;
+
+    client_slot * get( int slot );
+
+protected:
+    client_slot * slots;
+
+    // Indices into slots; the first num_active are in use, the rest are free
+    int * order;
+    // Where each slot sits within order
+    int * position;
+    unsigned int num_active;
+};
+
+#endif //CLIENTTABLE_H
@@ -0,0 +1,46 @@
+#include "clocksync.h"
+
+// How many exchanges we want under our belt before we'll trust the answer
+#define MIN_EXCHANGES           4
+
+ClockSync::ClockSync() {
+    this->last_heard = 0.0;
+    this->last_request = 0.0;
+    this->num_exchanges = 0;
+    this->best = 0;
+}
+
+void ClockSync::addExchange( uint64_t origin_us, uint64_t receive_us, uint64_t transmit_us, uint64_t reply_us ) {
+    // The whole trip, less however long the peer sat on it
+    int64_t round_trip = (int64_t)(reply_us - origin_us) - (int64_t)(transmit_us - receive_us);
+    if( round_trip < 0 )
+        round_trip = 0;
+
+    // Assuming it took as long to get there as to get back, the peer's clock is this far ahead of ours
+    int64_t offset = ((int64_t)(receive_us - origin_us) + (int64_t)(transmit_us - reply_us))/2;
+
+    unsigned int idx = this->num_exchanges % CLOCK_FILTER_LEN;
+    this->offsets[idx] = offset;
+    this->round_trips[idx] = round_trip;
+    this->num_exchanges++;
+
+    // Go by whichever of the ones we're keeping had the quickest round trip
+    unsigned int count = this->num_exchanges < CLOCK_FILTER_LEN ? this->num_exchanges : CLOCK_FILTER_LEN;
+    this->best = 0;
+    for( unsigned int i=1; i<count; ++i ) {
+        if( this->round_trips[i] < this->round_trips[this->best] )
+            this->best = i;
+    }
+}
+
+bool ClockSync::synced() const {
+    return this->num_exchanges >= MIN_EXCHANGES;
+}
+
+int64_t ClockSync::offset() const {
+    return this->num_exchanges > 0 ? this->offsets[this->best] : 0;
+}
+
+int64_t ClockSync::roundTrip() const {
+    return this->num_exchanges > 0 ? this->round_trips[this->best] : 0;
+}
@@ -0,0 +1,43 @@
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <stdint.h>
+
+// How many of the latest exchanges we pick the best of
+#define CLOCK_FILTER_LEN        8
+
+/*
+Works out how far a peer's wall clock is from ours, NTP-style.  Every so often we send the
+peer a PACKET_CLOCK_REQUEST stamped with our time, and it replies with when it got that and
+when it sent its reply, by its own clock.  Each exchange gives us a round trip time, and an
+offset between the two clocks which is off by at most half of that round trip (and only by
+that much if the trip there and the trip back took very different times).
+
+So that one slow exchange doesn't throw us off, we keep the last CLOCK_FILTER_LEN of them
+and go by whichever had the quickest round trip; on a quiet LAN (or between processes on
+one machine) that's good to within a few tens of microseconds.
+*/
+class ClockSync {
+public:
+    ClockSync();
+
+    // Account for an exchange: when we sent the request, when the peer got it and replied (by
+    // its clock), and when we got the reply back, all in microseconds
+    void addExchange( uint64_t origin_us, uint64_t receive_us, uint64_t transmit_us, uint64_t reply_us );
+
+    // Whether we've heard enough back to trust offset()
+    bool synced() const;
+
+    // How far ahead of ours the peer's clock is, and the round trip that told us so, in microseconds
+    int64_t offset() const;
+    int64_t roundTrip() const;
+
+    // When we last heard from (or about) this peer, and last asked it the time, in ms
+    double last_heard, last_request;
+
+protected:
+    int64_t offsets[CLOCK_FILTER_LEN], round_trips[CLOCK_FILTER_LEN];
+    unsigned int num_exchanges, best;
+};
+
+#endif //CLOCKSYNC_H
@@ -0,0 +1,445 @@
+#include "decodestage.h"
+#include "audio.h"
+#include "util.h"
+#include <zmq.h>
+
+// How many frames in a row we'll paper over with PLC/FEC when a client's packets go
+// missing; anything longer than that, we just let go silent
+#define MAX_PLC_FRAMES      5
+
+// How many multiples of a client's jitter (the same margin the jitter buffers keep) its next
+// packet can be late by before we take it that it's gone quiet, and start making frames up
+#define QUIET_MARGIN        3.0f
+
+// With more than one decode worker, the longest we'll hold a round open waiting for the
+// rest of our clients' packets to show up, so the workers have a worthwhile batch to split
+#define DECODE_BATCH_MS     2
+
+
+/*************
+* FRAMEPOOL *
+*************/
+void release_frame( pcm_frame * frame ) {
+    if( frame->refs.fetch_sub(1) == 1 )
+        frame->pool->put(frame);
+}
+
+FramePool::FramePool() {
+    pthread_mutex_init(&this->lock, NULL);
+}
+
+FramePool::~FramePool() {
+    for( auto frame : this->all_frames ) {
+        delete[] frame->samples;
+        delete frame;
+    }
+    pthread_mutex_destroy(&this->lock);
+}
+
+pcm_frame * FramePool::get() {
+    pthread_mutex_lock(&this->lock);
+    if( !this->free_frames.empty() ) {
+        pcm_frame * frame = this->free_frames.back();
+        this->free_frames.pop_back();
+        pthread_mutex_unlock(&this->lock);
+        return frame;
+    }
+
+    // Nothing to recycle, so we'll have to make a new one.  This only happens while warming up.
+    pcm_frame * frame = new pcm_frame();
+    frame->samples = new float[MAX_DECODE_CHANNELS*MAX_PCM_FRAME_SAMPLES];
+    frame->pool = this;
+    this->all_frames.push_back(frame);
+    pthread_mutex_unlock(&this->lock);
+    return frame;
+}
+
+void FramePool::put( pcm_frame * frame ) {
+    pthread_mutex_lock(&this->lock);
+    this->free_frames.push_back(frame);
+    pthread_mutex_unlock(&this->lock);
+}
+
+
+/***************
+* DECODESTAGE *
+***************/
+std::string DecodeStage::addressFor( audio_device * device ) {
+    char addr[64];
+    snprintf(addr, sizeof(addr), "inproc://decoded_%p", (void *)device);
+    return addr;
+}
+
+DecodeStage::DecodeStage( std::vector<audio_device *> & devices, unsigned int num_workers ) {
+    // The first output device we're sending to steers everybody's drift correction
+    this->rate_corrections = new std::atomic<float>[MAX_CLIENTS];
+    const std::atomic<float> * correction = NULL;
+    for( auto device : devices ) {
+        if( device->direction == INPUT )
+            continue;
+        device->rate_corrections = this->rate_corrections;
+        correction = this->rate_corrections;
+        break;
+    }
+
+    this->clients = new decode_slot[MAX_CLIENTS];
+    for( int slot=0; slot<MAX_CLIENTS; ++slot ) {
+        this->rate_corrections[slot].store(0.0f);
+        this->clients[slot].active = false;
+        this->clients[slot].decoder = NULL;
+        this->clients[slot].drift = NULL;
+        this->clients[slot].pcm = NULL;
+        this->clients[slot].correction = correction == NULL ? NULL : correction + slot;
+        this->clients[slot].pool = &this->pool;
+    }
+    this->first_waiting_ms = 0.0;
+
+    this->workers = new WorkerPool(num_workers, MAX_CLIENTS);
+    this->jobs = new pool_job[MAX_CLIENTS];
+
+    // Create our command channel, addressed just like the audio threads' are
+    this->cmd_sock = create_sock(ZMQ_DEALER, 10);
+    DecodeStage * self = this;
+    zmq_setsockopt(this->cmd_sock, ZMQ_IDENTITY, &self, sizeof(DecodeStage *));
+    zmq_connect(this->cmd_sock, "inproc://broker_cmd");
+
+    // Everything every client sends us comes in through here
+    this->packet_sock = create_sock(ZMQ_SUB, 2*MAX_CLIENTS);
+    zmq_setsockopt(this->packet_sock, ZMQ_SUBSCRIBE, "", 0);
+    zmq_connect(this->packet_sock, "inproc://broker_output");
+
+    // Bind a socket for each output device now, so that they're there by the time the audio threads connect
+    for( auto device : devices ) {
+        if( device->direction == INPUT )
+            continue;
+        void * sock = create_sock(ZMQ_PAIR, 2*MAX_CLIENTS);
+        bind_darnit(sock, DecodeStage::addressFor(device).c_str());
+        this->output_socks.push_back(sock);
+    }
+
+    if( pthread_create(&this->thread, NULL, DecodeStage::thread_main, (void *)this) != 0 ) {
+        fprintf(stderr, "pthread_create() failed!\n");
+        throw "Error: Could not create decode thread!";
+    }
+}
+
+DecodeStage::~DecodeStage() {
+    pthread_join(this->thread, NULL);
+    delete this->workers;
+    delete[] this->jobs;
+    delete[] this->clients;
+    delete[] this->rate_corrections;
+}
+
+void * DecodeStage::thread_main( void * stage ) {
+    ((DecodeStage *)stage)->run();
+    return NULL;
+}
+
+void DecodeStage::publish( uint16_t slot, pcm_frame * frame ) {
+    // Everybody gets a reference before anybody can let go of theirs
+    frame->refs.store(this->output_socks.size() + 1);
+    for( auto sock : this->output_socks ) {
+        // If an audio thread is so far behind it can't take any more, it just doesn't get this one
+        if( zmq_send(sock, &slot, sizeof(uint16_t), ZMQ_SNDMORE | ZMQ_DONTWAIT) != sizeof(uint16_t) ) {
+            release_frame(frame);
+            continue;
+        }
+        zmq_send(sock, &frame, sizeof(pcm_frame *), 0);
+    }
+    release_frame(frame);
+}
+
+bool DecodeStage::decodeFrame( decode_slot * c, const unsigned char * data, int len, unsigned int num_samples, int decode_fec, double arrival_ms, double media_ms, double play_ms ) {
+    int dec_len = opus_decode_float(c->decoder, data, len, c->pcm, num_samples, decode_fec);
+    if( dec_len != (int)num_samples )
+        return false;
+
+    // Stretch (or squeeze) it by however much the jitter buffers say this client's clock is off
+    // from ours.  Whatever the drift corrector was still holding on to comes out ahead of it.
+    double held_ms = (1000.0*c->drift->delay())/SAMPLE_RATE;
+    if( c->correction != NULL )
+        c->drift->adjust(c->correction->load(std::memory_order_relaxed));
+    pcm_frame * frame = c->pool->get();
+    frame->num_samples = c->drift->process(c->pcm, num_samples, frame->samples);
+
+    frame->num_channels = c->num_channels;
+    frame->arrival_ms = arrival_ms;
+    frame->media_ms = media_ms == 0.0 ? 0.0 : media_ms - held_ms;
+    frame->play_ms = play_ms == 0.0 ? 0.0 : play_ms - held_ms;
+    c->decoded.push_back(frame);
+    return true;
+}
+
+void DecodeStage::decodePending( void * client ) {
+    decode_slot * c = (decode_slot *)client;
+    for( auto& p : c->pending ) {
+        const unsigned char * packet = (const unsigned char *)zmq_msg_data(&p.msg);
+        int packet_len = zmq_msg_size(&p.msg);
+
+        audio_packet_header hdr;
+        if( !unpack_header(packet, packet_len, &hdr) || hdr.type != PACKET_AUDIO )
+            continue;
+        int enc_len = packet_len - PACKET_HEADER_LEN;
+
+        // Account for this packet; if it showed up after its successors, it's too late to play
+        stream_stats & sstats = c->stats;
+        int gap = update_stream_stats(&sstats, &hdr, p.arrival_ms);
+        if( gap < 0 )
+            continue;
+
+        // Any frame length opus can make will do; we don't have to be using the same one
+        if( !is_frame_size(hdr.num_samples) ) {
+            fprintf(stderr, "ERROR: %s sent %d samples, which isn't a frame length we know\n", c->ident.c_str(), hdr.num_samples);
+            continue;
+        }
+        if( hdr.num_channels < 1 || hdr.num_channels > MAX_DECODE_CHANNELS ) {
+            fprintf(stderr, "ERROR: %s sent %d channels, we can only decode up to %d\n", c->ident.c_str(), hdr.num_channels, MAX_DECODE_CHANNELS);
+            continue;
+        }
+
+        // If this is the first we've heard from this client, create its decoder now that we
+        // know how many channels it's sending us (or recreate it, if that's changed)
+        bool fresh_decoder = false;
+        if( c->decoder == NULL || c->num_channels != hdr.num_channels ) {
+            if( c->decoder != NULL )
+                opus_decoder_destroy(c->decoder);
+            c->decoder = opus_decoder_create(SAMPLE_RATE, hdr.num_channels, NULL);
+            c->num_channels = hdr.num_channels;
+            delete c->drift;
+            c->drift = new DriftCorrector(hdr.num_channels, MAX_FRAME_SAMPLES);
+            if( c->pcm == NULL )
+                c->pcm = new float[MAX_DECODE_CHANNELS*MAX_FRAME_SAMPLES];
+            fresh_decoder = true;
+        }
+        const unsigned char * opus_data = packet + PACKET_HEADER_LEN;
+
+        // If packets went missing right before this one (and not so many that we'd rather just
+        // go quiet), fill in for them so the decoder's output stays continuous.  All but the
+        // last are made up by PLC, the last can be rebuilt from the FEC data in this packet.
+        // We take it the missing packets were as long as this one.  Whatever we already made
+        // up while we were waiting for them has been sent on, so that doesn't need doing again.
+        unsigned int made_up = fresh_decoder ? 0 : c->quiet_frames;
+        c->quiet_frames = 0;
+        if( gap > (int)made_up && gap <= MAX_PLC_FRAMES && !fresh_decoder ) {
+            for( int k=made_up; k<gap-1; ++k ) {
+                if( decodeFrame(c, NULL, 0, hdr.num_samples, 0, 0.0, 0.0, 0.0) )
+                    sstats.concealed++;
+            }
+            if( decodeFrame(c, opus_data, enc_len, hdr.num_samples, 1, 0.0, 0.0, 0.0) )
+                sstats.recovered++;
+        }
+
+        // Keep up with how jittery this client is, and how long its frames are, so we know when to
+        // start worrying about the next one
+        double media_ms = (1000.0*sstats.timestamp)/SAMPLE_RATE;
+        if( c->frame_samples != 0 )
+            c->jitter_ms += (fabs((p.arrival_ms - c->last_arrival_ms) - (media_ms - c->last_media_ms)) - c->jitter_ms)/16.0f;
+        c->last_arrival_ms = p.arrival_ms;
+        c->last_media_ms = media_ms;
+        c->frame_samples = hdr.num_samples;
+
+        // Finally, decode this packet for real
+        if( !decodeFrame(c, opus_data, enc_len, hdr.num_samples, 0, p.arrival_ms, media_ms, hdr.presentation_us/1000.0) )
+            fprintf(stderr, "ERROR: Could not decode %d samples from %s\n", hdr.num_samples, c->ident.c_str());
+    }
+}
+
+void DecodeStage::runRound() {
+    // One job per client with something waiting, homed by slot so each decoder sticks to one worker
+    for( unsigned int j=0; j<this->waiting.size(); ++j ) {
+        this->jobs[j].home = this->waiting[j];
+        this->jobs[j].fn = DecodeStage::decodePending;
+        this->jobs[j].arg = &this->clients[this->waiting[j]];
+    }
+    this->workers->run(this->jobs, this->waiting.size());
+
+    // Everybody's joined, so now we can send it all on (zmq sockets being strictly one-thread-at-a-time)
+    for( auto slot : this->waiting ) {
+        decode_slot * c = &this->clients[slot];
+        for( auto frame : c->decoded )
+            this->publish(slot, frame);
+        c->decoded.clear();
+        for( auto& p : c->pending )
+            zmq_msg_close(&p.msg);
+        c->pending.clear();
+    }
+    this->waiting.clear();
+}
+
+double DecodeStage::concealQuiet() {
+    double now = time_ms(), next_ms = 0.0;
+    for( auto slot : this->active_slots ) {
+        decode_slot * c = &this->clients[slot];
+
+        // Nothing to go on yet, nothing more we're willing to make up, or its packets are already here
+        if( c->decoder == NULL || c->frame_samples == 0 || c->quiet_frames >= MAX_PLC_FRAMES || !c->pending.empty() )
+            continue;
+
+        // By the time its next packet is this late, every jitter buffer has used up the margin it keeps
+        // for jitter and is down to its last frame; from then on we fill in one frame a frame's length
+        float frame_ms = (1000.0f*c->frame_samples)/SAMPLE_RATE;
+        double overdue_ms = c->last_arrival_ms + frame_ms*(c->quiet_frames + 1) + QUIET_MARGIN*c->jitter_ms + frame_ms/2;
+        if( now < overdue_ms ) {
+            if( next_ms == 0.0 || overdue_ms < next_ms )
+                next_ms = overdue_ms;
+            continue;
+        }
+
+        // These are ours to make up, not the packets' to fill in for, so they count against the next gap
+        c->quiet_frames++;
+        if( decodeFrame(c, NULL, 0, c->frame_samples, 0, 0.0, 0.0, 0.0) ) {
+            c->stats.concealed++;
+            this->publish(slot, c->decoded.back());
+            c->decoded.clear();
+        }
+        if( c->quiet_frames < MAX_PLC_FRAMES && (next_ms == 0.0 || overdue_ms + frame_ms < next_ms) )
+            next_ms = overdue_ms + frame_ms;
+    }
+    return next_ms;
+}
+
+void DecodeStage::run() {
+    zmq_pollitem_t items[2];
+    memset(items, 0, sizeof(items));
+    items[0].socket = this->cmd_sock;
+    items[0].events = ZMQ_POLLIN;
+    items[1].socket = this->packet_sock;
+    items[1].events = ZMQ_POLLIN;
+
+    bool keepRunning = true;
+    while( keepRunning ) {
+        // Fill in for anybody who's gone quiet on us, then only wait until the next one would be
+        // overdue, or as long as we're willing to hold a round open, if we're holding one
+        long timeout = -1;
+        double quiet_ms = this->concealQuiet();
+        if( quiet_ms != 0.0 )
+            timeout = fmax(0.0, ceil(quiet_ms - time_ms()));
+        if( !this->waiting.empty() ) {
+            long batch_timeout = fmax(0.0, ceil(DECODE_BATCH_MS - (time_ms() - this->first_waiting_ms)));
+            if( timeout < 0 || batch_timeout < timeout )
+                timeout = batch_timeout;
+        }
+        int rc = zmq_poll(items, 2, timeout);
+        if( rc < 0 ) {
+            fprintf(stderr, "zmq_poll() == %d: %s\n", rc, strerror(errno) );
+            break;
+        }
+
+        // Gather up everything that's waiting
+        while( items[1].revents & ZMQ_POLLIN ) {
+            // The slot the broker tagged this client with comes first
+            uint16_t slot;
+            if( zmq_recv(this->packet_sock, &slot, sizeof(uint16_t), ZMQ_DONTWAIT) == -1 )
+                break;
+
+            // Next, the packet itself; header and audio all in one.  We hang on to the message
+            // itself rather than copying it out, until its round is over.
+            pending_packet p;
+            zmq_msg_init(&p.msg);
+            if( zmq_msg_recv(&p.msg, this->packet_sock, 0) == -1 ) {
+                zmq_msg_close(&p.msg);
+                continue;
+            }
+            p.arrival_ms = time_ms();
+
+            // This can happen if the packet beat the client list that announces its sender
+            if( slot >= MAX_CLIENTS || !this->clients[slot].active ) {
+                zmq_msg_close(&p.msg);
+                continue;
+            }
+
+            decode_slot * c = &this->clients[slot];
+            if( c->pending.empty() ) {
+                if( this->waiting.empty() )
+                    this->first_waiting_ms = p.arrival_ms;
+                this->waiting.push_back(slot);
+            }
+            c->pending.push_back(p);
+        }
+
+        // Decode a round if everybody's here, if we've waited long enough for the rest, or if
+        // there's nobody to share the work with anyway
+        if( !this->waiting.empty() && (this->workers->getNumWorkers() == 1 || this->waiting.size() >= this->active_slots.size() ||
+                                        time_ms() - this->first_waiting_ms >= DECODE_BATCH_MS) )
+            this->runRound();
+
+        if( items[0].revents & ZMQ_POLLIN ) {
+            // Don't pull the rug out from under anything that's still waiting
+            if( !this->waiting.empty() )
+                this->runRound();
+
+            audio_device_command cmd;
+            readCommand(this->cmd_sock, &cmd);
+            switch( cmd.type ) {
+                case CMD_CLIENTLIST: {
+                    std::vector<const char *> listed;
+                    parseClientList(cmd, listed);
+
+                    // Let go of anybody who's gone (or whose slot has been given to somebody else)
+                    for( int slot=0; slot<MAX_CLIENTS; ++slot ) {
+                        decode_slot * c = &this->clients[slot];
+                        if( !c->active || (listed[slot] != NULL && c->ident == listed[slot]) )
+                            continue;
+
+                        stream_stats & sstats = c->stats;
+                        printf("%s: %u packets, %u lost, %u late, %u recovered, %u concealed, %u resets, latency %.1fms\n", c->ident.c_str(),
+                               sstats.received, sstats.lost, sstats.late, sstats.recovered, sstats.concealed, sstats.resets, sstats.latency_ms);
+                        if( c->decoder != NULL )
+                            opus_decoder_destroy(c->decoder);
+                        c->decoder = NULL;
+                        delete c->drift;
+                        c->drift = NULL;
+                        delete[] c->pcm;
+                        c->pcm = NULL;
+                        c->active = false;
+                        for( unsigned int k=0; k<this->active_slots.size(); ++k ) {
+                            if( this->active_slots[k] == slot ) {
+                                this->active_slots[k] = this->active_slots.back();
+                                this->active_slots.pop_back();
+                                break;
+                            }
+                        }
+                    }
+
+                    // And welcome anybody new
+                    for( int slot=0; slot<MAX_CLIENTS; ++slot ) {
+                        decode_slot * c = &this->clients[slot];
+                        if( listed[slot] == NULL || c->active )
+                            continue;
+                        c->active = true;
+                        c->ident = listed[slot];
+                        c->num_channels = 0;
+                        init_stream_stats(&c->stats);
+                        c->jitter_ms = 0.0f;
+                        c->frame_samples = 0;
+                        c->quiet_frames = 0;
+                        this->active_slots.push_back(slot);
+                    }
+                    delete[] cmd.data;
+                }   break;
+                case CMD_SHUTDOWN:
+                    keepRunning = false;
+                    break;
+                case CMD_INVALID:
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Cleanup our decoders and sockets
+    for( int slot=0; slot<MAX_CLIENTS; ++slot ) {
+        decode_slot * c = &this->clients[slot];
+        if( c->decoder != NULL )
+            opus_decoder_destroy(c->decoder);
+        delete c->drift;
+        delete[] c->pcm;
+        for( auto& p : c->pending )
+            zmq_msg_close(&p.msg);
+    }
+    zmq_close(this->cmd_sock);
+    zmq_close(this->packet_sock);
+    for( auto sock : this->output_socks )
+        zmq_close(sock);
+}
@@ -0,0 +1,180 @@
+#ifndef DECODESTAGE_H
+#define DECODESTAGE_H
+
+#include "popuset.h"
+#include "clienttable.h"
+#include "packet.h"
+#include "workerpool.h"
+#include "resampler.h"
+#include <atomic>
+#include <zmq.h>
+
+// Opus itself will only decode mono or stereo
+#define MAX_DECODE_CHANNELS     2
+
+// The longest frame we send on; drift correction can stretch one a few samples past what Opus made
+#define MAX_PCM_FRAME_SAMPLES   DriftCorrector::maxOutput(MAX_FRAME_SAMPLES)
+
+class FramePool;
+
+/*
+One client's decoded audio for a single frame, in the client's own channel layout and frame length
+(give or take the odd sample drift correction adds or takes away).
+Every output device gets a pointer to the same frame, and the last one to let go of it
+hands it back to the pool it came from.
+*/
+struct pcm_frame {
+    std::atomic<int> refs;
+
+    unsigned short num_channels;
+    unsigned short num_samples;
+
+    // When the packet this came out of arrived, and when it was captured according to the
+    // sender's sample clock.  Frames we made up ourselves (PLC, FEC) have an arrival_ms of 0.
+    double arrival_ms, media_ms;
+
+    // When (on our wall clock) its sender wants it to start playing, or 0 if it doesn't mind
+    double play_ms;
+
+    // num_samples*num_channels interleaved samples
+    float * samples;
+
+    FramePool * pool;
+};
+
+// Let go of a frame; if we were the last one holding on to it, it goes back to its pool
+void release_frame( pcm_frame * frame );
+
+/*
+Recycles pcm_frames so that nothing is allocated per packet once we've warmed up.  The
+decode stage takes frames out, and whichever audio thread releases one last puts it back.
+*/
+class FramePool {
+public:
+    FramePool();
+    ~FramePool();
+
+    pcm_frame * get();
+    void put( pcm_frame * frame );
+
+protected:
+    pthread_mutex_t lock;
+    std::vector<pcm_frame *> free_frames;
+    std::vector<pcm_frame *> all_frames;
+};
+
+
+/*
+Decodes every inbound client's packets exactly once, no matter how many output devices
+we have, and fans the PCM out to their audio threads by reference.  It owns everything
+about a client that describes the stream itself rather than how one device plays it:
+its decoder, its loss/reordering accounting (including filling in for lost packets
+with FEC and PLC), and its drift correction.  That goes for a client that's gone quiet, too: once its next packet
+is overdue by more than its jitter explains, we make frames up with PLC on a timer, so
+that every device's jitter buffer keeps playing something continuous, for a while.
+
+Drift correction is steered by the first output device's jitter buffers: how much faster
+they'd like a client's audio to come is handed back through that device's rate_corrections,
+and every frame is stretched or squeezed by it once, here, on its way to every device.
+Any other output device's clock is off from that one's by a little too, so each of those
+corrects what's left itself, per client, steered by its own jitter buffers.
+
+Packets are gathered up per client and decoded in rounds across a WorkerPool, each
+client's home worker being fixed by its slot so its decoder state stays on one core.
+With more than one worker, we hold a round until every client has something waiting
+(or the first packet has waited DECODE_BATCH_MS) so that the workers have enough to
+share between them; once a round has joined, its frames are sent on.
+
+    Broker [PUB] -> DecodeStage [SUB], packets tagged with their client's slot
+    DecodeStage [PAIR] -> Audio thread [PAIR], pcm_frame pointers tagged the same way
+*/
+class DecodeStage {
+public:
+    // Binds a socket for each output device to connect to, then starts decoding with num_workers threads
+    DecodeStage( std::vector<audio_device *> & devices, unsigned int num_workers );
+    // Waits for the thread to finish (it must have been sent CMD_SHUTDOWN); any frames
+    // still in flight are freed along with the pool, so the audio threads must be done too
+    ~DecodeStage();
+
+    // Where the audio thread for this device should connect to get its decoded frames
+    static std::string addressFor( audio_device * device );
+
+protected:
+    static void * thread_main( void * stage );
+    void run();
+
+    // A packet waiting for its turn to be decoded, and when it got here
+    struct pending_packet {
+        zmq_msg_t msg;
+        double arrival_ms;
+    };
+
+    // Everything we know about one client
+    struct decode_slot {
+        bool active;
+        std::string ident;
+        OpusDecoder * decoder;
+        unsigned short num_channels;
+        stream_stats stats;
+
+        // When its last packet got here and was captured, and how jittery its arrivals are (RFC
+        // 3550 style, like the jitter buffers), so we know when the next one's overdue.  Then how
+        // long its frames are, and how many we've made up with PLC since because it hasn't shown.
+        double last_arrival_ms, last_media_ms;
+        float jitter_ms;
+        unsigned int frame_samples, quiet_frames;
+
+        // Keeps this client's clock in step with our own, by however much (in ppm) correction says;
+        // what comes out of the decoder goes into pcm on its way through
+        DriftCorrector * drift;
+        float * pcm;
+        const std::atomic<float> * correction;
+
+        // Filled by the receiving loop, emptied by whichever worker decodes this client
+        std::vector<pending_packet> pending;
+        // Filled by that worker, emptied once the round has joined and we send them on
+        std::vector<pcm_frame *> decoded;
+
+        FramePool * pool;
+    };
+    decode_slot * clients;
+    std::vector<uint16_t> active_slots;
+
+    // One for each client slot, handed to the output device that steers drift correction
+    std::atomic<float> * rate_corrections;
+
+    // Decode everything pending for one client (a decode_slot); run on a worker
+    static void decodePending( void * client );
+
+    // Decode one frame of num_samples (or have the decoder make one up, if data is NULL) onto c->decoded
+    static bool decodeFrame( decode_slot * c, const unsigned char * data, int len, unsigned int num_samples, int decode_fec, double arrival_ms, double media_ms, double play_ms );
+
+    // Decode everything that's waiting across the workers, then send it all on
+    void runRound();
+
+    // Make up a frame for everybody whose next packet is overdue, and send it on; returns when the
+    // next one will be overdue (on our wall clock), or 0 if nobody's waiting on anything
+    double concealQuiet();
+
+    // Hand a freshly decoded frame to every output device
+    void publish( uint16_t slot, pcm_frame * frame );
+
+    // Slots that have packets waiting, and when the oldest of them got here
+    std::vector<uint16_t> waiting;
+    double first_waiting_ms;
+
+    WorkerPool * workers;
+    pool_job * jobs;
+
+    // Broker [ROUTER] -> DecodeStage [DEALER], client lists and shutdown
+    void * cmd_sock;
+    // Broker [PUB] -> DecodeStage [SUB], every client's packets
+    void * packet_sock;
+    // One for each output device
+    std::vector<void *> output_socks;
+
+    FramePool pool;
+    pthread_t thread;
+};
+
+#endif //DECODESTAGE_H
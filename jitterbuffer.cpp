@@ -0,0 +1,198 @@
+#include "jitterbuffer.h"
+#include <string.h>
+#include <math.h>
+
+// How many multiples of the measured jitter we try to keep buffered
+#define JITTER_MARGIN       3.0f
+// How many frames past target_depth we tolerate before we start thinking about dropping
+#define DEEP_SLACK          2
+// How many reads in a row we must be too deep before we actually drop a frame
+#define DEEP_PATIENCE       100
+
+// How long we average our depth over before reacting to it, and how hard we react: DRIFT_KP ppm
+// for every ms we're off target, plus DRIFT_KI ppm for every ms*second we've been off target.
+// Slow enough to ignore jitter and never be heard, while still settling inside a few minutes.
+#define DRIFT_SMOOTHING_MS  2000.0f
+#define DRIFT_KP            10.0f
+#define DRIFT_KI            0.05f
+// No sound card we'd want to listen to is this far off
+#define MAX_DRIFT_PPM       500.0f
+
+// The same, for scheduled frames.  Being off schedule is measured much more precisely than being
+// off target_depth, so we can afford to react a lot faster: half a frame off is steered out in
+// a few seconds, without shifting pitch by more than a couple of cents on the way.
+#define SYNC_SMOOTHING_MS   200.0f
+#define SYNC_KP             200.0f
+#define SYNC_KI             20.0f
+#define MAX_SYNC_PPM        1000.0f
+
+JitterBuffer::JitterBuffer( const unsigned int capacity, const unsigned int frame_len, const float frame_ms ) {
+    this->capacity = capacity;
+    this->frame_len = frame_len;
+    this->data = new float[capacity*frame_len];
+    memset(this->data, 0, sizeof(float)*capacity*frame_len);
+    this->play_at = new double[capacity];
+    this->read_idx = 0;
+    this->count = 0;
+
+    this->frame_ms = frame_ms;
+    this->jitter_ms = 0.0f;
+    this->last_arrival = -1.0;
+    this->last_media = 0.0;
+
+    this->target_depth = 1;
+    this->deep_count = 0;
+    this->playing = false;
+
+    this->drops = 0;
+    this->underruns = 0;
+
+    this->depth_avg = 0.0f;
+    this->drift_ppm = 0.0f;
+    this->correction_ppm = 0.0f;
+
+    this->scheduled = false;
+    this->sync_error_ms = 0.0f;
+}
+
+JitterBuffer::~JitterBuffer() {
+    delete[] this->data;
+    delete[] this->play_at;
+}
+
+void JitterBuffer::dropOldest() {
+    this->read_idx = (this->read_idx + 1)%this->capacity;
+    this->count--;
+    this->drops++;
+}
+
+float * JitterBuffer::writeSlot() {
+    if( this->count == this->capacity )
+        this->dropOldest();
+    return this->data + ((this->read_idx + this->count)%this->capacity)*this->frame_len;
+}
+
+void JitterBuffer::commitWrite( double arrival_ms, double media_ms, double play_ms ) {
+    this->commitWrite(play_ms);
+
+    // Update our jitter estimate (RFC 3550 style) with how far off this arrival was from the
+    // spacing the sender captured it at.  This way a lost packet doesn't look like jitter.
+    if( this->last_arrival >= 0.0 ) {
+        float deviation = fabs((arrival_ms - this->last_arrival) - (media_ms - this->last_media));
+        this->jitter_ms += (deviation - this->jitter_ms)/16.0f;
+    }
+    this->last_arrival = arrival_ms;
+    this->last_media = media_ms;
+
+    // Keep enough frames around to ride out JITTER_MARGIN times that jitter, within reason
+    this->target_depth = 1 + (unsigned int)ceil(JITTER_MARGIN*this->jitter_ms/this->frame_ms);
+    if( this->target_depth > this->capacity/2 )
+        this->target_depth = this->capacity/2;
+}
+
+void JitterBuffer::commitWrite( double play_ms ) {
+    this->play_at[(this->read_idx + this->count)%this->capacity] = play_ms;
+    this->count++;
+}
+
+const float * JitterBuffer::pop() {
+    const float * frame = this->data + this->read_idx*this->frame_len;
+    this->read_idx = (this->read_idx + 1)%this->capacity;
+    this->count--;
+    return frame;
+}
+
+const float * JitterBuffer::readScheduled( double play_ms ) {
+    // Throw away anything that should have started playing more than half a frame ago
+    while( this->count > 0 && this->play_at[this->read_idx] != 0.0 && this->play_at[this->read_idx] < play_ms - this->frame_ms/2 )
+        this->dropOldest();
+    if( this->count == 0 ) {
+        if( this->playing )
+            this->underruns++;
+        this->playing = false;
+        return NULL;
+    }
+
+    // Hold on to anything that shouldn't start for more than half a frame yet
+    double at = this->play_at[this->read_idx];
+    if( at != 0.0 && at > play_ms + this->frame_ms/2 ) {
+        this->playing = false;
+        return NULL;
+    }
+
+    // Whatever's left, we can steer out.  Frames we made up ourselves carry on from the one before.
+    if( at != 0.0 ) {
+        float error_ms = play_ms - at;
+        if( !this->scheduled )
+            this->sync_error_ms = error_ms;
+        this->sync_error_ms += (error_ms - this->sync_error_ms)*this->frame_ms/SYNC_SMOOTHING_MS;
+        this->drift_ppm += SYNC_KI*this->sync_error_ms*this->frame_ms/1000.0f;
+        this->drift_ppm = fmaxf(-MAX_DRIFT_PPM, fminf(MAX_DRIFT_PPM, this->drift_ppm));
+        this->correction_ppm = fmaxf(-MAX_SYNC_PPM, fminf(MAX_SYNC_PPM, this->drift_ppm + SYNC_KP*this->sync_error_ms));
+        this->scheduled = true;
+    }
+    this->playing = true;
+    return this->pop();
+}
+
+const float * JitterBuffer::read( double play_ms ) {
+    // Frames that say when they should be played get played then, if we know when that is
+    if( play_ms != 0.0 && this->count > 0 && this->play_at[this->read_idx] != 0.0 )
+        return this->readScheduled(play_ms);
+    if( this->count > 0 )
+        this->scheduled = false;
+
+    // If we're (re)starting, wait until we've built up enough of a cushion
+    if( !this->playing ) {
+        if( this->count < this->target_depth || this->count == 0 )
+            return NULL;
+        this->playing = true;
+        this->depth_avg = this->count;
+    }
+
+    if( this->count == 0 ) {
+        this->playing = false;
+        this->underruns++;
+        return NULL;
+    }
+
+    // If we've been sitting too deep for too long, latency is creeping up on us; drop a frame
+    if( this->count > this->target_depth + DEEP_SLACK ) {
+        this->deep_count++;
+        if( this->deep_count > DEEP_PATIENCE ) {
+            this->dropOldest();
+            this->deep_count = 0;
+        }
+    } else
+        this->deep_count = 0;
+
+    // Steer how deep we run on average towards target_depth.  Only while we're playing; while we're
+    // building back up, being short is expected, and shouldn't wind up the integral.
+    this->depth_avg += (this->count - this->depth_avg)*this->frame_ms/DRIFT_SMOOTHING_MS;
+    float error_ms = (this->depth_avg - this->target_depth)*this->frame_ms;
+    this->drift_ppm += DRIFT_KI*error_ms*this->frame_ms/1000.0f;
+    this->drift_ppm = fmaxf(-MAX_DRIFT_PPM, fminf(MAX_DRIFT_PPM, this->drift_ppm));
+    this->correction_ppm = fmaxf(-MAX_DRIFT_PPM, fminf(MAX_DRIFT_PPM, this->drift_ppm + DRIFT_KP*error_ms));
+    return this->pop();
+}
+
+double JitterBuffer::nextPlayAt() const {
+    return this->count > 0 ? this->play_at[this->read_idx] : 0.0;
+}
+
+jitter_stats JitterBuffer::getStats() {
+    jitter_stats stats;
+    stats.depth = this->count;
+    stats.target_depth = this->target_depth;
+    stats.jitter_ms = this->jitter_ms;
+    stats.drops = this->drops;
+    stats.underruns = this->underruns;
+    stats.drift_ppm = this->drift_ppm;
+    stats.scheduled = this->scheduled;
+    stats.sync_error_ms = this->sync_error_ms;
+    return stats;
+}
+
+float JitterBuffer::rateCorrection() const {
+    return this->correction_ppm;
+}
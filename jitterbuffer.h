@@ -0,0 +1,109 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+// Statistics about a single client's jitter buffer, for display/tuning
+struct jitter_stats {
+    // How many frames are waiting to be played, and how many we'd like to have waiting
+    unsigned int depth, target_depth;
+
+    // Smoothed deviation of packet inter-arrival times from their capture spacing, in ms
+    float jitter_ms;
+
+    // Frames we threw away because we were running too deep (or were full)
+    unsigned int drops;
+
+    // Times we had been playing and ran dry
+    unsigned int underruns;
+
+    // How much faster than ours the client's sample clock runs, in parts per million
+    float drift_ppm;
+
+    // Whether we're playing frames when they say they should be played, and if so, how far
+    // behind that we're running on average, in ms
+    bool scheduled;
+    float sync_error_ms;
+};
+
+/*
+The JitterBuffer holds decoded frames for a single client between their (bursty)
+arrival off the network and their (steady) consumption by the mixer.  It is a
+fixed-capacity ring of preallocated frames, so nothing is allocated per packet.
+
+Its target depth follows the measured inter-arrival jitter: we don't start (or
+restart, after running dry) playing until we've built up target_depth frames,
+and if we spend too long sitting deeper than that we drop frames to claw the
+latency back.
+
+That alone would leave a client whose sound card runs a little faster (or slower)
+than ours forever building up (or running dry), so we also keep a slow PI loop on
+how deep we run on average.  Its output is how much faster the client's frames
+should be consumed, which whoever fills us resamples them by; once it settles, its
+integral term is the drift between the two clocks.
+
+Frames can also come with the time (on our clock) they should start playing at, when
+their sender wants every receiver playing them in sync.  If the reader tells us when
+what it reads will be heard, we play those frames then instead: anything more than
+half a frame late is thrown away, anything more than half a frame early waits, and
+the same PI loop, now on how far off we are, steers out the rest.
+*/
+class JitterBuffer {
+public:
+    JitterBuffer( const unsigned int capacity, const unsigned int frame_len, const float frame_ms );
+    ~JitterBuffer();
+
+    // Get the slot to put the next frame into, then commit it once it's filled.  If
+    // we're full, the oldest frame is dropped to make room.
+    float * writeSlot();
+    // arrival_ms is when this frame's packet got here, media_ms is when it was captured according
+    // to the sender's sample clock (e.g. its timestamp converted to ms); only differences matter.
+    // Frames we made up ourselves (e.g. via PLC) have no arrival time, and don't count towards jitter.
+    // play_ms is when (on our wall clock) this frame should start playing, or 0 for whenever.
+    void commitWrite( double arrival_ms, double media_ms, double play_ms = 0.0 );
+    void commitWrite( double play_ms = 0.0 );
+
+    // Get the next frame to play, or NULL if there isn't one (either because we
+    // ran dry, or because we're still building back up to target_depth).  If
+    // play_ms says when (on our wall clock) the frame we return will start playing,
+    // frames that say when they should be played are scheduled as above.  The
+    // returned frame is valid until the next call to writeSlot()/read().
+    const float * read( double play_ms = 0.0 );
+
+    // When (on our wall clock) the next frame read() could return says it should start playing,
+    // or 0 if it doesn't say (or there isn't one)
+    double nextPlayAt() const;
+
+    jitter_stats getStats();
+
+    // How many parts per million faster than nominal to resample this client's audio by
+    // before it's written in, to keep us at target_depth
+    float rateCorrection() const;
+
+protected:
+    void dropOldest();
+    const float * readScheduled( double play_ms );
+    const float * pop();
+
+    float * data;
+    double * play_at;
+    unsigned int capacity, frame_len;
+    unsigned int read_idx, count;
+
+    // Jitter estimation
+    float frame_ms, jitter_ms;
+    double last_arrival, last_media;
+
+    // Depth management
+    unsigned int target_depth, deep_count;
+    bool playing;
+
+    unsigned int drops, underruns;
+
+    // Drift compensation
+    float depth_avg, drift_ppm, correction_ppm;
+
+    // Scheduling
+    bool scheduled;
+    float sync_error_ms;
+};
+
+#endif //JITTERBUFFER_H
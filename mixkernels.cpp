@@ -0,0 +1,493 @@
+#include "mixkernels.h"
+#include <string.h>
+
+// SSE2 is part of the x86_64 baseline; 32-bit x86 builds only get it if asked for with -msse2
+#if defined(__SSE2__)
+#define MIX_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MIX_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/**********
+* SCALAR *
+**********/
+static void accumulate_scalar( float * out, const float * in, unsigned int len ) {
+    for( unsigned int i=0; i<len; ++i )
+        out[i] += in[i];
+}
+
+static void accumulate_gain_scalar( float * out, const float * in, float gain, unsigned int len ) {
+    for( unsigned int i=0; i<len; ++i )
+        out[i] += gain*in[i];
+}
+
+// Up/downmixing is written so the compiler can vectorize it: plain loops over pointers that don't
+// alias, and stereo (by far the most common case) spelled out on its own so its stride is a constant.
+// Called through a pointer with out_channels only known at runtime, the general loops can't be.
+static void upmix_stereo_scalar( float * __restrict out, const float * __restrict in, unsigned int num_samples ) {
+    for( unsigned int i=0; i<num_samples; ++i, out += 2 ) {
+        out[0] += in[i];
+        out[1] += in[i];
+    }
+}
+
+static void upmix_mono_scalar( float * __restrict out, const float * __restrict in, unsigned int num_samples, unsigned int out_channels ) {
+    if( out_channels == 2 ) {
+        upmix_stereo_scalar(out, in, num_samples);
+        return;
+    }
+    for( unsigned int i=0; i<num_samples; ++i, out += out_channels ) {
+        const float m = in[i];
+        for( unsigned int k=0; k<out_channels; ++k )
+            out[k] += m;
+    }
+}
+
+static void downmix_stereo_scalar( float * __restrict out, const float * __restrict in, unsigned int num_samples ) {
+    for( unsigned int i=0; i<num_samples; ++i, in += 2 )
+        out[i] += 0.5f*(in[0] + in[1]);
+}
+
+static void downmix_mono_scalar( float * __restrict out, const float * __restrict in, unsigned int num_samples, unsigned int in_channels ) {
+    if( in_channels == 2 ) {
+        downmix_stereo_scalar(out, in, num_samples);
+        return;
+    }
+    const float scale = 1.0f/in_channels;
+    for( unsigned int i=0; i<num_samples; ++i, in += in_channels ) {
+        float tmp_mix = 0.0f;
+        for( unsigned int k=0; k<in_channels; ++k )
+            tmp_mix += in[k];
+        out[i] += tmp_mix*scale;
+    }
+}
+
+static float dot_scalar( const float * a, const float * b, unsigned int len ) {
+    float sum = 0.0f;
+    for( unsigned int i=0; i<len; ++i )
+        sum += a[i]*b[i];
+    return sum;
+}
+
+static const mix_kernel_set scalar_kernels = {
+    "scalar", accumulate_scalar, accumulate_gain_scalar, upmix_mono_scalar, downmix_mono_scalar, dot_scalar
+};
+
+
+#ifdef MIX_HAVE_X86
+/*******
+* SSE *
+*******/
+static void accumulate_sse( float * out, const float * in, unsigned int len ) {
+    unsigned int i = 0;
+    // Two at a time, so we're not just waiting on the loop counter
+    for( ; i + 8 <= len; i += 8 ) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
+        _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), _mm_loadu_ps(in + i + 4)));
+    }
+    for( ; i + 4 <= len; i += 4 )
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
+    accumulate_scalar(out + i, in + i, len - i);
+}
+
+static void accumulate_gain_sse( float * out, const float * in, float gain, unsigned int len ) {
+    const __m128 g = _mm_set1_ps(gain);
+    unsigned int i = 0;
+    for( ; i + 4 <= len; i += 4 )
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(g, _mm_loadu_ps(in + i))));
+    accumulate_gain_scalar(out + i, in + i, gain, len - i);
+}
+
+// Any number of channels: each sample goes onto as many whole vectors of its channels as it has, then
+// a pair of them, then the last one if there's one left over
+static void upmix_mono_any_sse( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    for( unsigned int i=0; i<num_samples; ++i, out += out_channels ) {
+        const __m128 m = _mm_set1_ps(in[i]);
+        unsigned int k = 0;
+        for( ; k + 4 <= out_channels; k += 4 )
+            _mm_storeu_ps(out + k, _mm_add_ps(_mm_loadu_ps(out + k), m));
+        if( k + 2 <= out_channels ) {
+            __m128 pair = _mm_castpd_ps(_mm_load_sd((const double *)(out + k)));
+            _mm_store_sd((double *)(out + k), _mm_castps_pd(_mm_add_ps(pair, m)));
+            k += 2;
+        }
+        if( k < out_channels )
+            out[k] += in[i];
+    }
+}
+
+static void upmix_mono_sse( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    if( out_channels != 2 ) {
+        upmix_mono_any_sse(out, in, num_samples, out_channels);
+        return;
+    }
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        __m128 m = _mm_loadu_ps(in + i);
+        // [m0 m0 m1 m1] and [m2 m2 m3 m3]
+        __m128 lo = _mm_unpacklo_ps(m, m);
+        __m128 hi = _mm_unpackhi_ps(m, m);
+        _mm_storeu_ps(out + 2*i, _mm_add_ps(_mm_loadu_ps(out + 2*i), lo));
+        _mm_storeu_ps(out + 2*i + 4, _mm_add_ps(_mm_loadu_ps(out + 2*i + 4), hi));
+    }
+    upmix_mono_scalar(out + 2*i, in + i, num_samples - i, 2);
+}
+
+// Any number of channels, four samples at a time: transpose each four channels of them so that adding
+// the rows up sums each sample's channels, then pick up any channels left over one at a time
+static void downmix_mono_any_sse( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    const unsigned int n = in_channels;
+    const __m128 scale = _mm_set1_ps(1.0f/n);
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        const float * s = in + i*n;
+        __m128 sum = _mm_setzero_ps();
+        unsigned int k = 0;
+        for( ; k + 4 <= n; k += 4 ) {
+            __m128 r0 = _mm_loadu_ps(s + k), r1 = _mm_loadu_ps(s + n + k);
+            __m128 r2 = _mm_loadu_ps(s + 2*n + k), r3 = _mm_loadu_ps(s + 3*n + k);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            sum = _mm_add_ps(sum, _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+        }
+        for( ; k < n; ++k )
+            sum = _mm_add_ps(sum, _mm_setr_ps(s[k], s[n + k], s[2*n + k], s[3*n + k]));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(sum, scale)));
+    }
+    downmix_mono_scalar(out + i, in + i*n, num_samples - i, n);
+}
+
+static void downmix_mono_sse( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    if( in_channels != 2 ) {
+        downmix_mono_any_sse(out, in, num_samples, in_channels);
+        return;
+    }
+    const __m128 half = _mm_set1_ps(0.5f);
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        __m128 a = _mm_loadu_ps(in + 2*i);
+        __m128 b = _mm_loadu_ps(in + 2*i + 4);
+        // Split into lefts and rights, then average them
+        __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 mono = _mm_mul_ps(_mm_add_ps(left, right), half);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), mono));
+    }
+    downmix_mono_scalar(out + i, in + 2*i, num_samples - i, 2);
+}
+
+static float dot_sse( const float * a, const float * b, unsigned int len ) {
+    // Two running sums, so each add isn't waiting on the one before it
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    unsigned int i = 0;
+    for( ; i + 8 <= len; i += 8 ) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for( ; i + 4 <= len; i += 4 )
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+    // Add up the four lanes
+    __m128 sum = _mm_add_ps(sum0, sum1);
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum) + dot_scalar(a + i, b + i, len - i);
+}
+
+static const mix_kernel_set sse_kernels = {
+    "sse", accumulate_sse, accumulate_gain_sse, upmix_mono_sse, downmix_mono_sse, dot_sse
+};
+
+
+/********
+* AVX2 *
+********/
+// These are compiled for AVX2 regardless of our -m flags, and only ever called if the CPU says it can
+#define AVX2_FUNC __attribute__((target("avx2")))
+
+AVX2_FUNC static void accumulate_avx2( float * out, const float * in, unsigned int len ) {
+    unsigned int i = 0;
+    for( ; i + 8 <= len; i += 8 )
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_loadu_ps(in + i)));
+    // Like dot_avx2 below, clear the upper halves ourselves before handing the tail to SSE
+    _mm256_zeroupper();
+    accumulate_sse(out + i, in + i, len - i);
+}
+
+AVX2_FUNC static void accumulate_gain_avx2( float * out, const float * in, float gain, unsigned int len ) {
+    const __m256 g = _mm256_set1_ps(gain);
+    unsigned int i = 0;
+    for( ; i + 8 <= len; i += 8 )
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(g, _mm256_loadu_ps(in + i))));
+    _mm256_zeroupper();
+    accumulate_gain_sse(out + i, in + i, gain, len - i);
+}
+
+// The most channels we build permutes for; past that, it's SSE's turn
+#define AVX2_MAX_CHANNELS   16
+
+// Any number of channels, eight samples at a time: those make out_channels whole vectors, and lane t
+// of vector v is sample (8v + t)/out_channels, so each is a single permute of the eight
+AVX2_FUNC static void upmix_mono_any_avx2( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    const unsigned int n = out_channels;
+    if( n > AVX2_MAX_CHANNELS ) {
+        upmix_mono_any_sse(out, in, num_samples, n);
+        return;
+    }
+    __m256i idx[AVX2_MAX_CHANNELS];
+    for( unsigned int v=0; v<n; ++v ) {
+        int lanes[8];
+        for( unsigned int t=0; t<8; ++t )
+            lanes[t] = (8*v + t)/n;
+        idx[v] = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+
+    unsigned int i = 0;
+    for( ; i + 8 <= num_samples; i += 8 ) {
+        __m256 m = _mm256_loadu_ps(in + i);
+        float * o = out + i*n;
+        for( unsigned int v=0; v<n; ++v )
+            _mm256_storeu_ps(o + 8*v, _mm256_add_ps(_mm256_loadu_ps(o + 8*v), _mm256_permutevar8x32_ps(m, idx[v])));
+    }
+    _mm256_zeroupper();
+    upmix_mono_any_sse(out + i*n, in + i, num_samples - i, n);
+}
+
+AVX2_FUNC static void upmix_mono_avx2( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    if( out_channels != 2 ) {
+        upmix_mono_any_avx2(out, in, num_samples, out_channels);
+        return;
+    }
+    unsigned int i = 0;
+    for( ; i + 8 <= num_samples; i += 8 ) {
+        __m256 m = _mm256_loadu_ps(in + i);
+        // Unpacking works within 128-bit lanes: [m0 m0 m1 m1 | m4 m4 m5 m5] and [m2 m2 m3 m3 | m6 m6 m7 m7]
+        __m256 lo = _mm256_unpacklo_ps(m, m);
+        __m256 hi = _mm256_unpackhi_ps(m, m);
+        // So stitch the lanes back together in order
+        __m256 first = _mm256_permute2f128_ps(lo, hi, 0x20);
+        __m256 second = _mm256_permute2f128_ps(lo, hi, 0x31);
+        _mm256_storeu_ps(out + 2*i, _mm256_add_ps(_mm256_loadu_ps(out + 2*i), first));
+        _mm256_storeu_ps(out + 2*i + 8, _mm256_add_ps(_mm256_loadu_ps(out + 2*i + 8), second));
+    }
+    _mm256_zeroupper();
+    upmix_mono_sse(out + 2*i, in + i, num_samples - i, 2);
+}
+
+// Any number of channels, eight samples at a time: gather each channel of the eight, and add them up
+AVX2_FUNC static void downmix_mono_any_avx2( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    const int n = in_channels;
+    const __m256i offsets = _mm256_setr_epi32(0, n, 2*n, 3*n, 4*n, 5*n, 6*n, 7*n);
+    const __m256 scale = _mm256_set1_ps(1.0f/n);
+    unsigned int i = 0;
+    for( ; i + 8 <= num_samples; i += 8 ) {
+        const float * s = in + i*n;
+        __m256 sum = _mm256_setzero_ps();
+        for( int k=0; k<n; ++k )
+            sum = _mm256_add_ps(sum, _mm256_i32gather_ps(s + k, offsets, 4));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(sum, scale)));
+    }
+    _mm256_zeroupper();
+    downmix_mono_any_sse(out + i, in + i*n, num_samples - i, n);
+}
+
+AVX2_FUNC static void downmix_mono_avx2( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    if( in_channels != 2 ) {
+        downmix_mono_any_avx2(out, in, num_samples, in_channels);
+        return;
+    }
+    const __m256 half = _mm256_set1_ps(0.5f);
+    unsigned int i = 0;
+    for( ; i + 8 <= num_samples; i += 8 ) {
+        __m256 a = _mm256_loadu_ps(in + 2*i);
+        __m256 b = _mm256_loadu_ps(in + 2*i + 8);
+        // Within each lane: [a0 a2 b0 b2 | a4 a6 b4 b6] and [a1 a3 b1 b3 | a5 a7 b5 b7]
+        __m256 left = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 right = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 mono = _mm256_mul_ps(_mm256_add_ps(left, right), half);
+        // Put the 64-bit pairs back in order: [a0 a2 a4 a6 b0 b2 b4 b6]
+        mono = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(mono), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), mono));
+    }
+    _mm256_zeroupper();
+    downmix_mono_sse(out + i, in + 2*i, num_samples - i, 2);
+}
+
+AVX2_FUNC static float dot_avx2( const float * a, const float * b, unsigned int len ) {
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    unsigned int i = 0;
+    for( ; i + 16 <= len; i += 16 ) {
+        sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    for( ; i + 8 <= len; i += 8 )
+        sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+
+    // Fold the two halves together, then finish up like SSE does
+    __m256 sum = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    float sum_avx = _mm_cvtss_f32(half);
+
+    // The compiler won't clear the upper halves for us before calling (or returning to) non-AVX
+    // code, and every SSE instruction after that pays for it; this is called once per output sample
+    _mm256_zeroupper();
+    return sum_avx + dot_sse(a + i, b + i, len - i);
+}
+
+static const mix_kernel_set avx2_kernels = {
+    "avx2", accumulate_avx2, accumulate_gain_avx2, upmix_mono_avx2, downmix_mono_avx2, dot_avx2
+};
+#endif // MIX_HAVE_X86
+
+
+#ifdef MIX_HAVE_NEON
+/********
+* NEON *
+********/
+static void accumulate_neon( float * out, const float * in, unsigned int len ) {
+    unsigned int i = 0;
+    for( ; i + 4 <= len; i += 4 )
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), vld1q_f32(in + i)));
+    accumulate_scalar(out + i, in + i, len - i);
+}
+
+static void accumulate_gain_neon( float * out, const float * in, float gain, unsigned int len ) {
+    unsigned int i = 0;
+    for( ; i + 4 <= len; i += 4 )
+        vst1q_f32(out + i, vmlaq_n_f32(vld1q_f32(out + i), vld1q_f32(in + i), gain));
+    accumulate_gain_scalar(out + i, in + i, gain, len - i);
+}
+
+// Any number of channels: each sample goes onto as many whole vectors of its channels as it has
+static void upmix_mono_any_neon( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    for( unsigned int i=0; i<num_samples; ++i, out += out_channels ) {
+        const float32x4_t m = vdupq_n_f32(in[i]);
+        unsigned int k = 0;
+        for( ; k + 4 <= out_channels; k += 4 )
+            vst1q_f32(out + k, vaddq_f32(vld1q_f32(out + k), m));
+        for( ; k < out_channels; ++k )
+            out[k] += in[i];
+    }
+}
+
+static void upmix_mono_neon( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+    if( out_channels != 2 ) {
+        upmix_mono_any_neon(out, in, num_samples, out_channels);
+        return;
+    }
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        // vld2/vst2 do the (de)interleaving for us
+        float32x4_t m = vld1q_f32(in + i);
+        float32x4x2_t o = vld2q_f32(out + 2*i);
+        o.val[0] = vaddq_f32(o.val[0], m);
+        o.val[1] = vaddq_f32(o.val[1], m);
+        vst2q_f32(out + 2*i, o);
+    }
+    upmix_mono_scalar(out + 2*i, in + i, num_samples - i, 2);
+}
+
+// Any number of channels, four samples at a time, four channels at a time: vtrn pairs up neighbouring
+// channels of two samples, so two rounds of adding leave each sample's sum in its own lane
+static void downmix_mono_any_neon( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    const unsigned int n = in_channels;
+    const float scale = 1.0f/n;
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        const float * s = in + i*n;
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        unsigned int k = 0;
+        for( ; k + 4 <= n; k += 4 ) {
+            // [r0[0]+r0[1], r1[0]+r1[1], r0[2]+r0[3], r1[2]+r1[3]], and likewise for r2 and r3
+            float32x4x2_t t01 = vtrnq_f32(vld1q_f32(s + k), vld1q_f32(s + n + k));
+            float32x4x2_t t23 = vtrnq_f32(vld1q_f32(s + 2*n + k), vld1q_f32(s + 3*n + k));
+            float32x4_t a = vaddq_f32(t01.val[0], t01.val[1]);
+            float32x4_t b = vaddq_f32(t23.val[0], t23.val[1]);
+            sum = vaddq_f32(sum, vaddq_f32(vcombine_f32(vget_low_f32(a), vget_low_f32(b)), vcombine_f32(vget_high_f32(a), vget_high_f32(b))));
+        }
+        for( ; k < n; ++k ) {
+            float lanes[4] = {s[k], s[n + k], s[2*n + k], s[3*n + k]};
+            sum = vaddq_f32(sum, vld1q_f32(lanes));
+        }
+        vst1q_f32(out + i, vmlaq_n_f32(vld1q_f32(out + i), sum, scale));
+    }
+    downmix_mono_scalar(out + i, in + i*n, num_samples - i, n);
+}
+
+static void downmix_mono_neon( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+    if( in_channels != 2 ) {
+        downmix_mono_any_neon(out, in, num_samples, in_channels);
+        return;
+    }
+    unsigned int i = 0;
+    for( ; i + 4 <= num_samples; i += 4 ) {
+        float32x4x2_t lr = vld2q_f32(in + 2*i);
+        float32x4_t mono = vmulq_n_f32(vaddq_f32(lr.val[0], lr.val[1]), 0.5f);
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), mono));
+    }
+    downmix_mono_scalar(out + i, in + 2*i, num_samples - i, 2);
+}
+
+static float dot_neon( const float * a, const float * b, unsigned int len ) {
+    float32x4_t sum0 = vdupq_n_f32(0.0f), sum1 = vdupq_n_f32(0.0f);
+    unsigned int i = 0;
+    for( ; i + 8 <= len; i += 8 ) {
+        sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for( ; i + 4 <= len; i += 4 )
+        sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+
+    // vaddvq_f32 is AArch64 only, so add the lanes up by hand
+    float32x4_t sum = vaddq_f32(sum0, sum1);
+    float32x2_t pair = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    return vget_lane_f32(vpadd_f32(pair, pair), 0) + dot_scalar(a + i, b + i, len - i);
+}
+
+static const mix_kernel_set neon_kernels = {
+    "neon", accumulate_neon, accumulate_gain_neon, upmix_mono_neon, downmix_mono_neon, dot_neon
+};
+#endif // MIX_HAVE_NEON
+
+
+// Start out with something that always works, in case anybody mixes before init_mix_kernels()
+mix_kernel_set mixk = scalar_kernels;
+
+bool select_mix_kernels( const char * name ) {
+    if( strcmp(name, "scalar") == 0 ) {
+        mixk = scalar_kernels;
+        return true;
+    }
+#ifdef MIX_HAVE_X86
+    if( strcmp(name, "sse") == 0 ) {
+        mixk = sse_kernels;
+        return true;
+    }
+    if( strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") ) {
+        mixk = avx2_kernels;
+        return true;
+    }
+#endif
+#ifdef MIX_HAVE_NEON
+    // If we were compiled with NEON, it's part of the baseline we're running on
+    if( strcmp(name, "neon") == 0 ) {
+        mixk = neon_kernels;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void init_mix_kernels() {
+    const char * preferred[] = {"avx2", "neon", "sse", "scalar"};
+    for( unsigned int i=0; i<sizeof(preferred)/sizeof(preferred[0]); ++i ) {
+        if( select_mix_kernels(preferred[i]) )
+            return;
+    }
+}
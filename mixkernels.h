@@ -0,0 +1,41 @@
+#ifndef MIXKERNELS_H
+#define MIXKERNELS_H
+
+/*
+The inner loops of our mixer.  Every kernel ADDS into out rather than
+overwriting it, so that clients can be mixed straight into a shared buffer
+(apart from dot, which has no out to add to).
+There are scalar, SSE, AVX2 and NEON versions of each; init_mix_kernels()
+picks the best set the CPU we're running on supports, and everyone else just
+calls through mixk.
+*/
+struct mix_kernel_set {
+    const char * name;
+
+    // out[i] += in[i]
+    void (*accumulate)( float * out, const float * in, unsigned int len );
+
+    // out[i] += gain*in[i]
+    void (*accumulate_gain)( float * out, const float * in, float gain, unsigned int len );
+
+    // out[i*out_channels + k] += in[i], for every output channel k
+    void (*upmix_mono)( float * out, const float * in, unsigned int num_samples, unsigned int out_channels );
+
+    // out[i] += average of in[i*in_channels + k] over every input channel k
+    void (*downmix_mono)( float * out, const float * in, unsigned int num_samples, unsigned int in_channels );
+
+    // The sum of a[i]*b[i]; one output sample of the resampler's filter
+    float (*dot)( const float * a, const float * b, unsigned int len );
+};
+
+// The kernels everyone should use
+extern mix_kernel_set mixk;
+
+// Pick the fastest kernels this CPU can run
+void init_mix_kernels();
+
+// Force a particular set of kernels ("scalar", "sse", "avx2" or "neon"), returning
+// false if it isn't compiled in or this CPU can't run it.  Mostly for benchmarking.
+bool select_mix_kernels( const char * name );
+
+#endif //MIXKERNELS_H
@@ -0,0 +1,316 @@
+#include "packet.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+static void pack_u64( uint64_t val, unsigned char * buff ) {
+    uint32_t hi = htonl((uint32_t)(val >> 32));
+    uint32_t lo = htonl((uint32_t)(val & 0xffffffff));
+    memcpy(buff, &hi, 4);
+    memcpy(buff + 4, &lo, 4);
+}
+
+static uint64_t unpack_u64( const unsigned char * buff ) {
+    uint32_t hi, lo;
+    memcpy(&hi, buff, 4);
+    memcpy(&lo, buff + 4, 4);
+    return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
+
+int pack_header( const audio_packet_header * hdr, unsigned char * buff ) {
+    buff[0] = PACKET_VERSION;
+    buff[1] = hdr->type;
+    buff[2] = hdr->num_channels;
+    buff[3] = hdr->flags;
+
+    uint16_t num_samples = htons(hdr->num_samples);
+    uint16_t stream_id = htons(hdr->stream_id);
+    memcpy(buff + 4, &num_samples, 2);
+    memcpy(buff + 6, &stream_id, 2);
+
+    uint32_t seq = htonl(hdr->seq);
+    uint32_t timestamp = htonl(hdr->timestamp);
+    memcpy(buff + 8, &seq, 4);
+    memcpy(buff + 12, &timestamp, 4);
+
+    pack_u64(hdr->capture_us, buff + 16);
+    pack_u64(hdr->presentation_us, buff + 24);
+    return PACKET_HEADER_LEN;
+}
+
+bool unpack_header( const unsigned char * buff, int len, audio_packet_header * hdr ) {
+    if( len < PACKET_HEADER_LEN || buff[0] != PACKET_VERSION )
+        return false;
+
+    hdr->version = buff[0];
+    hdr->type = buff[1];
+    hdr->num_channels = buff[2];
+    hdr->flags = buff[3];
+
+    uint16_t num_samples, stream_id;
+    memcpy(&num_samples, buff + 4, 2);
+    memcpy(&stream_id, buff + 6, 2);
+    hdr->num_samples = ntohs(num_samples);
+    hdr->stream_id = ntohs(stream_id);
+
+    uint32_t seq, timestamp;
+    memcpy(&seq, buff + 8, 4);
+    memcpy(&timestamp, buff + 12, 4);
+    hdr->seq = ntohl(seq);
+    hdr->timestamp = ntohl(timestamp);
+
+    hdr->capture_us = unpack_u64(buff + 16);
+    hdr->presentation_us = unpack_u64(buff + 24);
+    return true;
+}
+
+
+void mark_relayed( unsigned char * packet, uint16_t stream_id ) {
+    packet[3] |= PACKET_FLAG_RELAYED;
+    uint16_t id = htons(stream_id);
+    memcpy(packet + 6, &id, 2);
+}
+
+void unmark_relayed( unsigned char * packet ) {
+    packet[3] &= ~PACKET_FLAG_RELAYED;
+    memset(packet + 6, 0, 2);
+}
+
+void retime_packet( unsigned char * packet, int64_t offset_us ) {
+    pack_u64(unpack_u64(packet + 16) - offset_us, packet + 16);
+    uint64_t presentation_us = unpack_u64(packet + 24);
+    if( presentation_us != 0 )
+        pack_u64(presentation_us - offset_us, packet + 24);
+}
+
+void unschedule_packet( unsigned char * packet ) {
+    memset(packet + 24, 0, 8);
+}
+
+int pack_clock( uint8_t type, const clock_stamps & stamps, unsigned char * buff, int buff_len ) {
+    if( CLOCK_PACKET_LEN > buff_len )
+        return -1;
+
+    audio_packet_header hdr;
+    memset(&hdr, 0, sizeof(audio_packet_header));
+    hdr.type = type;
+    pack_header(&hdr, buff);
+    pack_u64(stamps.origin_us, buff + PACKET_HEADER_LEN);
+    pack_u64(stamps.receive_us, buff + PACKET_HEADER_LEN + 8);
+    pack_u64(stamps.transmit_us, buff + PACKET_HEADER_LEN + 16);
+    return CLOCK_PACKET_LEN;
+}
+
+bool unpack_clock( const unsigned char * buff, int len, clock_stamps * stamps ) {
+    if( len < CLOCK_PACKET_LEN )
+        return false;
+    stamps->origin_us = unpack_u64(buff + PACKET_HEADER_LEN);
+    stamps->receive_us = unpack_u64(buff + PACKET_HEADER_LEN + 8);
+    stamps->transmit_us = unpack_u64(buff + PACKET_HEADER_LEN + 16);
+    return true;
+}
+
+int pack_subscribe( const subscribe_request & req, unsigned char * buff, int buff_len ) {
+    int len = PACKET_HEADER_LEN + 4;
+    for( auto& ident : req.wanted )
+        len += ident.size() + 1;
+    if( len > buff_len )
+        return -1;
+
+    audio_packet_header hdr;
+    memset(&hdr, 0, sizeof(audio_packet_header));
+    hdr.type = PACKET_SUBSCRIBE;
+    pack_header(&hdr, buff);
+
+    uint16_t max_streams = htons(req.max_streams);
+    uint16_t max_kbps = htons(req.max_kbps);
+    memcpy(buff + PACKET_HEADER_LEN, &max_streams, 2);
+    memcpy(buff + PACKET_HEADER_LEN + 2, &max_kbps, 2);
+
+    int idx = PACKET_HEADER_LEN + 4;
+    for( auto& ident : req.wanted ) {
+        memcpy(buff + idx, ident.c_str(), ident.size() + 1);
+        idx += ident.size() + 1;
+    }
+    return len;
+}
+
+bool unpack_subscribe( const unsigned char * buff, int len, subscribe_request * req ) {
+    if( len < PACKET_HEADER_LEN + 4 )
+        return false;
+    uint16_t max_streams, max_kbps;
+    memcpy(&max_streams, buff + PACKET_HEADER_LEN, 2);
+    memcpy(&max_kbps, buff + PACKET_HEADER_LEN + 2, 2);
+    req->max_streams = ntohs(max_streams);
+    req->max_kbps = ntohs(max_kbps);
+
+    // Every identity must be properly terminated, or we don't believe any of it
+    req->wanted.clear();
+    int idx = PACKET_HEADER_LEN + 4;
+    while( idx < len ) {
+        const unsigned char * end = (const unsigned char *)memchr(buff + idx, 0, len - idx);
+        if( end == NULL )
+            return false;
+        req->wanted.push_back(std::string((const char *)buff + idx));
+        idx = end - buff + 1;
+    }
+    return true;
+}
+
+
+int pack_streams( const stream_map & streams, stream_map::const_iterator & next, unsigned char * buff, int buff_len ) {
+    if( buff_len < PACKET_HEADER_LEN )
+        return -1;
+    audio_packet_header hdr;
+    memset(&hdr, 0, sizeof(audio_packet_header));
+    hdr.type = PACKET_STREAMS;
+    pack_header(&hdr, buff);
+
+    int idx = PACKET_HEADER_LEN;
+    for( ; next != streams.end(); ++next ) {
+        int entry_len = 2 + next->second.size() + 1;
+        if( idx + entry_len > buff_len )
+            break;
+        uint16_t id = htons(next->first);
+        memcpy(buff + idx, &id, 2);
+        memcpy(buff + idx + 2, next->second.c_str(), next->second.size() + 1);
+        idx += entry_len;
+    }
+    return idx > PACKET_HEADER_LEN ? idx : -1;
+}
+
+bool unpack_streams( const unsigned char * buff, int len, stream_map * streams ) {
+    // As with subscriptions, every identity must be properly terminated
+    int idx = PACKET_HEADER_LEN;
+    while( idx < len ) {
+        if( idx + 2 >= len )
+            return false;
+        const unsigned char * end = (const unsigned char *)memchr(buff + idx + 2, 0, len - idx - 2);
+        if( end == NULL )
+            return false;
+        uint16_t id;
+        memcpy(&id, buff + idx, 2);
+        (*streams)[ntohs(id)] = std::string((const char *)buff + idx + 2);
+        idx = end - buff + 1;
+    }
+    return true;
+}
+
+int batch_append( unsigned char * buff, int batch_len, int buff_len, const unsigned char * packet, int len ) {
+    audio_packet_header hdr;
+    if( !unpack_header(packet, len, &hdr) || hdr.type != PACKET_AUDIO )
+        return -1;
+    int data_len = len - PACKET_HEADER_LEN;
+
+    // Starting a new batch, it takes this packet's header
+    if( batch_len == 0 ) {
+        if( PACKET_HEADER_LEN + 1 + 2 + data_len > buff_len )
+            return -1;
+        memcpy(buff, packet, PACKET_HEADER_LEN);
+        buff[1] = PACKET_AUDIO_BATCH;
+        buff[PACKET_HEADER_LEN] = 0;
+        batch_len = PACKET_HEADER_LEN + 1;
+    } else {
+        audio_packet_header first;
+        unpack_header(buff, batch_len, &first);
+        unsigned int count = buff[PACKET_HEADER_LEN];
+        if( count >= MAX_BATCH_FRAMES || batch_len + 2 + data_len > buff_len )
+            return -1;
+        if( hdr.seq != first.seq + count || hdr.num_channels != first.num_channels ||
+            hdr.num_samples != first.num_samples || hdr.flags != first.flags )
+            return -1;
+    }
+
+    uint16_t frame_len = htons(data_len);
+    memcpy(buff + batch_len, &frame_len, 2);
+    memcpy(buff + batch_len + 2, packet + PACKET_HEADER_LEN, data_len);
+    buff[PACKET_HEADER_LEN]++;
+    return batch_len + 2 + data_len;
+}
+
+unsigned int batch_count( const unsigned char * buff, int batch_len ) {
+    if( batch_len <= PACKET_HEADER_LEN )
+        return 0;
+    return buff[PACKET_HEADER_LEN];
+}
+
+bool unpack_batch( const unsigned char * buff, int len, unsigned int sample_rate, std::vector<batch_frame> * frames ) {
+    audio_packet_header first;
+    if( !unpack_header(buff, len, &first) || len < PACKET_HEADER_LEN + 1 )
+        return false;
+    unsigned int count = buff[PACKET_HEADER_LEN];
+
+    frames->clear();
+    int idx = PACKET_HEADER_LEN + 1;
+    for( unsigned int i=0; i<count; ++i ) {
+        uint16_t frame_len;
+        if( idx + 2 > len )
+            return false;
+        memcpy(&frame_len, buff + idx, 2);
+        frame_len = ntohs(frame_len);
+        if( idx + 2 + frame_len > len )
+            return false;
+
+        batch_frame f;
+        f.hdr = first;
+        f.hdr.type = PACKET_AUDIO;
+        f.hdr.seq = first.seq + i;
+        f.hdr.timestamp = first.timestamp + i*first.num_samples;
+        f.hdr.capture_us = first.capture_us + (uint64_t)i*first.num_samples*1000000/sample_rate;
+        if( first.presentation_us != 0 )
+            f.hdr.presentation_us = first.presentation_us + (uint64_t)i*first.num_samples*1000000/sample_rate;
+        f.data = buff + idx + 2;
+        f.len = frame_len;
+        frames->push_back(f);
+        idx += 2 + frame_len;
+    }
+    return idx == len;
+}
+
+void init_stream_stats( stream_stats * stats ) {
+    memset(stats, 0, sizeof(stream_stats));
+}
+
+int update_stream_stats( stream_stats * stats, const audio_packet_header * hdr, double arrival_ms ) {
+    // Keep track of how long this took to get here, as best we can tell
+    float latency_ms = arrival_ms - hdr->capture_us/1000.0;
+    if( !stats->started )
+        stats->latency_ms = latency_ms;
+    stats->latency_ms += (latency_ms - stats->latency_ms)/16.0f;
+
+    stats->received++;
+    if( !stats->started ) {
+        stats->started = true;
+        stats->next_seq = hdr->seq + 1;
+        stats->last_timestamp = hdr->timestamp;
+        stats->timestamp = hdr->timestamp;
+        return 0;
+    }
+
+    // Signed distance between what we got and what we expected, so that wraparound works out
+    int32_t gap = (int32_t)(hdr->seq - stats->next_seq);
+
+    // If the sender started over, pick its new sequence numbers and timestamps up from here.  Keep our
+    // unwrapped timestamp counting on as if nothing happened, so nobody downstream sees it jump.
+    int64_t drift = (int64_t)(int32_t)(hdr->timestamp - stats->last_timestamp) - (int64_t)(gap + 1)*hdr->num_samples;
+    if( gap < -STREAM_RESET_GAP || gap > STREAM_RESET_GAP || drift < -STREAM_RESET_SAMPLES || drift > STREAM_RESET_SAMPLES ) {
+        stats->resets++;
+        stats->next_seq = hdr->seq + 1;
+        stats->timestamp += hdr->num_samples;
+        stats->last_timestamp = hdr->timestamp;
+        return 0;
+    }
+
+    if( gap < 0 ) {
+        stats->late++;
+        // Undo our premature judgement that this one was lost
+        if( stats->lost > 0 )
+            stats->lost--;
+        return -1;
+    }
+
+    stats->lost += gap;
+    stats->next_seq = hdr->seq + 1;
+    stats->timestamp += (int32_t)(hdr->timestamp - stats->last_timestamp);
+    stats->last_timestamp = hdr->timestamp;
+    return gap;
+}
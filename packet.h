@@ -0,0 +1,197 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// Bump this whenever the layout of audio_packet_header changes
+#define PACKET_VERSION          3
+
+// How many bytes audio_packet_header takes up on the wire
+#define PACKET_HEADER_LEN       32
+
+// What kind of packet this is
+enum {
+    PACKET_AUDIO = 0,
+    // Asks a relay to forward us audio; see pack_subscribe()
+    PACKET_SUBSCRIBE,
+    // Tells a subscriber whose audio a relay's stream IDs carry; see pack_streams()
+    PACKET_STREAMS,
+    // Several consecutive audio packets sent as one; see batch_append()
+    PACKET_AUDIO_BATCH,
+    // Asks a peer what time it is, and its answer; see pack_clock()
+    PACKET_CLOCK_REQUEST,
+    PACKET_CLOCK_REPLY,
+};
+
+// The most audio packets we'll put in one PACKET_AUDIO_BATCH
+#define MAX_BATCH_FRAMES        12
+
+// Set on audio packets a relay has forwarded; see mark_relayed()
+#define PACKET_FLAG_RELAYED     0x01
+
+/*
+Every audio packet we send is a single frame made up of this header, followed
+directly by the opus data.  All fields are sent in network byte order.
+*/
+struct audio_packet_header {
+    uint8_t version;
+    uint8_t type;
+    uint8_t num_channels;
+    uint8_t flags;
+
+    // How many samples (per channel) the opus data decodes to
+    uint16_t num_samples;
+
+    // On relayed packets, which of the relay's streams this is; otherwise 0
+    uint16_t stream_id;
+
+    // Incremented by one for every packet in a stream
+    uint32_t seq;
+
+    // Which sample (per channel, counting from the start of the stream) this packet starts with
+    uint32_t timestamp;
+
+    // Wall-clock time at which the first sample of this packet hit the ADC, in microseconds
+    uint64_t capture_us;
+
+    // Wall-clock time at which the first sample of this packet should hit every receiver's DAC,
+    // in microseconds, or 0 if it should just be played as soon as it can be
+    uint64_t presentation_us;
+};
+
+// Serialize hdr into buff (which must have room for PACKET_HEADER_LEN bytes), returning how many bytes were written
+int pack_header( const audio_packet_header * hdr, unsigned char * buff );
+
+// Deserialize a header out of buff; returns false if it's too short or from a version we don't speak
+bool unpack_header( const unsigned char * buff, int len, audio_packet_header * hdr );
+
+
+// Receive-side bookkeeping for a single stream of packets
+struct stream_stats {
+    bool started;
+    uint32_t next_seq;
+
+    // The timestamp of the latest packet, unwrapped so that it keeps counting up past 2^32
+    uint32_t last_timestamp;
+    int64_t timestamp;
+
+    // Packets we've gotten, packets that never showed up, and packets that showed up too late
+    unsigned int received, lost, late;
+
+    // Times the sender started over, with sequence numbers and timestamps nowhere near what we expected
+    unsigned int resets;
+
+    // Lost packets we rebuilt from FEC, and frames we had to make up out of thin air with PLC
+    unsigned int recovered, concealed;
+
+    // Smoothed capture-to-arrival latency, in ms.  Only meaningful if both clocks agree (or we've
+    // worked out how far apart they are; see ClockSync).
+    float latency_ms;
+};
+
+/*
+A relay forwards audio packets on untouched, except that it marks them PACKET_FLAG_RELAYED
+and fills in stream_id with a short ID for whoever originally sent them.  Which identity
+each ID stands for is told to each subscriber separately, in PACKET_STREAMS packets, so
+the audio itself never carries anything bigger than those two bytes.  Both of these work
+on the header in place.
+*/
+void mark_relayed( unsigned char * packet, uint16_t stream_id );
+void unmark_relayed( unsigned char * packet );
+
+/*
+Capture and presentation times are stamped on the sender's clock, so whoever receives a
+packet moves them onto its own before going any further (if it knows how far apart the two
+clocks are), or forgets the presentation time (if it doesn't).  Both work on the header in place.
+*/
+void retime_packet( unsigned char * packet, int64_t offset_us );
+void unschedule_packet( unsigned char * packet );
+
+/*
+A PACKET_CLOCK_REQUEST or PACKET_CLOCK_REPLY is a header followed by three 64-bit wall-clock
+times in microseconds, NTP-style: when the request was sent (by the requester's clock), and
+when it was received and the reply sent (by the replier's).  The replier just copies the
+first over, and the requester notes when the reply got back; see ClockSync.
+*/
+struct clock_stamps {
+    uint64_t origin_us, receive_us, transmit_us;
+};
+#define CLOCK_PACKET_LEN        (PACKET_HEADER_LEN + 24)
+
+// Returns the length of the whole packet, or -1 if it won't fit in buff_len bytes
+int pack_clock( uint8_t type, const clock_stamps & stamps, unsigned char * buff, int buff_len );
+bool unpack_clock( const unsigned char * buff, int len, clock_stamps * stamps );
+
+/*
+A PACKET_STREAMS is a header followed by any number of stream IDs, each a 16-bit ID followed
+by the NULL-terminated identity it stands for.  Each one adds to (or replaces) what the
+subscriber already knows; a relay only reuses an ID once it's told everybody what it's now for.
+*/
+typedef std::map<uint16_t, std::string> stream_map;
+
+// Pack as many of streams as will fit in buff_len bytes, starting from next and moving it past
+// them.  Returns the length of the whole packet, or -1 if not even one would fit.
+int pack_streams( const stream_map & streams, stream_map::const_iterator & next, unsigned char * buff, int buff_len );
+// Add everything in a PACKET_STREAMS to streams; returns false if it's mangled
+bool unpack_streams( const unsigned char * buff, int len, stream_map * streams );
+
+/*
+A PACKET_SUBSCRIBE is a header followed by the most streams we want forwarded to us (0 for
+no limit), the most bitrate they may add up to in kbps (0 for no limit), both 16-bit, then
+the identities of the senders we want, in order of preference, each NULL-terminated.  If
+none are listed, we'll take anybody.
+*/
+struct subscribe_request {
+    unsigned int max_streams;
+    unsigned int max_kbps;
+    std::vector<std::string> wanted;
+};
+
+// Returns the length of the whole packet, or -1 if it won't fit in buff_len bytes
+int pack_subscribe( const subscribe_request & req, unsigned char * buff, int buff_len );
+bool unpack_subscribe( const unsigned char * buff, int len, subscribe_request * req );
+
+
+/*
+A PACKET_AUDIO_BATCH is consecutive audio packets from one stream, sent as one to cut down
+on how many packets we send.  Its header is the first packet's, apart from its type; then
+comes how many packets there are (one byte), then each packet's opus data as a 16-bit length
+followed by that many bytes.  Each packet after the first has the next seq, and starts
+num_samples later than the one before.
+*/
+// Add an audio packet (len bytes, with a header) onto the batch in buff, which is batch_len bytes
+// long so far (0 for a new batch).  Returns the batch's new length, or -1 if the packet doesn't
+// follow on from the rest of the batch, or the batch is full or won't fit in buff_len bytes.
+int batch_append( unsigned char * buff, int batch_len, int buff_len, const unsigned char * packet, int len );
+// How many packets are in a batch
+unsigned int batch_count( const unsigned char * buff, int batch_len );
+
+// One of the packets in a batch, as it was before it was batched up
+struct batch_frame {
+    audio_packet_header hdr;
+    const unsigned char * data;
+    int len;
+};
+
+// Split a batch back up into its packets, whose data points into buff; returns false if it's mangled
+bool unpack_batch( const unsigned char * buff, int len, unsigned int sample_rate, std::vector<batch_frame> * frames );
+
+
+// A packet whose sequence number is more than this many away from the one we expected (either way),
+// or whose timestamp is more than STREAM_RESET_SAMPLES (a second's worth) away from where its sequence
+// number says it should be, means its sender started over (e.g. it restarted, or it's several
+// devices sharing one identity) rather than that packets went missing or arrived late
+#define STREAM_RESET_GAP        1000
+#define STREAM_RESET_SAMPLES    48000
+
+void init_stream_stats( stream_stats * stats );
+
+// Account for a newly-arrived packet.  Returns how many packets went missing right before
+// this one (0 if it's right on time, or if its sender just started over), or -1 if it's a
+// duplicate or arrived after its successors.
+int update_stream_stats( stream_stats * stats, const audio_packet_header * hdr, double arrival_ms );
+
+#endif //PACKET_H
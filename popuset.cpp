@@ -24,13 +24,30 @@ void printUsage(char * prog_name) {
 
     printf("Usage: %s <options> where options is zero or more of:\n", prog_name);
     printf("\t--device/-d:   Device name/ID to open, with optional channel and direction.\n");
-    printf("\t--target/-t:   Address of peer to send audio to.\n");
+    printf("\t--target/-t:   Address of peer to send audio to, with /<K> to send it K packets at a time.\n");
     printf("\t--meter/-m:    Display a wicked-sick live audio meter.\n");
     printf("\t--port/-p:     Port to listen on, only valid if input devices selected.\n");
     printf("\t--log/-l:      Prefix of .wav files to log input/output to.\n");
+    printf("\t--loss/-L:     Expected packet loss percentage to protect against with FEC (default %d).\n", DEFAULT_EXPECTED_LOSS);
+    printf("\t--route/-r:    Channel matrix to route clients onto an output device with.\n");
+    printf("\t--decoders/-D: Number of threads to decode inbound clients with (default %d).\n", DEFAULT_DECODE_WORKERS);
+    printf("\t--quality/-Q:  Resampling quality for devices that can't run at %dHz: low, medium or high (default medium).\n", SAMPLE_RATE);
+    printf("\t--frame/-F:    Milliseconds of audio per buffer: 2.5, 5, 10, 20, 40 or 60 (default %d).\n", (1000*DEFAULT_FRAME_SAMPLES)/SAMPLE_RATE);
+    printf("\t--sync/-P:     Have every target play what we send this many ms after we captured it, all in sync (up to %d).\n", MAX_SYNC_MS);
+    printf("\t--direct/-x:   Send audio from input devices straight to targets, skipping the broker.\n");
+    printf("\t--udp/-u:      Send and receive audio as UDP datagrams rather than over TCP.\n");
+    printf("\t--multicast/-M: Multicast group (<group>:<port>) to send audio to and receive it from over UDP.\n");
+    printf("\t--relay/-R:    Run as a relay, forwarding audio to peers without playing or decoding it.\n");
+    printf("\t--mixer/-X:    Run as a mixer, sending each peer a mix of everybody but themselves.\n");
+    printf("\t--max-streams/-S: Most streams a relay should forward us (default no limit).\n");
+    printf("\t--max-kbps/-K: Most bitrate in kbps a relay should forward us (default no limit).\n");
+    printf("\t--listen-to/-T: Identity of a sender we'd like a relay to forward us, in order of preference.\n");
     printf("\t--help/-h:     Print this help message, along with a device listing.\n\n");
 
-    printf("Device strings conform to: <\"input\"/\"output\">:<device name/numeric id>:<channels>\n");
+    printf("Device strings conform to: <\"input\"/\"output\">:<device name/numeric id>:<channels>:<prerender>\n");
+    printf("where <prerender> is how many buffers to mix ahead of an output device (default %d).\n", DEFAULT_PRERENDER);
+    printf("Route strings conform to: [<device id>/][<client identity>/]<in>x<out>:<gains>\n");
+    printf("where <gains> lists <in> gains for each of the <out> output channels, comma-separated.\n");
     printf("Defaults: listen on port 5040, open default input/output devices with up to two channels:\n");
     printf("  %s -p 5040 -d \"input:%s:%d\" -d \"output:%s:%d\"\n\n", prog_name, input_name, input_channels, output_name, output_channels );
 
@@ -64,7 +81,7 @@ void printUsage(char * prog_name) {
 
 audio_device * parseDevice(char * optarg) {
     // Parse the device string
-    char *inout = NULL, *nameid = NULL, *channels = NULL;
+    char *inout = NULL, *nameid = NULL, *channels = NULL, *prerender = NULL;
 
     // Assume we've got at least one separator
     nameid = strstr(optarg, ":");
@@ -82,6 +99,13 @@ audio_device * parseDevice(char * optarg) {
         if( channels != NULL ) {
             channels[0] = 0;
             channels++;
+
+            // And finally, how many buffers to render ahead
+            prerender = strstr(channels, ":");
+            if( prerender != NULL ) {
+                prerender[0] = 0;
+                prerender++;
+            }
         }
     }
 
@@ -165,6 +189,18 @@ audio_device * parseDevice(char * optarg) {
         }
     }
 
+    // Last but not least, how far ahead of the device we should render
+    device->num_prerender = DEFAULT_PRERENDER;
+    if( prerender != NULL ) {
+        if( !is_number(prerender) || atoi(prerender) < 1 ) {
+            fprintf(stderr, "Invalid prerender specifier \"%s\"\n", prerender);
+            delete device->name;
+            delete device;
+            return NULL;
+        }
+        device->num_prerender = atoi(prerender);
+    }
+
     // Finally, return this device!
     return device;
 }
@@ -178,6 +214,20 @@ void parseOptions( int argc, char ** argv ) {
         {"meter", no_argument, 0, 'm'},
         {"port", required_argument, 0, 'p'},
         {"log", required_argument, 0, 'l'},
+        {"loss", required_argument, 0, 'L'},
+        {"route", required_argument, 0, 'r'},
+        {"decoders", required_argument, 0, 'D'},
+        {"frame", required_argument, 0, 'F'},
+        {"quality", required_argument, 0, 'Q'},
+        {"sync", required_argument, 0, 'P'},
+        {"direct", no_argument, 0, 'x'},
+        {"udp", no_argument, 0, 'u'},
+        {"multicast", required_argument, 0, 'M'},
+        {"relay", no_argument, 0, 'R'},
+        {"mixer", no_argument, 0, 'X'},
+        {"max-streams", required_argument, 0, 'S'},
+        {"max-kbps", required_argument, 0, 'K'},
+        {"listen-to", required_argument, 0, 'T'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -186,10 +236,21 @@ void parseOptions( int argc, char ** argv ) {
     opts.port = 5040;
     opts.meter = false;
     opts.logprefix = "";
+    opts.expected_loss = DEFAULT_EXPECTED_LOSS;
+    opts.decode_workers = DEFAULT_DECODE_WORKERS;
+    opts.frame_samples = DEFAULT_FRAME_SAMPLES;
+    opts.resampler_quality = RESAMPLE_MEDIUM;
+    opts.sync_ms = 0;
+    opts.direct = false;
+    opts.udp = false;
+    opts.relay = false;
+    opts.mixer = false;
+    opts.max_streams = 0;
+    opts.max_kbps = 0;
 
     int option_index = 0;
     int c;
-    while( (c = getopt_long( argc, argv, "d:t:p:l:mh", long_options, &option_index)) != -1 ) {
+    while( (c = getopt_long( argc, argv, "d:t:p:l:L:r:D:F:Q:P:M:S:K:T:xuRXmh", long_options, &option_index)) != -1 ) {
         switch( c ) {
             case 'd': {
                 audio_device * d = parseDevice(optarg);
@@ -206,9 +267,84 @@ void parseOptions( int argc, char ** argv ) {
             case 'm':
                 opts.meter = true;
                 break;
+            case 'x':
+                opts.direct = true;
+                break;
+            case 'u':
+                opts.udp = true;
+                break;
+            case 'M':
+                opts.multicast = optarg;
+                opts.udp = true;
+                break;
+            case 'R':
+                opts.relay = true;
+                break;
+            case 'X':
+                opts.mixer = true;
+                break;
+            case 'S':
+                opts.max_streams = atoi(optarg);
+                if( !is_number(optarg) || opts.max_streams > 65535 ) {
+                    fprintf(stderr, "Invalid number of streams \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'K':
+                opts.max_kbps = atoi(optarg);
+                if( !is_number(optarg) || opts.max_kbps > 65535 ) {
+                    fprintf(stderr, "Invalid bitrate \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                opts.listen_to.push_back(optarg);
+                break;
             case 'l':
                 opts.logprefix = optarg;
                 break;
+            case 'L':
+                opts.expected_loss = atoi(optarg);
+                if( !is_number(optarg) || opts.expected_loss > 100 ) {
+                    fprintf(stderr, "Invalid packet loss percentage \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r': {
+                channel_route route;
+                if( !parse_channel_route(optarg, &route) ) {
+                    fprintf(stderr, "Invalid route \"%s\"\n", optarg);
+                    exit(1);
+                }
+                opts.routes.push_back(route);
+            }   break;
+            case 'D':
+                opts.decode_workers = atoi(optarg);
+                if( !is_number(optarg) || opts.decode_workers < 1 ) {
+                    fprintf(stderr, "Invalid number of decode threads \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                opts.frame_samples = (unsigned int)(atof(optarg)*SAMPLE_RATE/1000.0 + 0.5);
+                if( !is_frame_size(opts.frame_samples) ) {
+                    fprintf(stderr, "Invalid frame length \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                if( !Resampler::parseQuality(optarg, &opts.resampler_quality) ) {
+                    fprintf(stderr, "Invalid resampling quality \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                opts.sync_ms = atoi(optarg);
+                if( !is_number(optarg) || opts.sync_ms < 1 || opts.sync_ms > MAX_SYNC_MS ) {
+                    fprintf(stderr, "Invalid playback delay \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'h':
                 printUsage(argv[0]);
                 exit(0);
@@ -216,14 +352,45 @@ void parseOptions( int argc, char ** argv ) {
         }
     }
 
+    // Direct mode hands each device its own zmq connection, which UDP has no use for
+    if( opts.direct && opts.udp ) {
+        fprintf(stderr, "--direct and --udp can't be used together\n");
+        exit(1);
+    }
+
+    // A relay doesn't touch audio itself, so it doesn't get any devices, default or otherwise
+    if( opts.relay && opts.devices.size() > 0 ) {
+        fprintf(stderr, "A relay can't open any devices\n");
+        exit(1);
+    }
+    if( opts.relay && opts.mixer ) {
+        fprintf(stderr, "--relay and --mixer can't be used together\n");
+        exit(1);
+    }
+
+    // A mixer mixes on a device of its own; it can play on (or record from) real devices as well,
+    // but only if we're told to.  A relay has no devices at all.
+    bool want_defaults = opts.devices.size() == 0 && !opts.relay && !opts.mixer;
+    if( opts.mixer ) {
+        audio_device * mixer = new audio_device();
+        mixer->id = -1;
+        mixer->name = new_strdup("mixer");
+        mixer->num_channels = 2;
+        mixer->direction = OUTPUT;
+        mixer->num_prerender = DEFAULT_PRERENDER;
+        mixer->is_virtual = true;
+        opts.devices.push_back(mixer);
+    }
+
     // If we haven't been given any devices, add the defaults:
-    if( opts.devices.size() == 0 ) {
+    if( want_defaults ) {
         // Default output
         audio_device * default_output = new audio_device();
         default_output->id = Pa_GetDefaultOutputDevice();
         default_output->name = new_strdup(Pa_GetDeviceInfo(default_output->id)->name);
         default_output->num_channels = fmin(2, Pa_GetDeviceInfo(default_output->id)->maxOutputChannels);
         default_output->direction = OUTPUT;
+        default_output->num_prerender = DEFAULT_PRERENDER;
 
         // Default input
         audio_device * default_input = new audio_device();
@@ -231,6 +398,7 @@ void parseOptions( int argc, char ** argv ) {
         default_input->name = new_strdup(Pa_GetDeviceInfo(default_input->id)->name);
         default_input->num_channels = fmin(2, Pa_GetDeviceInfo(default_input->id)->maxInputChannels);
         default_input->direction = INPUT;
+        default_input->num_prerender = DEFAULT_PRERENDER;
 
         // Add them to opts.devices so they get initialized by the AudioEngine
         opts.devices.push_back(default_output);
@@ -264,6 +432,13 @@ int main( int argc, char ** argv ) {
     signal(SIGINT, sigint_handler);
     setpriority(PRIO_PROCESS, 0, -10);
 
+    // Block SIGINT while we start up, so that every thread we create inherits that and it
+    // only ever gets delivered to us, in sigsuspend() below
+    sigset_t int_mask, orig_mask;
+    sigemptyset(&int_mask);
+    sigaddset(&int_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &int_mask, &orig_mask);
+
     // Initialize AudioEngine and all its little thready things
     AudioEngine * ae = new AudioEngine(opts.devices);
 
@@ -271,15 +446,13 @@ int main( int argc, char ** argv ) {
     for( auto target : opts.targets )
         ae->connect(target);
 
-    // Start the long haul loop
+    // The broker and audio threads do all the work from here on; we just wait for CTRL-C
     printf("Use CTRL-C to gracefully shutdown...\n");
+    while( shouldRun )
+        sigsuspend(&orig_mask);
 
-    while( shouldRun ) {
-        ae->processBroker();
-
-        // Run this 1000 times a second at maximum
-        usleep(1000);
-    }
+    // Let another CTRL-C through while we clean up, in case we get stuck
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
 
     // Cleanup the audio engine!
     delete ae;
@@ -15,7 +15,10 @@
 #include <math.h>
 #include <string.h>
 
+#include "channelmatrix.h"
 #include "qarb.h"
+#include "resampler.h"
+#include "ringbuffer.h"
 #include "wavfile.h"
 
 enum device_direction {
@@ -37,23 +40,53 @@ struct audio_device {
     // How many channels we read/write  (Note this is limited by opus)
     unsigned short num_channels;
 
+    // The rate the device itself runs at, and how many samples (per channel) are in each buffer it
+    // hands us or takes from us.  These are SAMPLE_RATE and opts.frame_samples unless the device
+    // can't run at SAMPLE_RATE, in which case its audio thread resamples to and from it.
+    unsigned int sample_rate, buffer_samples;
+
     // which direction we're using this device in; reading, writing, or both?
     device_direction direction;
 
+    // The mixer (see --mixer) is a device with no hardware behind it; its audio thread keeps
+    // time for itself and sends its mixes back out to our peers rather than playing them
+    bool is_virtual;
+
     // Broker [PUB] -> Audio thread [SUB], commands (client list, etc...)
     void * cmd_sock;
 
     // Audio thread [DEALER] -> Broker [ROUTER], data
     void * input_sock;
 
-    // Audio thread [PAIR] -> Audio device [PAIR]
-    void * mixed_audio_out; // PAIR (thread side)
-    void * mixed_audio_in;  // PAIR (device side)
+    // DecodeStage [PAIR] -> Audio thread [PAIR], decoded pcm_frame pointers tagged with their client slot
+    void * data_sock;
+
+    // Audio thread -> Audio device, mixed buffers ready to be played
+    SPSCRingBuffer * mixed_audio;
+
+    // How many mixed buffers the audio thread keeps rendered ahead of the device
+    unsigned int num_prerender;
+
+    // Audio device -> Audio thread, when (by the stream clock) each mixed buffer the device took
+    // will start playing, so that the audio thread can work out when what it mixes will be heard
+    SPSCTimeQueue * played;
+
+    // Only touched by the device callback; the last buffer it played, and whether it
+    // has already faded that out because the audio thread had nothing ready for it
+    float * last_mixed;
+    bool concealing;
 
+    // How many times the device wanted audio and the audio thread had none ready
+    std::atomic<unsigned int> underruns;
 
-    // Device [PUSH] -> Audio thread [PULL]
-    void * raw_audio_in;    // PUSH
-    void * raw_audio_out;   // PULL
+    // Audio thread -> Decode stage, how many ppm faster each client's audio (by slot) should come
+    // for its jitter buffer here to stay where it wants to be.  Only the one output device whose
+    // clock the decode stage keeps everybody in step with has these; NULL for the rest, which
+    // correct whatever drift is left from that device's clock to their own themselves.
+    std::atomic<float> * rate_corrections;
+
+    // Audio device -> Audio thread, raw buffers waiting to be encoded
+    SPSCRingBuffer * raw_audio;
 
     // Audio coming out of the device, and the encoder that will consume it
     OpusEncoder * encoder;
@@ -87,6 +120,46 @@ struct opts_struct {
 
     // Should we show the meter thing?
     bool meter;
+
+    // The packet loss percentage we tell our encoders to expect (and protect against with FEC)
+    int expected_loss;
+
+    // How clients get routed onto the channels of our output devices, when the defaults won't do
+    std::vector<channel_route> routes;
+
+    // How many threads share the work of decoding our inbound clients
+    unsigned int decode_workers;
+
+    // How many samples (per channel) go in each buffer we capture, encode, mix and play.  Whoever
+    // we hear from can use whatever frame length they like; we play it in buffers of our own.
+    unsigned int frame_samples;
+
+    // How carefully we resample devices that can't run at SAMPLE_RATE
+    resample_quality resampler_quality;
+
+    // If it's not 0, how many ms after capturing it every target should play what we send, so
+    // that they all play it at once (each going by how far its clock is from ours)
+    unsigned int sync_ms;
+
+    // Should input devices send straight to our targets, rather than through the broker?
+    bool direct;
+
+    // Should we talk to our peers over UDP, rather than zmq over TCP?
+    bool udp;
+
+    // The multicast group ("group:port") we send to and/or listen to, if any; implies udp
+    std::string multicast;
+
+    // Should we be a relay, forwarding what we get to whoever asks without playing any of it?
+    bool relay;
+
+    // Should we be a mixer, sending everybody who asks a mix of everybody else?
+    bool mixer;
+
+    // What we ask any relays we target for: at most this many streams adding up to at most
+    // this much bitrate (0 for no limit on either), preferably from these senders
+    unsigned int max_streams, max_kbps;
+    std::vector<std::string> listen_to;
 };
 
 extern opts_struct opts;
@@ -96,6 +169,9 @@ enum {
     CMD_INVALID = 0,
     CMD_SHUTDOWN,
     CMD_CLIENTLIST,
+    CMD_CONNECT,
+    CMD_DISCONNECT,
+    CMD_LISTENERS,
 };
 
 struct audio_device_command {
@@ -112,8 +188,21 @@ struct audio_device_command {
 // I am pretty much locked in to 48 KHz sample rate, so let's just define that here.
 #define SAMPLE_RATE             48000
 
-// I am also locked in to 10ms buffers, for better or worse.
-#define SAMPLES_IN_BUFFER       ((10*SAMPLE_RATE)/1000)
+// Frames are 10ms unless told otherwise with --frame/-F, and never longer than opus allows (60ms)
+#define DEFAULT_FRAME_SAMPLES   ((10*SAMPLE_RATE)/1000)
+#define MAX_FRAME_SAMPLES       ((60*SAMPLE_RATE)/1000)
+
+// Unless told otherwise, we assume we'll lose this percentage of our packets
+#define DEFAULT_EXPECTED_LOSS   10
+
+// How many buffers ahead of an output device we render, unless told otherwise
+#define DEFAULT_PRERENDER       2
+
+// One decode thread is plenty until we've got a whole lot of clients
+#define DEFAULT_DECODE_WORKERS  1
+
+// The longest --sync we'll take; whatever's waiting to be played has to fit in a client's jitter buffer
+#define MAX_SYNC_MS             250
 
 // We'll just keep this for funsies; this is the maximum packet size for opus
 // We've set it to an optimistic estimate of the MTU, we'll see if that's actually reasonable?
@@ -1,92 +1,116 @@
 #include "qarb.h"
+#include "mixkernels.h"
 #include <string.h>
-#include <math.h>
-#include <stdio.h>
 
-QueueingAdditiveRingBuffer::QueueingAdditiveRingBuffer( const unsigned int len ) {
-	this->data = new float[len];
-    memset(this->data, 0, sizeof(float)*len);
+QueueingAdditiveRingBuffer::QueueingAdditiveRingBuffer( const unsigned int len, const unsigned int num_channels, const unsigned int max_clients ) {
+	this->data = new float[len*num_channels];
+	memset(this->data, 0, sizeof(float)*len*num_channels);
 	this->datalen = len;
-	this->idx = 0;
-	this->last_idx = 0;
-    this->farthest_write_idx = 0;
+	this->num_channels = num_channels;
+	this->max_clients = max_clients;
+	this->read_pos = 0;
+	this->farthest_write_pos = 0;
+
+	this->write_pos = new uint64_t[max_clients];
+	this->writing = new bool[max_clients];
+	for( unsigned int i=0; i<max_clients; ++i ) {
+		this->write_pos[i] = 0;
+		this->writing[i] = false;
+	}
 }
 
 QueueingAdditiveRingBuffer::~QueueingAdditiveRingBuffer() {
 	delete[] this->data;
+	delete[] this->write_pos;
+	delete[] this->writing;
 }
 
-unsigned int QueueingAdditiveRingBuffer::circularDistance( unsigned int start, unsigned int end) {
-    int amnt = end - start;
-    if( amnt < 0 )
-        amnt += this->datalen;
-    return amnt;
+void QueueingAdditiveRingBuffer::read( const unsigned int num_samples, float * outputBuff ) {
+	// If we have to wraparound to service this request, then do it in two goes
+	unsigned int done = 0;
+	while( done < num_samples ) {
+		unsigned int idx = (this->read_pos + done)%this->datalen;
+		unsigned int batch_size = this->datalen - idx;
+		if( batch_size > num_samples - done )
+			batch_size = num_samples - done;
+
+		// Ready data into outputBuff, then zero out the stuff we just read in!
+		float * src = this->data + idx*this->num_channels;
+		memcpy(outputBuff + done*this->num_channels, src, sizeof(float)*batch_size*this->num_channels);
+		memset(src, 0, sizeof(float)*batch_size*this->num_channels);
+		done += batch_size;
+	}
+	this->read_pos += num_samples;
+	if( this->farthest_write_pos < this->read_pos )
+		this->farthest_write_pos = this->read_pos;
 }
 
-void QueueingAdditiveRingBuffer::read(const unsigned int num_samples, float * outputBuff) {
-    //printf("QARB: Reading %d\n", num_samples);
-	// If we have to wraparound to service this request, then do so by invoking ourselves twice
-    if( this->idx + num_samples > this->datalen ) {
-        unsigned int first_batch = this->datalen - this->idx;
-        this->read(first_batch, outputBuff);
-        this->read(num_samples - first_batch, outputBuff + first_batch);
-    } else {
-        // Move idxs so other people don't muck with our data
-        int old_idx = this->idx;
-    	this->idx = (this->idx + num_samples)%this->datalen;
-
-        // Update write_idxs to not fall behind this->idx
-        for( auto &kv : this->write_idxs ) {
-            if( circularDistance(old_idx, kv.second) < num_samples )
-                this->write_idxs[kv.first] = this->idx;
-        }
-
-        if( circularDistance(old_idx, this->farthest_write_idx) < num_samples ) {
-            this->farthest_write_idx = this->idx;
-        }
-
-    	// Ready data into outputBuff
-        memcpy(outputBuff, this->data + old_idx, num_samples*sizeof(float));
-
-        // Zero out the stuff we just read in!
-        memset(this->data + old_idx, 0, num_samples*sizeof(float));
-    }
+void QueueingAdditiveRingBuffer::write( const unsigned int client, const float * inputBuff, const unsigned int num_samples, const float gain ) {
+	uint64_t position = this->following(client) ? this->write_pos[client] : this->read_pos;
+	this->writeAt(client, position, inputBuff, num_samples, gain);
 }
 
-void QueueingAdditiveRingBuffer::write(const unsigned int num_samples, const std::string client_ident, const float * inputBuff) {
-    // If we've never seen this client before, then initialize his index
-    if( this->write_idxs.find(client_ident) == this->write_idxs.end() )
-        this->write_idxs[client_ident] = this->idx;
-
-    unsigned int write_idx = this->write_idxs[client_ident];
-	unsigned int amnt_written = 0;
-	while( amnt_written < num_samples ) {
-		// Instead of memcpy'ing like an ordinary ringbuffer, we ADD, and we don't update this->idx!
-		unsigned int batch_size = fmin(this->datalen - write_idx, num_samples - amnt_written);
-		for( unsigned int i=0; i<batch_size; ++i)
-			this->data[write_idx + i] += inputBuff[i + amnt_written];
-
-		amnt_written += batch_size;
-		write_idx = (write_idx + batch_size)%this->datalen;
+void QueueingAdditiveRingBuffer::writeAt( const unsigned int client, uint64_t position, const float * inputBuff, unsigned int num_samples, const float gain ) {
+	if( client >= this->max_clients )
+		return;
+	this->write_pos[client] = position + num_samples;
+	this->writing[client] = true;
+
+	// Anything that should have been read already is too late to be heard
+	if( position < this->read_pos ) {
+		uint64_t late = this->read_pos - position;
+		if( late >= num_samples )
+			return;
+		inputBuff += late*this->num_channels;
+		num_samples -= late;
+		position = this->read_pos;
+	}
+
+	// Anything past the end of the ring would wrap round onto what we haven't read yet
+	if( position + num_samples > this->read_pos + this->datalen ) {
+		if( position >= this->read_pos + this->datalen )
+			return;
+		num_samples = this->read_pos + this->datalen - position;
+	}
+
+	// Instead of memcpy'ing like an ordinary ringbuffer, we ADD, and we don't move the read position!
+	unsigned int written = 0;
+	while( written < num_samples ) {
+		unsigned int idx = (position + written)%this->datalen;
+		unsigned int batch_size = this->datalen - idx;
+		if( batch_size > num_samples - written )
+			batch_size = num_samples - written;
+
+		float * dst = this->data + idx*this->num_channels;
+		const float * src = inputBuff + written*this->num_channels;
+		if( gain == 1.0f )
+			mixk.accumulate(dst, src, batch_size*this->num_channels);
+		else
+			mixk.accumulate_gain(dst, src, gain, batch_size*this->num_channels);
+		written += batch_size;
 	}
 
-    // Update the write_idx
-    this->write_idxs[client_ident] = write_idx;
+	if( position + num_samples > this->farthest_write_pos )
+		this->farthest_write_pos = position + num_samples;
+}
 
-    // Update farthest_write_idx
-    unsigned int max_dist = fmax(circularDistance(this->idx, write_idx), circularDistance(this->idx, this->farthest_write_idx));
-    this->farthest_write_idx = (this->idx + max_dist)%this->datalen;
+bool QueueingAdditiveRingBuffer::following( const unsigned int client ) const {
+	return client < this->max_clients && this->writing[client] && this->write_pos[client] >= this->read_pos;
 }
 
-unsigned int QueueingAdditiveRingBuffer::getMaxReadable() {
-    return circularDistance(this->idx, this->farthest_write_idx);
+unsigned int QueueingAdditiveRingBuffer::ahead( const unsigned int client ) const {
+	return this->following(client) ? this->write_pos[client] - this->read_pos : 0;
 }
 
-void QueueingAdditiveRingBuffer::clearClient( std::string client_ident ) {
-    this->write_idxs.erase(client_ident);
+unsigned int QueueingAdditiveRingBuffer::getMaxReadable() const {
+	return this->farthest_write_pos - this->read_pos;
 }
 
-// You probably don't need to call this.
-unsigned int QueueingAdditiveRingBuffer::getIdx() {
-    return this->idx;
-}
\ No newline at end of file
+uint64_t QueueingAdditiveRingBuffer::position() const {
+	return this->read_pos;
+}
+
+void QueueingAdditiveRingBuffer::clearClient( const unsigned int client ) {
+	if( client < this->max_clients )
+		this->writing[client] = false;
+}
@@ -1,12 +1,22 @@
-#include <map>
-#include <string>
+#ifndef QARB_H
+#define QARB_H
+
+#include <stdint.h>
 
 /*
 The Queueing Additive Ring Buffer (QARB, pronounced "Carb") is a datastructure
 used to simplify the mixing together of multiple client audio streams into a
 single resultant audio stream in realtime.  This is done by having a single
-underlying ring buffer that is added into by multiple clients, all of which
-track their own respective location within the ring buffer.
+underlying ring buffer of interleaved audio that is added into by multiple
+clients, all of which track their own respective location within the ring buffer.
+
+Locations are absolute sample positions (per channel) on the stream we're
+reading out, so a client can also write at a particular position, e.g. the one
+its audio is meant to be heard at.  Anything that lands before what we've
+already read is too late and is discarded, as is anything too far ahead to fit.
+Clients are numbered from 0 up to the max_clients we're built with (e.g. their
+ClientTable slot), and writing is one pass of mixk.accumulate per write, so
+nothing is allocated once we're up and running.
 
 The underlying ring buffer is read from at a particular rate; clients that
 overrun this rate and the amount of available buffer space have their excess
@@ -15,20 +25,39 @@ their output.
 */
 class QueueingAdditiveRingBuffer {
 public:
-	QueueingAdditiveRingBuffer( const unsigned int len );
+	// Room for len samples (per channel) of num_channels interleaved audio
+	QueueingAdditiveRingBuffer( const unsigned int len, const unsigned int num_channels, const unsigned int max_clients );
 	~QueueingAdditiveRingBuffer();
 
-	void read(const unsigned int num_samples, float * outputBuff);
-	void write(const unsigned int num_samples, const std::string client_ident, const float * inputBuff);
+	// Copy out the next num_samples (per channel) of the mix, leaving silence behind
+	void read( const unsigned int num_samples, float * outputBuff );
+
+	// Add num_samples (per channel) of a client's audio in, scaled by gain, either carrying on
+	// from where it last left off (or from the read position, if that's already gone by), or
+	// starting at the given position.  Either way, that client carries on from the end of it.
+	void write( const unsigned int client, const float * inputBuff, const unsigned int num_samples, const float gain = 1.0f );
+	void writeAt( const unsigned int client, const uint64_t position, const float * inputBuff, const unsigned int num_samples, const float gain = 1.0f );
 
-	unsigned int getMaxReadable();
-	unsigned int getIdx();
+	// Whether this client's next write carries on from where it left off, and if so how far past
+	// the read position it'll land
+	bool following( const unsigned int client ) const;
+	unsigned int ahead( const unsigned int client ) const;
 
-	void clearClient( const std::string client_ident );
+	// How much we can read before running past everything anyone has written
+	unsigned int getMaxReadable() const;
+
+	// The position of the next sample we'll read
+	uint64_t position() const;
+
+	void clearClient( const unsigned int client );
 protected:
-	unsigned int circularDistance( unsigned int start, unsigned int end);
 	float * data;
-	unsigned int datalen, idx, last_idx, farthest_write_idx;
+	unsigned int datalen, num_channels, max_clients;
+	uint64_t read_pos, farthest_write_pos;
 
-	std::map<std::string, unsigned int> write_idxs;
+	// Where each client's next write carries on from, if it's written since it was last cleared
+	uint64_t * write_pos;
+	bool * writing;
 };
+
+#endif //QARB_H
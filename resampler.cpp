@@ -0,0 +1,240 @@
+#include "resampler.h"
+#include "mixkernels.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Filter length, how much of the passband we keep, and the Kaiser window's beta for each quality.
+// Longer filters buy a steeper cutoff, a bigger beta buys a deeper stopband.
+static const struct {
+    unsigned int taps;
+    double rolloff, beta;
+} presets[] = {
+    {16, 0.85, 6.0},    // RESAMPLE_LOW
+    {32, 0.90, 8.0},    // RESAMPLE_MEDIUM
+    {64, 0.95, 10.0},   // RESAMPLE_HIGH
+};
+
+static unsigned int gcd( unsigned int a, unsigned int b ) {
+    while( b != 0 ) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser window
+static double bessel_i0( double x ) {
+    double sum = 1.0, term = 1.0;
+    for( int k=1; k<50; ++k ) {
+        term *= (x/(2*k))*(x/(2*k));
+        sum += term;
+        if( term < 1e-12*sum )
+            break;
+    }
+    return sum;
+}
+
+Resampler::Resampler( unsigned int in_rate, unsigned int out_rate, unsigned int num_channels, unsigned int max_in, resample_quality quality ) {
+    unsigned int g = gcd(in_rate, out_rate);
+    this->phases = out_rate/g;
+    this->step = in_rate/g;
+    if( this->phases > MAX_RESAMPLE_PHASES ) {
+        fprintf(stderr, "Can't resample from %u to %u, they don't divide evenly enough\n", in_rate, out_rate);
+        throw "Error: Unsupported resampling ratio!";
+    }
+    this->num_channels = num_channels;
+    this->max_in = max_in;
+    this->taps = presets[quality].taps;
+
+    // Cut off just below whichever Nyquist frequency is lower, in cycles per input sample
+    double cutoff = 0.5*presets[quality].rolloff*fmin(1.0, (double)out_rate/in_rate);
+    double half_len = this->taps/2.0;
+    double beta = presets[quality].beta;
+
+    // Phase p puts its output sample p/phases of the way between two input samples, and its
+    // taps line up with the taps input samples around that point, the earliest first
+    this->coeffs = new float[this->phases*this->taps];
+    for( unsigned int p=0; p<this->phases; ++p ) {
+        float * row = this->coeffs + p*this->taps;
+        double sum = 0.0;
+        for( unsigned int k=0; k<this->taps; ++k ) {
+            // How far this tap's input sample is from where the output sample lands
+            double t = (double)p/this->phases + half_len - 1 - k;
+            double x = 2*cutoff*t;
+            double sinc = fabs(x) < 1e-9 ? 1.0 : sin(M_PI*x)/(M_PI*x);
+            double w = t/half_len;
+            double window = fabs(w) >= 1.0 ? 0.0 : bessel_i0(beta*sqrt(1 - w*w))/bessel_i0(beta);
+            row[k] = 2*cutoff*sinc*window;
+            sum += row[k];
+        }
+
+        // Make sure every phase passes DC through untouched, so none of them stand out
+        for( unsigned int k=0; k<this->taps; ++k )
+            row[k] /= sum;
+    }
+
+    // Start out with a filter's worth of silence, so we've got something to output straight away
+    this->history = new float *[num_channels];
+    for( unsigned int c=0; c<num_channels; ++c ) {
+        this->history[c] = new float[this->taps + max_in];
+        memset(this->history[c], 0, sizeof(float)*(this->taps + max_in));
+    }
+    this->buffered = this->taps - 1;
+    this->pos = 0;
+}
+
+Resampler::~Resampler() {
+    for( unsigned int c=0; c<this->num_channels; ++c )
+        delete[] this->history[c];
+    delete[] this->history;
+    delete[] this->coeffs;
+}
+
+unsigned int Resampler::maxOutput( unsigned int num_in ) const {
+    return ((unsigned long)num_in*this->phases + this->step - 1)/this->step + 1;
+}
+
+unsigned int Resampler::delay() const {
+    return this->taps/2;
+}
+
+unsigned int Resampler::process( const float * in, unsigned int num_in, float * out ) {
+    if( num_in > this->max_in )
+        num_in = this->max_in;
+
+    // Split the new input up by channel
+    for( unsigned int c=0; c<this->num_channels; ++c ) {
+        float * h = this->history[c] + this->buffered;
+        for( unsigned int i=0; i<num_in; ++i )
+            h[i] = in[i*this->num_channels + c];
+    }
+    this->buffered += num_in;
+
+    // Make every output sample whose taps we've got all the input for
+    unsigned int num_out = 0;
+    while( this->pos/this->phases + this->taps <= this->buffered ) {
+        unsigned int idx = this->pos/this->phases;
+        const float * row = this->coeffs + (this->pos % this->phases)*this->taps;
+        for( unsigned int c=0; c<this->num_channels; ++c )
+            out[num_out*this->num_channels + c] = mixk.dot(row, this->history[c] + idx, this->taps);
+        num_out++;
+        this->pos += this->step;
+    }
+
+    // Forget whatever's behind the next output sample's taps
+    unsigned int consumed = this->pos/this->phases;
+    for( unsigned int c=0; c<this->num_channels; ++c )
+        memmove(this->history[c], this->history[c] + consumed, sizeof(float)*(this->buffered - consumed));
+    this->buffered -= consumed;
+    this->pos -= (unsigned long)consumed*this->phases;
+    return num_out;
+}
+
+bool Resampler::parseQuality( const char * name, resample_quality * quality ) {
+    const char * names[] = {"low", "medium", "high"};
+    for( unsigned int i=0; i<sizeof(names)/sizeof(names[0]); ++i ) {
+        if( strcmp(name, names[i]) == 0 ) {
+            *quality = (resample_quality)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+DriftCorrector::DriftCorrector( unsigned int num_channels, unsigned int max_in ) {
+    this->num_channels = num_channels;
+    this->max_in = max_in;
+
+    // Start out with silence before us, in case we're interpolating from the first sample on
+    this->history = new float[(DRIFT_TAPS + max_in)*num_channels];
+    memset(this->history, 0, sizeof(float)*(DRIFT_TAPS + max_in)*num_channels);
+    this->buffered = DRIFT_TAPS - 1;
+    this->interpolating = false;
+    this->fpos = 0.0;
+    this->fstep = 1.0;
+}
+
+DriftCorrector::~DriftCorrector() {
+    delete[] this->history;
+}
+
+unsigned int DriftCorrector::maxOutput( unsigned int num_in ) {
+    return (unsigned int)ceil(num_in/(1.0 - MAX_DRIFT_CORRECTION_PPM/1e6)) + DRIFT_TAPS;
+}
+
+double DriftCorrector::delay() const {
+    return this->interpolating ? this->buffered - this->fpos : 0.0;
+}
+
+void DriftCorrector::adjust( double ppm ) {
+    ppm = fmax(-MAX_DRIFT_CORRECTION_PPM, fmin(MAX_DRIFT_CORRECTION_PPM, ppm));
+    this->fstep = 1.0 + ppm/1e6;
+}
+
+unsigned int DriftCorrector::process( const float * in, unsigned int num_in, float * out ) {
+    if( num_in > this->max_in )
+        num_in = this->max_in;
+    const unsigned int nc = this->num_channels;
+    const unsigned int keep = DRIFT_TAPS - 1;
+    bool correcting = fabs(this->fstep - 1.0) >= DRIFT_BYPASS_PPM/1e6;
+
+    // Close enough that nobody would ever hear the difference; pass it straight through, just
+    // hanging on to the last of it in case we have to start interpolating next time
+    if( !this->interpolating && !correcting ) {
+        memcpy(out, in, sizeof(float)*num_in*nc);
+        if( num_in >= keep ) {
+            memcpy(this->history, in + (num_in - keep)*nc, sizeof(float)*keep*nc);
+        } else {
+            memmove(this->history, this->history + num_in*nc, sizeof(float)*(keep - num_in)*nc);
+            memcpy(this->history + (keep - num_in)*nc, in, sizeof(float)*num_in*nc);
+        }
+        return num_in;
+    }
+
+    memcpy(this->history + this->buffered*nc, in, sizeof(float)*num_in*nc);
+    this->buffered += num_in;
+
+    // Starting afresh, the first thing out is the first thing in
+    if( !this->interpolating ) {
+        this->fpos = this->buffered - num_in;
+        this->interpolating = true;
+    }
+
+    // And stopping, everything we've got from the nearest input sample on goes out as it is
+    if( !correcting ) {
+        unsigned int idx = (unsigned int)(this->fpos + 0.5);
+        unsigned int num_out = this->buffered - idx;
+        memcpy(out, this->history + idx*nc, sizeof(float)*num_out*nc);
+        memmove(this->history, this->history + (this->buffered - keep)*nc, sizeof(float)*keep*nc);
+        this->buffered = keep;
+        this->interpolating = false;
+        return num_out;
+    }
+
+    // Make every output sample we've got the input either side of
+    unsigned int num_out = 0;
+    while( (unsigned int)this->fpos + 2 < this->buffered ) {
+        unsigned int idx = (unsigned int)this->fpos;
+        float t = this->fpos - idx;
+        const float * x = this->history + (idx - 1)*nc;
+        for( unsigned int c=0; c<nc; ++c ) {
+            float xm1 = x[c], x0 = x[nc + c], x1 = x[2*nc + c], x2 = x[3*nc + c];
+            float c1 = 0.5f*(x1 - xm1);
+            float c2 = xm1 - 2.5f*x0 + 2.0f*x1 - 0.5f*x2;
+            float c3 = 0.5f*(x2 - xm1) + 1.5f*(x0 - x1);
+            out[num_out*nc + c] = ((c3*t + c2)*t + c1)*t + x0;
+        }
+        num_out++;
+        this->fpos += this->fstep;
+    }
+
+    // Forget whatever's behind the next output sample's taps
+    unsigned int consumed = (unsigned int)this->fpos - 1;
+    memmove(this->history, this->history + consumed*nc, sizeof(float)*(this->buffered - consumed)*nc);
+    this->buffered -= consumed;
+    this->fpos -= consumed;
+    return num_out;
+}
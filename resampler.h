@@ -0,0 +1,120 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+// How hard the resampler works at keeping aliasing and imaging out; see Resampler
+enum resample_quality {
+    RESAMPLE_LOW = 0,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_HIGH,
+};
+
+// The most phases (the output rate's share of the two rates' ratio, in lowest terms) we'll
+// build a filter bank for; every common device rate against 48KHz needs far fewer than this
+#define MAX_RESAMPLE_PHASES     1024
+
+/*
+Converts a stream of interleaved audio from one sample rate to another, for devices that
+don't run at SAMPLE_RATE.  It's a polyphase windowed-sinc filter: with the two rates in
+lowest terms as in_rate:out_rate = M:L, each output sample lands on one of L evenly spaced
+positions between two input samples, and each of those positions (phases) has its own set
+of taps.  Every output sample is then a single dot product of those taps against the
+channel's recent input, which goes through mixk.dot so it's vectorized.
+
+Each channel's history is kept deinterleaved so those dot products run over contiguous
+memory.  Output lags input by half the filter's length.
+*/
+class Resampler {
+public:
+    // Process up to max_in samples (per channel) at a time
+    Resampler( unsigned int in_rate, unsigned int out_rate, unsigned int num_channels, unsigned int max_in, resample_quality quality );
+    ~Resampler();
+
+    // Resample num_in interleaved samples (per channel) from in, writing every output sample
+    // we can make so far into out; returns how many (per channel) that was.  out needs room
+    // for maxOutput(num_in) samples.
+    unsigned int process( const float * in, unsigned int num_in, float * out );
+
+    // The most samples (per channel) process() can write for num_in samples in
+    unsigned int maxOutput( unsigned int num_in ) const;
+
+    // How far behind its input our output runs, in input samples
+    unsigned int delay() const;
+
+    // Parse "low", "medium" or "high", returning false if it's none of those
+    static bool parseQuality( const char * name, resample_quality * quality );
+
+protected:
+    unsigned int num_channels, max_in;
+
+    // L and M, as above; we step through the input M/L of a sample for every output sample
+    unsigned int phases, step;
+
+    // phases*taps coefficients, one row of taps for each phase
+    unsigned int taps;
+    float * coeffs;
+
+    // Each channel's input, the oldest sample we still need first; there are buffered samples in
+    // each, and the next output sample is pos/phases samples in, at phase pos % phases
+    float ** history;
+    unsigned int buffered;
+    unsigned long pos;
+};
+
+// The furthest a DriftCorrector can be pushed from its input's rate, in parts per million
+#define MAX_DRIFT_CORRECTION_PPM    1000.0
+
+// Any closer than this, and a DriftCorrector leaves its input alone
+#define DRIFT_BYPASS_PPM            1.0
+
+// How many samples of input a DriftCorrector interpolates each output sample from
+#define DRIFT_TAPS                  4
+
+/*
+Stretches (or squeezes) a stream of interleaved audio by the few hundred parts per million
+two sample clocks can disagree by, e.g. to keep a client's jitter buffer where it wants to
+be.  At ratios this close to 1 where each output sample lands between two input samples
+barely moves from one to the next, so rather than a whole windowed-sinc filter like
+Resampler's, each is a 4-point cubic (Catmull-Rom) interpolation of the input around it:
+a handful of multiplies per sample per channel, and a couple of samples of latency.
+
+Below DRIFT_BYPASS_PPM it doesn't interpolate at all, and input goes straight through.  When
+it's pushed past that it starts afresh, right on the next input sample, and when it drops back
+under, it lets out what it's holding on to from the nearest input sample, so neither way jumps.
+*/
+class DriftCorrector {
+public:
+    // Process up to max_in samples (per channel) at a time
+    DriftCorrector( unsigned int num_channels, unsigned int max_in );
+    ~DriftCorrector();
+
+    // Correct num_in interleaved samples (per channel) from in, writing every output sample we
+    // can make so far into out; returns how many (per channel) that was.  out needs room for
+    // maxOutput(num_in) samples.
+    unsigned int process( const float * in, unsigned int num_in, float * out );
+
+    // The most samples (per channel) process() can write for num_in samples in
+    static unsigned int maxOutput( unsigned int num_in );
+
+    // How far behind its input our output runs, in input samples: how much of what we've been
+    // given the next process() will write out ahead of any of its own
+    double delay() const;
+
+    // Consume input ppm parts per million faster (or slower, if negative) than it comes in,
+    // clamped to MAX_DRIFT_CORRECTION_PPM
+    void adjust( double ppm );
+
+protected:
+    unsigned int num_channels, max_in;
+
+    // The last of our input, interleaved, oldest first; there are buffered samples in it.  While
+    // we're passing input through, that's just the last DRIFT_TAPS - 1, ready to start from.
+    float * history;
+    unsigned int buffered;
+
+    // Whether we're interpolating, how far into history the next output sample is, and how far we
+    // move for each one (both in input samples)
+    bool interpolating;
+    double fpos, fstep;
+};
+
+#endif //RESAMPLER_H
@@ -0,0 +1,125 @@
+#include "ringbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+SPSCRingBuffer::SPSCRingBuffer( const unsigned int num_slots, const unsigned int slot_len ) {
+    // Round up to a power of two so wrapping is just a mask
+    this->num_slots = 1;
+    while( this->num_slots < num_slots )
+        this->num_slots <<= 1;
+    this->mask = this->num_slots - 1;
+
+    // Round each slot up to a whole number of cache lines
+    const unsigned int floats_per_line = CACHE_LINE_SIZE/sizeof(float);
+    this->slot_len = slot_len;
+    this->slot_stride = ((slot_len + floats_per_line - 1)/floats_per_line)*floats_per_line;
+
+    void * mem = NULL;
+    if( posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(float)*this->slot_stride*this->num_slots) != 0 )
+        throw "Could not allocate ring buffer";
+    this->data = (float *)mem;
+    memset(this->data, 0, sizeof(float)*this->slot_stride*this->num_slots);
+    this->times = new double[this->num_slots];
+    memset(this->times, 0, sizeof(double)*this->num_slots);
+
+    this->write_idx.store(0);
+    this->read_idx.store(0);
+}
+
+SPSCRingBuffer::~SPSCRingBuffer() {
+    free(this->data);
+    delete[] this->times;
+}
+
+float * SPSCRingBuffer::writeSlot() {
+    unsigned int w = this->write_idx.load(std::memory_order_relaxed);
+    if( w - this->read_idx.load(std::memory_order_acquire) >= this->num_slots )
+        return NULL;
+    return this->data + (w & this->mask)*this->slot_stride;
+}
+
+void SPSCRingBuffer::commitWrite( double time ) {
+    unsigned int w = this->write_idx.load(std::memory_order_relaxed);
+    this->times[w & this->mask] = time;
+    this->write_idx.store(w + 1, std::memory_order_release);
+}
+
+bool SPSCRingBuffer::push( const float * data, double time ) {
+    float * slot = this->writeSlot();
+    if( slot == NULL )
+        return false;
+    memcpy(slot, data, sizeof(float)*this->slot_len);
+    this->commitWrite(time);
+    return true;
+}
+
+const float * SPSCRingBuffer::readSlot( double * time ) {
+    unsigned int r = this->read_idx.load(std::memory_order_relaxed);
+    if( this->write_idx.load(std::memory_order_acquire) == r )
+        return NULL;
+    if( time != NULL )
+        *time = this->times[r & this->mask];
+    return this->data + (r & this->mask)*this->slot_stride;
+}
+
+void SPSCRingBuffer::commitRead() {
+    unsigned int r = this->read_idx.load(std::memory_order_relaxed);
+    this->read_idx.store(r + 1, std::memory_order_release);
+}
+
+bool SPSCRingBuffer::pop( float * data, double * time ) {
+    const float * slot = this->readSlot(time);
+    if( slot == NULL )
+        return false;
+    memcpy(data, slot, sizeof(float)*this->slot_len);
+    this->commitRead();
+    return true;
+}
+
+unsigned int SPSCRingBuffer::size() {
+    // Load read_idx first; write_idx can only have moved further ahead of it since
+    unsigned int r = this->read_idx.load(std::memory_order_acquire);
+    return this->write_idx.load(std::memory_order_acquire) - r;
+}
+
+unsigned int SPSCRingBuffer::capacity() {
+    return this->num_slots;
+}
+
+unsigned int SPSCRingBuffer::getSlotLen() {
+    return this->slot_len;
+}
+
+SPSCTimeQueue::SPSCTimeQueue( const unsigned int num_slots ) {
+    unsigned int n = 1;
+    while( n < num_slots )
+        n <<= 1;
+    this->mask = n - 1;
+    this->times = new double[n];
+    memset(this->times, 0, sizeof(double)*n);
+
+    this->write_idx.store(0);
+    this->read_idx.store(0);
+}
+
+SPSCTimeQueue::~SPSCTimeQueue() {
+    delete[] this->times;
+}
+
+bool SPSCTimeQueue::push( double time ) {
+    unsigned int w = this->write_idx.load(std::memory_order_relaxed);
+    if( w - this->read_idx.load(std::memory_order_acquire) > this->mask )
+        return false;
+    this->times[w & this->mask] = time;
+    this->write_idx.store(w + 1, std::memory_order_release);
+    return true;
+}
+
+bool SPSCTimeQueue::pop( double * time ) {
+    unsigned int r = this->read_idx.load(std::memory_order_relaxed);
+    if( this->write_idx.load(std::memory_order_acquire) == r )
+        return false;
+    *time = this->times[r & this->mask];
+    this->read_idx.store(r + 1, std::memory_order_release);
+    return true;
+}
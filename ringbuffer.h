@@ -0,0 +1,85 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <stddef.h>
+
+// We pad things out to this so that the producer and consumer never fight over a cache line
+#define CACHE_LINE_SIZE     64
+
+/*
+The SPSCRingBuffer is a wait-free single-producer, single-consumer queue of
+fixed-size float slots, used to pass audio between the PortAudio callback and
+its audio thread.  All slots are allocated (and cache-line aligned) up front,
+so neither side ever allocates, locks or makes a syscall; a push into a full
+buffer or a pop from an empty one simply fails, and the caller decides what to
+do about it.  Each slot also carries a timestamp alongside its audio, so that
+device timing information can travel with the buffer it describes.
+
+Only one thread may ever call the producer methods (writeSlot/commitWrite/push)
+and only one thread may ever call the consumer methods (readSlot/commitRead/pop).
+*/
+class SPSCRingBuffer {
+public:
+    // num_slots is rounded up to the next power of two
+    SPSCRingBuffer( const unsigned int num_slots, const unsigned int slot_len );
+    ~SPSCRingBuffer();
+
+    // Producer side: get a pointer to the next free slot (NULL if full), fill
+    // it, then commit it.  push() does both, copying slot_len floats in.
+    float * writeSlot();
+    void commitWrite( double time = 0.0 );
+    bool push( const float * data, double time = 0.0 );
+
+    // Consumer side: get a pointer to the oldest full slot (NULL if empty),
+    // use it, then commit it.  pop() does both, copying slot_len floats out.
+    const float * readSlot( double * time = NULL );
+    void commitRead();
+    bool pop( float * data, double * time = NULL );
+
+    // Number of full slots; exact for either side, approximate for anyone else
+    unsigned int size();
+    unsigned int capacity();
+    unsigned int getSlotLen();
+
+protected:
+    float * data;
+    double * times;
+    unsigned int num_slots, mask, slot_len, slot_stride;
+
+    // Free-running indices, only ever written by the producer and consumer respectively
+    char pad0[CACHE_LINE_SIZE];
+    std::atomic<unsigned int> write_idx;
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+    std::atomic<unsigned int> read_idx;
+    char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+};
+
+/*
+The SPSCTimeQueue is the same wait-free single-producer, single-consumer queue,
+for when all we've got to pass along is a time on its own (e.g. when each buffer
+the device took will be heard), with none of the audio slots around it.  The same
+rules apply: a push onto a full queue or a pop from an empty one just fails, and
+each side belongs to one thread only.
+*/
+class SPSCTimeQueue {
+public:
+    // num_slots is rounded up to the next power of two
+    SPSCTimeQueue( const unsigned int num_slots );
+    ~SPSCTimeQueue();
+
+    bool push( double time );
+    bool pop( double * time );
+
+protected:
+    double * times;
+    unsigned int mask;
+
+    char pad0[CACHE_LINE_SIZE];
+    std::atomic<unsigned int> write_idx;
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+    std::atomic<unsigned int> read_idx;
+    char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+};
+
+#endif //RINGBUFFER_H
@@ -0,0 +1,100 @@
+// Measures how many clients' worth of 10ms stereo frames we can decode inside 10ms with
+// 1, 2, 4 and 8 decode workers, the same way DecodeStage runs a round.
+//   g++ -O3 -std=c++11 -o decodepool_bench decodepool_bench.cpp ../workerpool.cpp -lopus -lpthread
+#include "../workerpool.h"
+#include <opus/opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#define SAMPLE_RATE 48000
+#define NUM_SAMPLES 480
+#define MAX_BENCH_CLIENTS 1024
+#define ROUNDS 200
+
+struct bench_client {
+	OpusDecoder * decoder;
+	float pcm[2*NUM_SAMPLES];
+};
+
+unsigned char packet[1500];
+int packet_len;
+bench_client clients[MAX_BENCH_CLIENTS];
+pool_job jobs[MAX_BENCH_CLIENTS];
+
+double now_s() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+void decode_one( void * arg ) {
+	bench_client * c = (bench_client *)arg;
+	if( opus_decode_float(c->decoder, packet, packet_len, c->pcm, NUM_SAMPLES, 0) != NUM_SAMPLES ) {
+		fprintf(stderr, "Decode failed!\n");
+		exit(1);
+	}
+}
+
+// Average milliseconds per round of decoding one frame for each of num_clients clients
+double time_round( WorkerPool & pool, unsigned int num_clients ) {
+	for( unsigned int i=0; i<num_clients; ++i ) {
+		jobs[i].home = i;
+		jobs[i].fn = decode_one;
+		jobs[i].arg = &clients[i];
+	}
+
+	// Warm up the decoders and the workers' caches first
+	pool.run(jobs, num_clients);
+
+	double start = now_s();
+	for( int r=0; r<ROUNDS; ++r )
+		pool.run(jobs, num_clients);
+	return 1000.0*(now_s() - start)/ROUNDS;
+}
+
+int main( void ) {
+	// Encode a single frame of something musical to decode over and over
+	int err;
+	OpusEncoder * enc = opus_encoder_create(SAMPLE_RATE, 2, OPUS_APPLICATION_AUDIO, &err);
+	opus_encoder_ctl(enc, OPUS_SET_BITRATE(128000));
+	float pcm[2*NUM_SAMPLES];
+	for( int i=0; i<NUM_SAMPLES; ++i ) {
+		pcm[2*i + 0] = 0.5f*sinf(2*M_PI*440.0f*i/SAMPLE_RATE);
+		pcm[2*i + 1] = 0.5f*sinf(2*M_PI*554.4f*i/SAMPLE_RATE);
+	}
+	packet_len = opus_encode_float(enc, pcm, NUM_SAMPLES, packet, sizeof(packet));
+	opus_encoder_destroy(enc);
+
+	for( int i=0; i<MAX_BENCH_CLIENTS; ++i )
+		clients[i].decoder = opus_decoder_create(SAMPLE_RATE, 2, &err);
+
+	unsigned int worker_counts[] = {1, 2, 4, 8};
+	for( auto num_workers : worker_counts ) {
+		WorkerPool pool(num_workers, MAX_BENCH_CLIENTS);
+
+		// Double the clients until we blow the 10ms budget, then bisect to find the most that fit
+		unsigned int lo = 0, hi = 1;
+		while( hi <= MAX_BENCH_CLIENTS && time_round(pool, hi) < 10.0 ) {
+			lo = hi;
+			hi *= 2;
+		}
+		if( hi > MAX_BENCH_CLIENTS )
+			hi = MAX_BENCH_CLIENTS + 1;
+		while( hi - lo > 1 ) {
+			unsigned int mid = (lo + hi)/2;
+			if( time_round(pool, mid) < 10.0 )
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		double per_client = lo > 0 ? time_round(pool, lo)/lo : 0.0;
+		printf("%u workers: %4u clients in 10ms (%.3fms per client per round)\n", num_workers, lo, per_client);
+	}
+
+	for( int i=0; i<MAX_BENCH_CLIENTS; ++i )
+		opus_decoder_destroy(clients[i].decoder);
+	return 0;
+}
@@ -0,0 +1,121 @@
+// Compares the two ways an input device's packets can get onto the wire: handed through an
+// inproc DEALER to a broker thread that sends them on from its ROUTER (the default), or sent
+// straight out of the device thread's own DEALER (--direct).  For each, we time how long a
+// packet takes to reach a receiver over loopback TCP, and count the context switches per packet.
+//   g++ -O2 -std=c++11 -o direct_send_bench direct_send_bench.cpp -lzmq -lpthread
+#include <zmq.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define NUM_PACKETS 2000
+#define PACKET_LEN 200
+
+void * ctx;
+void * receiver;
+volatile bool broker_running;
+
+double now_ms() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000.0 + t.tv_nsec/1e6;
+}
+
+long context_switches() {
+	rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_nvcsw + r.ru_nivcsw;
+}
+
+// What AudioEngine::processBroker() does with input packets, and nothing else
+void * broker(void * arg) {
+	void * input = zmq_socket(ctx, ZMQ_ROUTER);
+	zmq_bind(input, "inproc://broker_input");
+	void * world = zmq_socket(ctx, ZMQ_ROUTER);
+	zmq_setsockopt(world, ZMQ_IDENTITY, "sender", 7);
+	zmq_connect(world, "tcp://127.0.0.1:5099");
+	// Give the connection a moment to come up, so the ROUTER knows where "receiver" is
+	usleep(200*1000);
+
+	zmq_pollitem_t item = {input, 0, ZMQ_POLLIN, 0};
+	unsigned char packet[PACKET_LEN];
+	while( broker_running ) {
+		if( zmq_poll(&item, 1, 100) <= 0 )
+			continue;
+		char device[8];
+		zmq_recv(input, device, sizeof(device), 0);
+		int len = zmq_recv(input, packet, sizeof(packet), 0);
+		zmq_send(world, "receiver", 9, ZMQ_SNDMORE);
+		zmq_send(world, packet, len, 0);
+	}
+	zmq_close(input);
+	zmq_close(world);
+	return NULL;
+}
+
+void run(bool direct) {
+	pthread_t broker_thread;
+	void * sender;
+	if( direct ) {
+		sender = zmq_socket(ctx, ZMQ_DEALER);
+		zmq_setsockopt(sender, ZMQ_IDENTITY, "direct", 7);
+		zmq_connect(sender, "tcp://127.0.0.1:5099");
+	} else {
+		broker_running = true;
+		pthread_create(&broker_thread, NULL, broker, NULL);
+		sender = zmq_socket(ctx, ZMQ_DEALER);
+		zmq_setsockopt(sender, ZMQ_IDENTITY, "device", 7);
+		zmq_connect(sender, "inproc://broker_input");
+	}
+	usleep(500*1000);
+
+	// Every packet carries the time it was sent; pace them out like a real device would (if
+	// quicker), so we're measuring a handoff and not a queue
+	double total_ms = 0.0, max_ms = 0.0;
+	long start_switches = context_switches();
+	for( int i=0; i<NUM_PACKETS; ++i ) {
+		unsigned char packet[PACKET_LEN];
+		memset(packet, 0, sizeof(packet));
+		double sent = now_ms();
+		memcpy(packet, &sent, sizeof(double));
+		zmq_send(sender, packet, sizeof(packet), 0);
+
+		char ident[16];
+		zmq_recv(receiver, ident, sizeof(ident), 0);
+		zmq_recv(receiver, packet, sizeof(packet), 0);
+		double elapsed = now_ms() - sent;
+		total_ms += elapsed;
+		if( elapsed > max_ms )
+			max_ms = elapsed;
+		usleep(1000);
+	}
+	long switches = context_switches() - start_switches;
+
+	// We sleep once per packet ourselves, so take that out of the count
+	printf("%-8s %.3fms average, %.3fms max, %.2f context switches per packet\n", direct ? "direct" : "broker",
+	       total_ms/NUM_PACKETS, max_ms, (double)(switches - NUM_PACKETS)/NUM_PACKETS);
+
+	zmq_close(sender);
+	if( !direct ) {
+		broker_running = false;
+		pthread_join(broker_thread, NULL);
+	}
+}
+
+int main(void) {
+	ctx = zmq_ctx_new();
+
+	// The far end, just like a world_sock
+	receiver = zmq_socket(ctx, ZMQ_ROUTER);
+	zmq_setsockopt(receiver, ZMQ_IDENTITY, "receiver", 9);
+	zmq_bind(receiver, "tcp://127.0.0.1:5099");
+
+	run(false);
+	run(true);
+	zmq_close(receiver);
+	zmq_ctx_term(ctx);
+	return 0;
+}
@@ -0,0 +1,167 @@
+// Measures samples/second through each of our mixing kernels, against the plain loops
+// audio_thread and mixdown_channels used to run, and checks every set agrees with scalar.
+//   g++ -O3 -std=c++11 -o mixkernels_bench mixkernels_bench.cpp ../mixkernels.cpp
+#include "../mixkernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// 10ms at 48KHz, like one client's frame, with room for up to MAX_CHANNELS
+#define NUM_SAMPLES 480
+#define ITERATIONS 200000
+#define MAX_CHANNELS 8
+
+float in[MAX_CHANNELS*NUM_SAMPLES], out[MAX_CHANNELS*NUM_SAMPLES], check[MAX_CHANNELS*NUM_SAMPLES];
+
+// Channel counts only turn up at runtime in the real thing, so don't let the compiler see them here either
+volatile unsigned int stereo = 2, surround = 6;
+
+double now_s() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// What we used to do, kept out of line so the compiler can't get clever across iterations
+__attribute__((noinline)) void old_accumulate( float * out, const float * in, unsigned int len ) {
+	for( unsigned int i=0; i<len; ++i )
+		out[i] += in[i];
+}
+__attribute__((noinline)) void old_upmix_mono( float * out, const float * in, unsigned int num_samples, unsigned int out_channels ) {
+	for( unsigned int i=0; i<num_samples; ++i ) {
+		for( unsigned int k=0; k<out_channels; ++k )
+			out[i*out_channels + k] += in[i];
+	}
+}
+__attribute__((noinline)) void old_downmix_mono( float * out, const float * in, unsigned int num_samples, unsigned int in_channels ) {
+	for( unsigned int i=0; i<num_samples; ++i ) {
+		float tmp_mix = 0.0f;
+		for( unsigned int k=0; k<in_channels; ++k )
+			tmp_mix += in[i*in_channels + k];
+		out[i] += tmp_mix/in_channels;
+	}
+}
+
+void report(const char * kernels, const char * kernel, double elapsed, unsigned int samples_per_iter) {
+	printf("%-8s %-16s %8.1f Msamples/s\n", kernels, kernel, (double)samples_per_iter*ITERATIONS/elapsed/1e6);
+}
+
+// Run every kernel through its paces, with whatever is currently selected in mixk
+void bench(const char * name, const mix_kernel_set & k) {
+	double start;
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.accumulate(out, in, 2*NUM_SAMPLES);
+	report(name, "accumulate", now_s() - start, 2*NUM_SAMPLES);
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.accumulate_gain(out, in, 0.5f, 2*NUM_SAMPLES);
+	report(name, "accumulate_gain", now_s() - start, 2*NUM_SAMPLES);
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.upmix_mono(out, in, NUM_SAMPLES, stereo);
+	report(name, "upmix 1->2", now_s() - start, NUM_SAMPLES);
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.downmix_mono(out, in, NUM_SAMPLES, stereo);
+	report(name, "downmix 2->1", now_s() - start, NUM_SAMPLES);
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.upmix_mono(out, in, NUM_SAMPLES, surround);
+	report(name, "upmix 1->6", now_s() - start, NUM_SAMPLES);
+
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		k.downmix_mono(out, in, NUM_SAMPLES, surround);
+	report(name, "downmix 6->1", now_s() - start, NUM_SAMPLES);
+
+	// A resampler's worth of taps at a time
+	volatile float sink = 0.0f;
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i ) {
+		for( unsigned int j=0; j+32<=2*NUM_SAMPLES; j += 32 )
+			sink = sink + k.dot(in + j, out + j, 32);
+	}
+	report(name, "dot (32 taps)", now_s() - start, 2*NUM_SAMPLES);
+}
+
+// Compare a kernel set against scalar on an awkward length, to exercise the tail handling
+bool verify(const mix_kernel_set & k, const mix_kernel_set & ref) {
+	const unsigned int n = NUM_SAMPLES - 3;
+	bool ok = true;
+	#define VERIFY(what, call_k, call_ref, len) \
+		memset(out, 0, sizeof(out)); memset(check, 0, sizeof(check)); \
+		call_k; call_ref; \
+		for( unsigned int i=0; i<len; ++i ) { \
+			if( fabs(out[i] - check[i]) > 1e-6 ) { \
+				printf("%s %s mismatch at %u: %f != %f\n", k.name, what, i, out[i], check[i]); \
+				ok = false; break; \
+			} \
+		}
+	VERIFY("accumulate", k.accumulate(out, in, 2*n), ref.accumulate(check, in, 2*n), 2*n);
+	VERIFY("accumulate_gain", k.accumulate_gain(out, in, 0.3f, 2*n), ref.accumulate_gain(check, in, 0.3f, 2*n), 2*n);
+	for( unsigned int ch=1; ch<=MAX_CHANNELS; ++ch ) {
+		VERIFY("upmix", k.upmix_mono(out, in, n, ch), ref.upmix_mono(check, in, n, ch), ch*n);
+		VERIFY("downmix", k.downmix_mono(out, in, n, ch), ref.downmix_mono(check, in, n, ch), n);
+	}
+	// Vectorized dot products add up in a different order, so only hold them to float precision
+	float dot_k = k.dot(in, in + n, n), dot_ref = ref.dot(in, in + n, n);
+	if( fabs(dot_k - dot_ref) > 1e-5*fabs(dot_ref) ) {
+		printf("%s dot mismatch: %f != %f\n", k.name, dot_k, dot_ref);
+		ok = false;
+	}
+	return ok;
+}
+
+int main( void ) {
+	for( int i=0; i<MAX_CHANNELS*NUM_SAMPLES; ++i )
+		in[i] = (rand()%2000 - 1000)/1000.0f;
+	memset(out, 0, sizeof(out));
+
+	mix_kernel_set old_loops = {"old", old_accumulate, NULL, old_upmix_mono, old_downmix_mono, NULL};
+	double start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		old_loops.accumulate(out, in, 2*NUM_SAMPLES);
+	report("old", "accumulate", now_s() - start, 2*NUM_SAMPLES);
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		old_loops.upmix_mono(out, in, NUM_SAMPLES, stereo);
+	report("old", "upmix 1->2", now_s() - start, NUM_SAMPLES);
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		old_loops.downmix_mono(out, in, NUM_SAMPLES, stereo);
+	report("old", "downmix 2->1", now_s() - start, NUM_SAMPLES);
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		old_loops.upmix_mono(out, in, NUM_SAMPLES, surround);
+	report("old", "upmix 1->6", now_s() - start, NUM_SAMPLES);
+	start = now_s();
+	for( int i=0; i<ITERATIONS; ++i )
+		old_loops.downmix_mono(out, in, NUM_SAMPLES, surround);
+	report("old", "downmix 6->1", now_s() - start, NUM_SAMPLES);
+
+	select_mix_kernels("scalar");
+	mix_kernel_set scalar = mixk;
+
+	const char * names[] = {"scalar", "sse", "avx2", "neon"};
+	for( int i=0; i<4; ++i ) {
+		if( !select_mix_kernels(names[i]) ) {
+			printf("%-8s (not available)\n", names[i]);
+			continue;
+		}
+		if( !verify(mixk, scalar) )
+			return 1;
+		bench(names[i], mixk);
+	}
+
+	init_mix_kernels();
+	printf("init_mix_kernels() chose %s\n", mixk.name);
+	return 0;
+}
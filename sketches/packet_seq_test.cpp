@@ -0,0 +1,65 @@
+// Checks that update_stream_stats() tells lost and late packets apart from a sender starting over.
+//   g++ -std=c++11 -o packet_seq_test packet_seq_test.cpp ../packet.cpp && ./packet_seq_test
+#include "../packet.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FRAME 480
+
+int failures = 0;
+
+void check( bool ok, const char * what ) {
+	printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+	if( !ok )
+		failures++;
+}
+
+// What update_stream_stats() makes of a packet with this sequence number and timestamp
+int arrive( stream_stats * stats, uint32_t seq, uint32_t timestamp ) {
+	audio_packet_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = PACKET_AUDIO;
+	hdr.seq = seq;
+	hdr.timestamp = timestamp;
+	hdr.num_samples = FRAME;
+	return update_stream_stats(stats, &hdr, 0.0);
+}
+
+int main( void ) {
+	stream_stats stats;
+
+	// A sender that's been going a while, then restarts from 0; everything after the restart should
+	// play, rather than be thrown away as late until its sequence numbers catch back up
+	init_stream_stats(&stats);
+	for( uint32_t seq=5000; seq<5100; ++seq )
+		arrive(&stats, seq, seq*FRAME);
+	bool all_played = true;
+	for( uint32_t seq=0; seq<100; ++seq )
+		all_played &= arrive(&stats, seq, seq*FRAME) == 0;
+	check(all_played, "restart with a lower sequence number plays");
+	check(stats.resets == 1 && stats.late == 0 && stats.lost == 0, "restart counted once, nothing late or lost");
+	check(stats.timestamp == (int64_t)(5000 + 199)*FRAME, "unwrapped timestamp carries on through the restart");
+
+	// A restart that happens to pick up just a little behind where we were is caught by its timestamps
+	init_stream_stats(&stats);
+	for( uint32_t seq=100; seq<200; ++seq )
+		arrive(&stats, seq, 1000000 + seq*FRAME);
+	check(arrive(&stats, 150, 777) == 0 && arrive(&stats, 151, 777 + FRAME) == 0, "restart close by with new timestamps plays");
+	check(stats.resets == 1, "restart close by counted once");
+
+	// Whereas ordinary loss and reordering are still just that
+	init_stream_stats(&stats);
+	arrive(&stats, 10, 10*FRAME);
+	check(arrive(&stats, 13, 13*FRAME) == 2, "two lost packets");
+	check(arrive(&stats, 12, 12*FRAME) == -1, "late packet");
+	check(stats.resets == 0 && stats.lost == 1 && stats.late == 1, "loss and lateness counted, no resets");
+
+	// Sequence numbers wrapping around aren't a restart either
+	init_stream_stats(&stats);
+	arrive(&stats, 0xfffffffe, 0xfffffffe*FRAME);
+	check(arrive(&stats, 0xffffffff, 0xffffffff*FRAME) == 0 && arrive(&stats, 0, 0) == 0, "sequence wraparound");
+	check(stats.resets == 0, "no resets across wraparound");
+
+	printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures != 0;
+}
@@ -1,4 +1,5 @@
 #include "../qarb.h"
+#include "../mixkernels.h"
 #include "../wavfile.h"
 #include <pthread.h>
 #include <unistd.h>
@@ -46,7 +47,7 @@ void * producer1(void * data) {
 	// Push data into this guy until we should quit
 	int count = -100;
 	int offset = 0;
-	std::string ident = "producer1";
+	unsigned int client = 0;
 
 	while( !should_quit ) {
 		usleep(WRITE_MS*1000);
@@ -55,7 +56,7 @@ void * producer1(void * data) {
 			for( int i=0; i<WRITE_CHUNK; ++i )
 				buff[i] = count;
 
-			qarb->write(WRITE_CHUNK, ident, buff);
+			qarb->write(client, buff, WRITE_CHUNK);
 			offset += WRITE_CHUNK;
 			count++;
 			if( count > 100 )
@@ -69,8 +70,8 @@ void * monitor(void * data) {
 	QueueingAdditiveRingBuffer * qarb = (QueueingAdditiveRingBuffer *)data;
 
 	while( !should_quit ) {
-		unsigned int start_idx = qarb->getIdx()/20;
-		unsigned int end_idx = ((qarb->getIdx() + qarb->getMaxReadable())%QARB_LEN)/20;
+		unsigned int start_idx = (qarb->position()%QARB_LEN)/20;
+		unsigned int end_idx = ((qarb->position() + qarb->getMaxReadable())%QARB_LEN)/20;
 
 		printf("\r[");
 		if( end_idx < start_idx ) {
@@ -106,7 +107,8 @@ void sigint_handler(int dummy=0) {
 
 
 int main( void ) {
-	QueueingAdditiveRingBuffer * qarb = new QueueingAdditiveRingBuffer(QARB_LEN);
+	init_mix_kernels();
+	QueueingAdditiveRingBuffer * qarb = new QueueingAdditiveRingBuffer(QARB_LEN, 1, 1);
 
 	// Start producer and consumer threads
 	pthread_t producer1_thread;
@@ -0,0 +1,98 @@
+// Measures what resampling a device that can't run at 48KHz costs us, per channel, at each
+// quality and with each set of mixing kernels (the resampler's dot products go through mixk),
+// and then what correcting a client's drift costs, both passing through and interpolating.
+// Each run pushes 10 seconds of audio through in 10ms buffers, the way an audio thread would,
+// and reports the share of one core each channel takes to keep up in realtime.
+//   g++ -O3 -std=c++11 -o resampler_bench resampler_bench.cpp ../resampler.cpp ../mixkernels.cpp
+#include "../resampler.h"
+#include "../mixkernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#define SECONDS 10
+#define MAX_CHANNELS 2
+
+double now_s() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// Seconds of CPU it takes to resample SECONDS of audio
+double time_resample( unsigned int in_rate, unsigned int out_rate, unsigned int num_channels, resample_quality quality ) {
+	unsigned int buffer = in_rate/100;
+	Resampler r(in_rate, out_rate, num_channels, buffer, quality);
+	float * in = new float[buffer*num_channels];
+	float * out = new float[r.maxOutput(buffer)*num_channels];
+	for( unsigned int i=0; i<buffer*num_channels; ++i )
+		in[i] = 0.5f*sinf(2*M_PI*1000.0f*(i/num_channels)/in_rate);
+
+	// Keep the output live, so none of it gets optimized away
+	volatile float sink = 0.0f;
+	double start = now_s();
+	for( int b=0; b<100*SECONDS; ++b ) {
+		unsigned int n = r.process(in, buffer, out);
+		sink = sink + out[(n - 1)*num_channels];
+	}
+	double elapsed = now_s() - start;
+
+	delete[] in;
+	delete[] out;
+	return elapsed;
+}
+
+// The same, for correcting drift by ppm at 48KHz
+double time_drift( double ppm, unsigned int num_channels ) {
+	unsigned int buffer = 480;
+	DriftCorrector d(num_channels, buffer);
+	d.adjust(ppm);
+	float * in = new float[buffer*num_channels];
+	float * out = new float[DriftCorrector::maxOutput(buffer)*num_channels];
+	for( unsigned int i=0; i<buffer*num_channels; ++i )
+		in[i] = 0.5f*sinf(2*M_PI*1000.0f*(i/num_channels)/48000);
+
+	volatile float sink = 0.0f;
+	double start = now_s();
+	for( int b=0; b<100*SECONDS; ++b ) {
+		unsigned int n = d.process(in, buffer, out);
+		sink = sink + out[(n - 1)*num_channels];
+	}
+	double elapsed = now_s() - start;
+
+	delete[] in;
+	delete[] out;
+	return elapsed;
+}
+
+int main( void ) {
+	const char * kernels[] = {"scalar", "sse", "avx2", "neon"};
+	const char * qualities[] = {"low", "medium", "high"};
+	const unsigned int rates[][2] = {{44100, 48000}, {48000, 44100}, {96000, 48000}};
+
+	for( auto name : kernels ) {
+		if( !select_mix_kernels(name) ) {
+			printf("%-8s (not available)\n", name);
+			continue;
+		}
+		for( int q=0; q<3; ++q ) {
+			for( auto& rate : rates ) {
+				for( unsigned int ch=1; ch<=MAX_CHANNELS; ++ch ) {
+					double elapsed = time_resample(rate[0], rate[1], ch, (resample_quality)q);
+					printf("%-8s %-6s %6u -> %6u, %u channel%s: %.3f%% of a core per channel\n", name, qualities[q],
+					       rate[0], rate[1], ch, ch == 1 ? " " : "s", 100.0*elapsed/SECONDS/ch);
+				}
+			}
+		}
+	}
+
+	const double ppms[] = {0.0, 500.0};
+	for( auto ppm : ppms ) {
+		for( unsigned int ch=1; ch<=MAX_CHANNELS; ++ch ) {
+			double elapsed = time_drift(ppm, ch);
+			printf("drift    %+6.0fppm, %u channel%s: %.3f%% of a core per channel\n", ppm, ch, ch == 1 ? " " : "s", 100.0*elapsed/SECONDS/ch);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,256 @@
+// Compares how long the PortAudio callback spends handing audio to/from the audio
+// thread over the old inproc ZMQ sockets versus the SPSC ring buffers, and then what
+// the whole callback side costs if it also wakes the audio thread up through an eventfd,
+// against leaving the audio thread to wake itself up in time for the next callback.  Build with:
+//   g++ -O3 -std=c++11 -o ringbuffer_bench ringbuffer_bench.cpp ../ringbuffer.cpp -lzmq -lpthread
+#include "../ringbuffer.h"
+#include <zmq.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define CHANNELS 2
+#define FRAMES 480
+#define ITERATIONS 5000
+// Pretend to be a callback firing every so often, so the other side can keep up
+#define CALLBACK_PERIOD_US 200
+
+bool should_quit = false;
+void * zmq_ctx;
+
+double now_us() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+void report(const char * name, std::vector<double> & times) {
+	std::sort(times.begin(), times.end());
+	double sum = 0;
+	for( unsigned int i=0; i<times.size(); ++i )
+		sum += times[i];
+	printf("%-22s mean %7.2fus  p50 %7.2fus  p99 %7.2fus  max %8.2fus\n", name, sum/times.size(),
+		times[times.size()/2], times[(times.size()*99)/100], times.back());
+}
+
+// The audio thread side of the old input path: PULL everything the device pushes
+void * zmq_input_consumer(void * data) {
+	void * sock = zmq_socket(zmq_ctx, ZMQ_PULL);
+	zmq_connect(sock, "inproc://bench_raw");
+	float buff[FRAMES*CHANNELS];
+	for( int i=0; i<ITERATIONS; ++i )
+		zmq_recv(sock, buff, sizeof(buff), 0);
+	zmq_close(sock);
+	return NULL;
+}
+
+// The audio thread side of the old output path: answer every request with a buffer
+void * zmq_output_responder(void * data) {
+	void * sock = zmq_socket(zmq_ctx, ZMQ_PAIR);
+	zmq_connect(sock, "inproc://bench_mixed");
+	float buff[FRAMES*CHANNELS];
+	memset(buff, 0, sizeof(buff));
+	for( int i=0; i<ITERATIONS; ++i ) {
+		int empty;
+		zmq_recv(sock, &empty, 0, 0);
+		zmq_send(sock, buff, sizeof(buff), 0);
+	}
+	zmq_close(sock);
+	return NULL;
+}
+
+// The audio thread side of the new paths: drain raw, keep mixed topped up
+void * ring_thread(void * data) {
+	SPSCRingBuffer ** rings = (SPSCRingBuffer **)data;
+	float buff[FRAMES*CHANNELS];
+	memset(buff, 0, sizeof(buff));
+	while( !should_quit ) {
+		while( rings[0]->pop(buff) )
+			;
+		while( rings[1]->size() < 1 )
+			rings[1]->push(buff);
+		usleep(100);
+	}
+	return NULL;
+}
+
+// The audio thread's side, for timing the callback with a wakeup: either the device writes to an
+// eventfd (or pipe) every callback and we sleep on it, or the device makes no syscalls at all and we
+// sleep until just before its next callback is due, looking in every millisecond from then on
+int wake_fds[2];
+bool use_fd;
+unsigned int thread_wakeups;
+
+void make_wakeup() {
+#ifdef __linux__
+	wake_fds[0] = wake_fds[1] = eventfd(0, EFD_NONBLOCK);
+#else
+	(void)!pipe(wake_fds);
+	for( int i=0; i<2; ++i )
+		fcntl(wake_fds[i], F_SETFL, fcntl(wake_fds[i], F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+void wake() {
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+	(void)!write(wake_fds[1], &one, sizeof(one));
+}
+
+void * waiting_ring_thread(void * data) {
+	SPSCRingBuffer ** rings = (SPSCRingBuffer **)data;
+	float buff[FRAMES*CHANNELS];
+	memset(buff, 0, sizeof(buff));
+	pollfd item = {wake_fds[0], POLLIN, 0};
+	double next_callback_us = 0.0;
+	while( !should_quit ) {
+		bool has_work = rings[0]->size() > 0 || rings[1]->size() < 1;
+		if( use_fd ) {
+			poll(&item, 1, has_work ? 0 : 100);
+			char drain[64];
+			while( read(wake_fds[0], drain, sizeof(drain)) > 0 )
+				;
+		} else {
+			double wait_ms = has_work ? 0.0 : fmax(1.0, ceil((next_callback_us - now_us())/1000.0 - 1.0));
+			poll(NULL, 0, (int)wait_ms);
+			if( rings[0]->size() > 0 || rings[1]->size() < 1 )
+				next_callback_us = now_us() + CALLBACK_PERIOD_US*10;
+		}
+		thread_wakeups++;
+
+		while( rings[0]->pop(buff) )
+			;
+		while( rings[1]->size() < 1 )
+			rings[1]->push(buff);
+	}
+	return NULL;
+}
+
+// Time the callback side, wakeup and all, with the callback firing every 10*CALLBACK_PERIOD_US so
+// that the audio thread has time to go to sleep in between, as it would for real
+void time_callback(const char * name, bool fd) {
+	float buff[FRAMES*CHANNELS];
+	memset(buff, 0, sizeof(buff));
+	SPSCRingBuffer * rings[2];
+	rings[0] = new SPSCRingBuffer(8, FRAMES*CHANNELS);
+	rings[1] = new SPSCRingBuffer(1, FRAMES*CHANNELS);
+	use_fd = fd;
+	thread_wakeups = 0;
+	should_quit = false;
+	pthread_t thread;
+	pthread_create(&thread, NULL, waiting_ring_thread, (void *)&rings[0]);
+
+	std::vector<double> times;
+	unsigned int misses = 0;
+	for( int i=0; i<ITERATIONS/10; ++i ) {
+		double start = now_us();
+		rings[0]->push(buff);
+		if( !rings[1]->pop(buff) )
+			misses++;
+		if( fd )
+			wake();
+		times.push_back(now_us() - start);
+		usleep(10*CALLBACK_PERIOD_US);
+	}
+	should_quit = true;
+	wake();
+	pthread_join(thread, NULL);
+	report(name, times);
+	printf("%s: audio thread woke %.1f times a callback, nothing ready %u/%d times\n", name,
+		(double)thread_wakeups/(ITERATIONS/10), misses, ITERATIONS/10);
+
+	delete rings[0];
+	delete rings[1];
+}
+
+int main( void ) {
+	zmq_ctx = zmq_ctx_new();
+	float buff[FRAMES*CHANNELS];
+	memset(buff, 0, sizeof(buff));
+	std::vector<double> times;
+	pthread_t thread;
+
+	// Old input path: zmq_send() on a PUSH socket
+	void * raw_in = zmq_socket(zmq_ctx, ZMQ_PUSH);
+	zmq_bind(raw_in, "inproc://bench_raw");
+	pthread_create(&thread, NULL, zmq_input_consumer, NULL);
+	for( int i=0; i<ITERATIONS; ++i ) {
+		double start = now_us();
+		zmq_send(raw_in, buff, sizeof(buff), 0);
+		times.push_back(now_us() - start);
+		usleep(CALLBACK_PERIOD_US);
+	}
+	pthread_join(thread, NULL);
+	zmq_close(raw_in);
+	report("zmq input (PUSH)", times);
+	times.clear();
+
+	// Old output path: zmq_send()/zmq_recv() round trip on a PAIR socket
+	void * mixed_in = zmq_socket(zmq_ctx, ZMQ_PAIR);
+	zmq_bind(mixed_in, "inproc://bench_mixed");
+	pthread_create(&thread, NULL, zmq_output_responder, NULL);
+	for( int i=0; i<ITERATIONS; ++i ) {
+		double start = now_us();
+		int empty = 0;
+		zmq_send(mixed_in, &empty, 1, 0);
+		zmq_recv(mixed_in, buff, sizeof(buff), 0);
+		times.push_back(now_us() - start);
+		usleep(CALLBACK_PERIOD_US);
+	}
+	pthread_join(thread, NULL);
+	zmq_close(mixed_in);
+	report("zmq output (PAIR)", times);
+	times.clear();
+
+	// New paths: ring buffer push and pop
+	SPSCRingBuffer * rings[2];
+	rings[0] = new SPSCRingBuffer(8, FRAMES*CHANNELS);
+	rings[1] = new SPSCRingBuffer(1, FRAMES*CHANNELS);
+	pthread_create(&thread, NULL, ring_thread, (void *)&rings[0]);
+
+	std::vector<double> out_times;
+	unsigned int misses = 0;
+	for( int i=0; i<ITERATIONS; ++i ) {
+		double start = now_us();
+		rings[0]->push(buff);
+		double mid = now_us();
+		if( !rings[1]->pop(buff) )
+			misses++;
+		double end = now_us();
+		times.push_back(mid - start);
+		out_times.push_back(end - mid);
+		usleep(CALLBACK_PERIOD_US);
+	}
+	should_quit = true;
+	pthread_join(thread, NULL);
+	report("ring input (push)", times);
+	report("ring output (pop)", out_times);
+	printf("ring output had nothing ready %u/%d times\n", misses, ITERATIONS);
+
+	delete rings[0];
+	delete rings[1];
+
+	// And the whole callback side, including waking the audio thread up
+	make_wakeup();
+	time_callback("callback + eventfd", true);
+	time_callback("callback, timed wait", false);
+	close(wake_fds[0]);
+	if( wake_fds[1] != wake_fds[0] )
+		close(wake_fds[1]);
+
+	zmq_ctx_term(zmq_ctx);
+	return 0;
+}
@@ -0,0 +1,292 @@
+#include "udptransport.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+
+// Format an address the way we identify peers by
+static std::string format_ident( const sockaddr_storage * addr ) {
+    char host[INET6_ADDRSTRLEN];
+    unsigned short port;
+    if( addr->ss_family == AF_INET6 ) {
+        const sockaddr_in6 * a6 = (const sockaddr_in6 *)addr;
+        port = ntohs(a6->sin6_port);
+
+        // IPv4 peers show up on our dual-stack socket as ::ffff:a.b.c.d; call them what they are
+        if( IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr) ) {
+            inet_ntop(AF_INET, &a6->sin6_addr.s6_addr[12], host, sizeof(host));
+            return std::string(host) + ":" + std::to_string(port);
+        }
+        inet_ntop(AF_INET6, &a6->sin6_addr, host, sizeof(host));
+        return "[" + std::string(host) + "]:" + std::to_string(port);
+    }
+    const sockaddr_in * a4 = (const sockaddr_in *)addr;
+    port = ntohs(a4->sin_port);
+    inet_ntop(AF_INET, &a4->sin_addr, host, sizeof(host));
+    return std::string(host) + ":" + std::to_string(port);
+}
+
+// Look up "host:port" or "[host]:port", as an IPv6 address (IPv4 ones get mapped) since that's what our socket
+// speaks, unless family says otherwise
+static bool lookup( const std::string & addr, int flags, sockaddr_storage * out, socklen_t * out_len, int family = AF_INET6 ) {
+    size_t colon = addr.rfind(':');
+    if( colon == std::string::npos || colon == 0 )
+        return false;
+    std::string host = addr.substr(0, colon);
+    std::string port = addr.substr(colon + 1);
+    if( host[0] == '[' && host[host.size()-1] == ']' )
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints, * res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = family == AF_INET6 ? flags | AI_V4MAPPED : flags;
+    if( getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || res == NULL )
+        return false;
+    memcpy(out, res->ai_addr, res->ai_addrlen);
+    *out_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+UDPTransport::UDPTransport( unsigned short port ) {
+    this->port = port;
+    this->group_fd = -1;
+    this->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if( this->fd < 0 ) {
+        fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+        throw "Error: Could not create UDP socket!";
+    }
+
+    // Take IPv4 peers as well
+    int off = 0;
+    setsockopt(this->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(int));
+
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if( bind(this->fd, (sockaddr *)&addr, sizeof(addr)) != 0 ) {
+        fprintf(stderr, "Could not bind UDP port %d: %s\n", port, strerror(errno));
+        close(this->fd);
+        throw "Error: Could not bind UDP socket!";
+    }
+
+    this->recv_buffs = new unsigned char[UDP_BATCH*MAX_DATAGRAM_LEN];
+}
+
+UDPTransport::~UDPTransport() {
+    close(this->fd);
+    if( this->group_fd >= 0 )
+        close(this->group_fd);
+    delete[] this->recv_buffs;
+}
+
+int UDPTransport::getFd() const {
+    return this->fd;
+}
+
+int UDPTransport::getGroupFd() const {
+    return this->group_fd;
+}
+
+bool UDPTransport::joinGroup( const std::string & group ) {
+    sockaddr_storage ss;
+    socklen_t ss_len;
+    if( this->group_fd >= 0 || !lookup(group, AI_NUMERICHOST, &ss, &ss_len, AF_UNSPEC) )
+        return false;
+
+    // Everybody on this machine listening to the group has to be able to bind its port
+    this->group_fd = socket(ss.ss_family, SOCK_DGRAM, 0);
+    int on = 1;
+    setsockopt(this->group_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+#ifdef SO_REUSEPORT
+    setsockopt(this->group_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int));
+#endif
+
+    int rc;
+    if( ss.ss_family == AF_INET6 ) {
+        sockaddr_in6 any;
+        memset(&any, 0, sizeof(any));
+        any.sin6_family = AF_INET6;
+        any.sin6_addr = in6addr_any;
+        any.sin6_port = ((sockaddr_in6 *)&ss)->sin6_port;
+        rc = bind(this->group_fd, (sockaddr *)&any, sizeof(any));
+
+        ipv6_mreq mreq;
+        mreq.ipv6mr_multiaddr = ((sockaddr_in6 *)&ss)->sin6_addr;
+        mreq.ipv6mr_interface = ((sockaddr_in6 *)&ss)->sin6_scope_id;
+        if( rc == 0 )
+            rc = setsockopt(this->group_fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+    } else {
+        sockaddr_in any;
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        any.sin_port = ((sockaddr_in *)&ss)->sin_port;
+        rc = bind(this->group_fd, (sockaddr *)&any, sizeof(any));
+
+        ip_mreq mreq;
+        mreq.imr_multiaddr = ((sockaddr_in *)&ss)->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if( rc == 0 )
+            rc = setsockopt(this->group_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+    if( rc != 0 ) {
+        fprintf(stderr, "Could not join multicast group %s: %s\n", group.c_str(), strerror(errno));
+        close(this->group_fd);
+        this->group_fd = -1;
+        return false;
+    }
+
+    // If we send to the group as well, our own packets come back to us from whichever of our
+    // addresses they went out on; remember what those look like so we can ignore them
+    ifaddrs * ifaddr = NULL;
+    getifaddrs(&ifaddr);
+    for( ifaddrs * ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next ) {
+        if( ifa->ifa_addr == NULL || (ifa->ifa_addr->sa_family != AF_INET && ifa->ifa_addr->sa_family != AF_INET6) )
+            continue;
+        sockaddr_storage own;
+        memset(&own, 0, sizeof(own));
+        if( ifa->ifa_addr->sa_family == AF_INET6 ) {
+            memcpy(&own, ifa->ifa_addr, sizeof(sockaddr_in6));
+            ((sockaddr_in6 *)&own)->sin6_port = htons(this->port);
+        } else {
+            memcpy(&own, ifa->ifa_addr, sizeof(sockaddr_in));
+            ((sockaddr_in *)&own)->sin_port = htons(this->port);
+        }
+        this->own_idents.insert(format_ident(&own));
+    }
+    if( ifaddr != NULL )
+        freeifaddrs(ifaddr);
+    return true;
+}
+
+std::string UDPTransport::resolve( const std::string & addr ) {
+    sockaddr_storage ss;
+    socklen_t ss_len;
+    if( !lookup(addr, 0, &ss, &ss_len) )
+        return "";
+    return format_ident(&ss);
+}
+
+bool UDPTransport::addTarget( const std::string & ident ) {
+    for( auto& t : this->targets ) {
+        if( t.ident == ident )
+            return true;
+    }
+
+    // Identities are numeric already, so this never has to go out to DNS
+    udp_target t;
+    if( !lookup(ident, AI_NUMERICHOST, &t.addr, &t.addr_len) )
+        return false;
+    t.ident = ident;
+    this->targets.push_back(t);
+    return true;
+}
+
+void UDPTransport::removeTarget( const std::string & ident ) {
+    for( auto itty = this->targets.begin(); itty != this->targets.end(); ++itty ) {
+        if( itty->ident == ident ) {
+            this->targets.erase(itty);
+            return;
+        }
+    }
+}
+
+void UDPTransport::sendToAll( const unsigned char * data, int len ) {
+#ifdef __linux__
+    // Every message points at the same buffer, so this costs one system call per UDP_BATCH targets
+    iovec iov = {(void *)data, (size_t)len};
+    mmsghdr msgs[UDP_BATCH];
+    for( size_t start=0; start<this->targets.size(); start += UDP_BATCH ) {
+        unsigned int n = 0;
+        for( size_t i=start; i<this->targets.size() && n<UDP_BATCH; ++i, ++n ) {
+            memset(&msgs[n], 0, sizeof(mmsghdr));
+            msgs[n].msg_hdr.msg_name = &this->targets[i].addr;
+            msgs[n].msg_hdr.msg_namelen = this->targets[i].addr_len;
+            msgs[n].msg_hdr.msg_iov = &iov;
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+
+        // A target we can't reach right now just misses this one
+        unsigned int sent = 0;
+        while( sent < n ) {
+            int rc = sendmmsg(this->fd, &msgs[sent], n - sent, MSG_DONTWAIT);
+            if( rc <= 0 ) {
+                sent++;
+                continue;
+            }
+            sent += rc;
+        }
+    }
+#else
+    for( auto& t : this->targets )
+        sendto(this->fd, data, len, MSG_DONTWAIT, (sockaddr *)&t.addr, t.addr_len);
+#endif
+}
+
+bool UDPTransport::sendTo( const std::string & ident, const unsigned char * data, int len ) {
+    auto itty = this->peers.find(ident);
+    if( itty == this->peers.end() ) {
+        udp_target t;
+        if( !lookup(ident, AI_NUMERICHOST, &t.addr, &t.addr_len) )
+            return false;
+        t.ident = ident;
+        itty = this->peers.insert(std::make_pair(ident, t)).first;
+    }
+    return sendto(this->fd, data, len, MSG_DONTWAIT, (sockaddr *)&itty->second.addr, itty->second.addr_len) == len;
+}
+
+void UDPTransport::forget( const std::string & ident ) {
+    this->peers.erase(ident);
+}
+
+int UDPTransport::recvBatch( int fd, udp_datagram * out ) {
+    int num_received = 0;
+#ifdef __linux__
+    iovec iovs[UDP_BATCH];
+    mmsghdr msgs[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for( int i=0; i<UDP_BATCH; ++i ) {
+        iovs[i].iov_base = this->recv_buffs + i*MAX_DATAGRAM_LEN;
+        iovs[i].iov_len = MAX_DATAGRAM_LEN;
+        msgs[i].msg_hdr.msg_name = &this->recv_addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int rc = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    for( int i=0; i<rc; ++i ) {
+        // Too big to be one of ours
+        if( msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+            continue;
+        out[num_received].ident = format_ident(&this->recv_addrs[i]);
+        if( this->own_idents.count(out[num_received].ident) )
+            continue;
+        out[num_received].data = this->recv_buffs + i*MAX_DATAGRAM_LEN;
+        out[num_received].len = msgs[i].msg_len;
+        num_received++;
+    }
+#else
+    for( int i=0; i<UDP_BATCH; ++i ) {
+        socklen_t addr_len = sizeof(sockaddr_storage);
+        unsigned char * buff = this->recv_buffs + i*MAX_DATAGRAM_LEN;
+        int len = recvfrom(fd, buff, MAX_DATAGRAM_LEN, MSG_DONTWAIT, (sockaddr *)&this->recv_addrs[i], &addr_len);
+        if( len < 0 )
+            break;
+        out[num_received].ident = format_ident(&this->recv_addrs[i]);
+        if( this->own_idents.count(out[num_received].ident) )
+            continue;
+        out[num_received].data = buff;
+        out[num_received].len = len;
+        num_received++;
+    }
+#endif
+    return num_received;
+}
@@ -0,0 +1,92 @@
+#ifndef UDPTRANSPORT_H
+#define UDPTRANSPORT_H
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// How many datagrams we'll move in or out with a single system call
+#define UDP_BATCH               32
+
+// Room for any datagram we're willing to receive; anything bigger is dropped
+#define MAX_DATAGRAM_LEN        1500
+
+// One datagram received by recvBatch(), along with the identity of whoever sent it
+struct udp_datagram {
+    std::string ident;
+    unsigned char * data;
+    int len;
+};
+
+/*
+Sends our packets to peers as plain UDP datagrams, one packet (and so one opus frame)
+per datagram, and receives theirs.  Packets already carry their own sequence number and
+timestamp, so nothing is added on the wire; a peer is identified by the address its
+datagrams come from, formatted just like the identities of our TCP peers ("[v6]:port",
+or "v4:port").  Only the broker thread touches this, and it batches with sendmmsg() and
+recvmmsg() where they're available.
+
+A target can just as well be a multicast group, so that a source sends each packet
+once no matter how many are listening; listeners joinGroup() to hear it, on a socket
+of its own so that everybody on one machine can share the group's port.  Sources are
+still known by their own address, so a group behaves just like that many peers.
+*/
+class UDPTransport {
+public:
+    // Bind a dual-stack socket to port; throws if we can't
+    UDPTransport( unsigned short port );
+    ~UDPTransport();
+
+    // The sockets, for the broker to poll on; the group socket is -1 until we've joined one
+    int getFd() const;
+    int getGroupFd() const;
+
+    // Listen to a multicast group ("group:port", or "[v6 group]:port"), ignoring anything we send to it ourselves
+    bool joinGroup( const std::string & group );
+
+    // Turn "host:port" or "[v6 host]:port" into the identity that peer's datagrams will show up as,
+    // returning "" if it can't be resolved
+    static std::string resolve( const std::string & addr );
+
+    // Start/stop sending to a peer, given the identity resolve() gave us
+    bool addTarget( const std::string & ident );
+    void removeTarget( const std::string & ident );
+
+    // Send a packet to every target at once
+    void sendToAll( const unsigned char * data, int len );
+
+    // Send a packet to just one peer (target or not), given its identity
+    bool sendTo( const std::string & ident, const unsigned char * data, int len );
+    // Once we're done sending to them
+    void forget( const std::string & ident );
+
+    // Receive up to UDP_BATCH datagrams from fd (one of ours) without blocking, returning how
+    // many we got.  The data they point to is only good until the next call.
+    int recvBatch( int fd, udp_datagram * out );
+
+protected:
+    int fd, group_fd;
+    unsigned short port;
+
+    // How we'd show up to ourselves, were a group to loop our own packets back to us
+    std::unordered_set<std::string> own_idents;
+
+    struct udp_target {
+        std::string ident;
+        sockaddr_storage addr;
+        socklen_t addr_len;
+    };
+    std::vector<udp_target> targets;
+
+    // Everybody we've sent to with sendTo(), so we only have to work out where they are once
+    std::unordered_map<std::string, udp_target> peers;
+
+    // Where recvBatch() puts things
+    unsigned char * recv_buffs;
+    sockaddr_storage recv_addrs[UDP_BATCH];
+};
+
+#endif //UDPTRANSPORT_H
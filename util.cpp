@@ -42,6 +42,16 @@ bool is_number(const char * str) {
     return true;
 }
 
+bool is_frame_size(unsigned int num_samples) {
+    // In tenths of a millisecond, so 2.5ms comes out even
+    const unsigned int lengths[] = {25, 50, 100, 200, 400, 600};
+    for( auto length : lengths ) {
+        if( num_samples == (length*SAMPLE_RATE)/10000 )
+            return true;
+    }
+    return false;
+}
+
 
 
 // Print the level meter thingy that is so awesome and unnecessary
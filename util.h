@@ -15,6 +15,9 @@ const double time_ms();
 // Return true if the given string is only whitespace and digits
 bool is_number(const char * str);
 
+// Return true if num_samples (per channel) is as long as an opus frame can be: 2.5, 5, 10, 20, 40 or 60ms
+bool is_frame_size(unsigned int num_samples);
+
 // Print the level meter thingy that is so awesome and sooooooo unnecessary
 void print_level_meter( float * buffer );
 
@@ -0,0 +1,98 @@
+#include "workerpool.h"
+#include <stdio.h>
+
+struct worker_arg {
+    WorkerPool * pool;
+    unsigned int id;
+};
+
+WorkerPool::WorkerPool( unsigned int num_workers, unsigned int max_jobs ) {
+    this->num_workers = num_workers < 1 ? 1 : num_workers;
+    this->shutdown = false;
+    sem_init(&this->done, 0, 0);
+
+    this->queues = new worker_queue[this->num_workers];
+    for( unsigned int w=0; w<this->num_workers; ++w ) {
+        this->queues[w].next.store(0);
+        this->queues[w].count = 0;
+        this->queues[w].jobs = new pool_job *[max_jobs];
+        sem_init(&this->queues[w].start, 0, 0);
+    }
+
+    // Worker 0 is whoever calls run(), so we only need threads for the rest
+    for( unsigned int w=1; w<this->num_workers; ++w ) {
+        worker_arg * arg = new worker_arg;
+        arg->pool = this;
+        arg->id = w;
+        pthread_t thread;
+        if( pthread_create(&thread, NULL, WorkerPool::thread_main, (void *)arg) != 0 ) {
+            fprintf(stderr, "pthread_create() failed!\n");
+            throw "Error: Could not create worker thread!";
+        }
+        this->threads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    this->shutdown = true;
+    for( unsigned int w=1; w<this->num_workers; ++w )
+        sem_post(&this->queues[w].start);
+    for( auto thread : this->threads )
+        pthread_join(thread, NULL);
+
+    for( unsigned int w=0; w<this->num_workers; ++w ) {
+        delete[] this->queues[w].jobs;
+        sem_destroy(&this->queues[w].start);
+    }
+    delete[] this->queues;
+    sem_destroy(&this->done);
+}
+
+unsigned int WorkerPool::getNumWorkers() const {
+    return this->num_workers;
+}
+
+void * WorkerPool::thread_main( void * arg ) {
+    worker_arg * wa = (worker_arg *)arg;
+    WorkerPool * pool = wa->pool;
+    unsigned int id = wa->id;
+    delete wa;
+
+    while( true ) {
+        sem_wait(&pool->queues[id].start);
+        if( pool->shutdown )
+            break;
+        pool->work(id);
+        sem_post(&pool->done);
+    }
+    return NULL;
+}
+
+void WorkerPool::work( unsigned int id ) {
+    // Our own jobs first, then whatever's left over in everybody else's queue
+    for( unsigned int k=0; k<this->num_workers; ++k ) {
+        worker_queue * q = &this->queues[(id + k) % this->num_workers];
+        unsigned int i;
+        while( (i = q->next.fetch_add(1)) < q->count )
+            q->jobs[i]->fn(q->jobs[i]->arg);
+    }
+}
+
+void WorkerPool::run( pool_job * jobs, unsigned int num_jobs ) {
+    // Deal everybody's jobs out to their home queues
+    for( unsigned int w=0; w<this->num_workers; ++w ) {
+        this->queues[w].count = 0;
+        this->queues[w].next.store(0, std::memory_order_relaxed);
+    }
+    for( unsigned int j=0; j<num_jobs; ++j ) {
+        worker_queue * q = &this->queues[jobs[j].home % this->num_workers];
+        q->jobs[q->count++] = &jobs[j];
+    }
+
+    // Wake everybody up, pitch in ourselves, then wait for the stragglers
+    for( unsigned int w=1; w<this->num_workers; ++w )
+        sem_post(&this->queues[w].start);
+    this->work(0);
+    for( unsigned int w=1; w<this->num_workers; ++w )
+        sem_wait(&this->done);
+}
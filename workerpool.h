@@ -0,0 +1,54 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+#include <semaphore.h>
+#include "ringbuffer.h"
+
+// A single piece of work; fn(arg) is run exactly once, preferably by worker home % num_workers
+struct pool_job {
+    unsigned int home;
+    void (*fn)( void * arg );
+    void * arg;
+};
+
+/*
+A fixed set of worker threads that run a batch of jobs in parallel and then join.
+Each worker starts on the jobs that call it home, so that jobs touching the same
+state (e.g. the same client's decoder) keep landing on the same core; once it runs
+out, it steals whole jobs from the front of the other workers' queues.  The thread
+calling run() is worker 0, so a pool of one worker is just a plain loop.
+*/
+class WorkerPool {
+public:
+    WorkerPool( unsigned int num_workers, unsigned int max_jobs );
+    ~WorkerPool();
+
+    // Run every job in jobs, returning once they've all finished
+    void run( pool_job * jobs, unsigned int num_jobs );
+
+    unsigned int getNumWorkers() const;
+
+protected:
+    static void * thread_main( void * arg );
+    void work( unsigned int id );
+
+    // Each worker's share of the current batch; next is shared with thieves, so it gets its own cache line
+    struct worker_queue {
+        std::atomic<unsigned int> next;
+        char pad0[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+        unsigned int count;
+        pool_job ** jobs;
+        sem_t start;
+    };
+
+    unsigned int num_workers;
+    worker_queue * queues;
+    std::vector<pthread_t> threads;
+    sem_t done;
+    bool shutdown;
+};
+
+#endif //WORKERPOOL_H